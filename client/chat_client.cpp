@@ -2,6 +2,8 @@
 #include <QMessageBox>
 #include <QJsonArray>
 #include <QUrlQuery>
+#include <QNetworkReply>
+#include <QNetworkRequest>
 #include <QDebug>
 #include <QApplication>
 #include <QDateTime>
@@ -10,10 +12,12 @@
 #include <QScrollArea>
 #include <QPainter>
 #include <QTimer>
+#include <random>
 
 ChatClient::ChatClient(QWidget *parent)
     : QMainWindow(parent),
       webSocket(new QWebSocket),
+      http(new QNetworkAccessManager(this)),
       strand_(io_context_.get_executor()),
       resolver_(io_context_),
       isInitialSubscription(true)
@@ -46,6 +50,12 @@ void ChatClient::initializeWebSocket()
     connect(webSocket, &QWebSocket::textMessageReceived, this, &ChatClient::onTextMessageReceived);
     connect(webSocket, &QWebSocket::errorOccurred, this, [this](QAbstractSocket::SocketError error) {
         qDebug() << "WebSocket error:" << error << webSocket->errorString();
+        // The server answers 401 to an expired or revoked resume token; fall
+        // back to the password on the next attempt.
+        if (resumeAttempt && webSocket->errorString().contains("401")) {
+            resumeToken.clear();
+        }
+        resumeAttempt = false;
         connectionStatusLabel->setText("Chat: Error");
         connectionStatusLabel->setStyleSheet("color: red;");
         if (!isAuthenticated) {
@@ -69,6 +79,18 @@ void ChatClient::initializeVoIP()
 void ChatClient::tryReconnect()
 {
     if (webSocket->state() != QAbstractSocket::ConnectedState && isAuthenticated) {
+        if (!resumeToken.isEmpty()) {
+            qDebug() << "Resuming chat session from event" << lastEventSeq;
+            QUrlQuery query;
+            query.addQueryItem("resume", resumeToken);
+            query.addQueryItem("epoch", QString::number(eventEpoch));
+            query.addQueryItem("since", QString::number(lastEventSeq));
+            QUrl url(serverUrl);
+            url.setQuery(query);
+            resumeAttempt = true;
+            webSocket->open(url);
+            return;
+        }
         if (savedLogin.isEmpty() || savedPassword.isEmpty()) {
             qDebug() << "Reconnection impossible: login or password empty";
             showAuthScreen();
@@ -80,6 +102,7 @@ void ChatClient::tryReconnect()
         query.addQueryItem("password", savedPassword);
         QUrl url(serverUrl);
         url.setQuery(query);
+        lastEventSeq = 0;
         webSocket->open(url);
     }
 }
@@ -91,14 +114,7 @@ void ChatClient::onConnected()
     reconnectTimer->stop();
     connectionStatusLabel->setText("Chat: Connected");
     connectionStatusLabel->setStyleSheet("color: green;");
-
-    if (isAuthenticated) {
-        QJsonObject message;
-        message["topic"] = 2;
-        message["ty"] = 2;
-        sendJsonMessage(message);
-        requestFriendsList();
-    }
+    resumeAttempt = false;
 }
 
 void ChatItemDelegate::paint(QPainter *painter, const QStyleOptionViewItem &option, const QModelIndex &index) const
@@ -230,11 +246,16 @@ void ChatClient::setupUi()
     stopCallButton = new QPushButton("★", chatsTab);
     stopCallButton->setEnabled(false);
     voipStatusLabel = new QLabel("VoIP: Disconnected", chatsTab);
+    voipStatsLabel = new QLabel(chatsTab);
+    voipStatsTimer = new QTimer(this);
+    voipStatsTimer->setInterval(1000);
+    connect(voipStatsTimer, &QTimer::timeout, this, &ChatClient::updateVoipStats);
 
     QHBoxLayout *voipLayout = new QHBoxLayout();
     voipLayout->addWidget(startCallButton);
     voipLayout->addWidget(stopCallButton);
     voipLayout->addWidget(voipStatusLabel);
+    voipLayout->addWidget(voipStatsLabel);
 
     chatsLayout->addWidget(messageScroll, 3);
     chatsLayout->addLayout(messageInputLayout);
@@ -594,6 +615,7 @@ void ChatClient::onRegisterButtonClicked()
         query.addQueryItem("name", nameEdit->text());
         QUrl url(serverUrl);
         url.setQuery(query);
+        lastEventSeq = 0;
         webSocket->open(url);
     } catch (const std::exception &e) {
         QMessageBox::warning(this, "Error", e.what());
@@ -611,6 +633,7 @@ void ChatClient::onLoginButtonClicked()
         query.addQueryItem("password", savedPassword);
         QUrl url(serverUrl);
         url.setQuery(query);
+        lastEventSeq = 0;
         webSocket->open(url);
     } catch (const std::exception &e) {
         QMessageBox::warning(this, "Error", e.what());
@@ -639,11 +662,43 @@ void ChatClient::onTextMessageReceived(const QString &message)
     int topic = obj["topic"].toInt();
     qDebug() << "Received message with topic:" << topic << "full message:" << message;
 
+    // Directory and friend events are numbered; after a resume the server
+    // replays the ones we missed, so anything already seen is dropped.
+    if (topic != 7 && obj.contains("event_seq")) {
+        quint64 seq = obj["event_seq"].toVariant().toULongLong();
+        if (seq <= lastEventSeq) {
+            return;
+        }
+        lastEventSeq = seq;
+    }
+
+    // Room events carry a per-room seq; replayed ones we already have are dropped.
+    if ((topic == 3 || topic == 9) && obj.contains("seq")) {
+        int chatId = obj.contains("to") ? obj["to"].toInt(-1) : currentChatId;
+        quint64 seq = obj["seq"].toVariant().toULongLong();
+        if (seq <= roomSeq.value(chatId)) {
+            return;
+        }
+        roomSeq[chatId] = seq;
+    }
+
     switch (topic) {
     case 0:
         break;
-    case 1:
+    case 1: // Subscribe
+    {
+        if (obj["status"].toString() != "subscribed") {
+            break;
+        }
+        int chatId = obj["chat_id"].toInt(-1);
+        roomEpoch[chatId] = obj["epoch"].toVariant().toULongLong();
+        if (!obj["replayed"].toBool(false)) {
+            roomSeq[chatId] = obj["seq"].toVariant().toULongLong();
+            requestHistory(chatId);
+            qDebug() << "Запросили историю сообщений для чата с ID:" << chatId;
+        }
         break;
+    }
     case 2: // GetChatList
         updateChatList(obj["chats"].toArray());
         break;
@@ -684,11 +739,7 @@ void ChatClient::onTextMessageReceived(const QString &message)
                 currentChatId = chatId;
                 onChatSelected(item);
 
-                QJsonObject historyMessage;
-                historyMessage["topic"] = 6;
-                historyMessage["ty"] = 6;
-                historyMessage["to"] = chatId;
-                sendJsonMessage(historyMessage);
+                requestHistory(chatId);
 
                 QMessageBox::information(this, "Уведомление", QString("Чат создан: %1").arg(chatName));
             }
@@ -782,11 +833,32 @@ void ChatClient::onTextMessageReceived(const QString &message)
             break;
         }
     case 7: // GetMyId
+    {
         currentUserId = obj["user_id"].toInt();
-        showChatScreen();
+        resumeToken = obj["token"].toString();
+        eventEpoch = obj["event_epoch"].toVariant().toULongLong();
+        quint64 seq = obj["event_seq"].toVariant().toULongLong();
+        bool resumed = obj["resumed"].toBool(false);
+        bool reconnect = isAuthenticated;
+        lastEventSeq = resumed ? qMax(lastEventSeq, seq) : seq;
+        if (reconnect && resumed) {
+            // Lists are up to date from the replay; only the room subscription
+            // belongs to the old connection.
+            resubscribeCurrentChat();
+        } else {
+            showChatScreen();
+            if (reconnect) {
+                requestFriendsList();
+            }
+        }
         break;
+    }
     case 8: // DeleteAccount
     {
+        // Deletions are announced to everyone; only our own ends the session.
+        if (obj.contains("user_id") && obj["user_id"].toInt() != currentUserId) {
+            break;
+        }
         if (obj.contains("status") && obj["status"].toString() == "success") {
             QMetaObject::invokeMethod(this, [this]() {
                 webSocket->close();
@@ -798,6 +870,10 @@ void ChatClient::onTextMessageReceived(const QString &message)
                 friendRequestsList->clear();
                 savedLogin.clear();
                 savedPassword.clear();
+                resumeToken.clear();
+                lastEventSeq = 0;
+                roomEpoch.clear();
+                roomSeq.clear();
                 isAuthenticated = false;
                 showAuthScreen();
                 QMessageBox::information(this, "Успех", "Аккаунт успешно удалён");
@@ -990,6 +1066,18 @@ void ChatClient::onTextMessageReceived(const QString &message)
             QMessageBox::warning(this, "Error", obj["error"].toString());
         }
         break;
+    case 23: // VoiceToken
+        if (obj["status"].toString() == "success") {
+            if (obj["chat_id"].toInt() == currentChatId) {
+                startCall(obj["channel"].toString(), obj["token"].toString());
+            } else {
+                startCallButton->setEnabled(true);
+            }
+        } else {
+            startCallButton->setEnabled(true);
+            QMessageBox::warning(this, "Ошибка", obj["error"].toString());
+        }
+        break;
     case 18: // DeleteFriend
             {
                 if (obj.contains("error")) {
@@ -1020,6 +1108,10 @@ void ChatClient::onTextMessageReceived(const QString &message)
                 friendRequestsList->clear();
                 savedLogin.clear();
                 savedPassword.clear();
+                resumeToken.clear();
+                lastEventSeq = 0;
+                roomEpoch.clear();
+                roomSeq.clear();
                 isAuthenticated = false;
                 showAuthScreen();
                 qDebug() << "Пользователь вышел";
@@ -1207,26 +1299,106 @@ void ChatClient::onChatSelected(QListWidgetItem *item) {
         }
     }
 
-    QJsonObject subscribeMessage;
-    subscribeMessage["topic"] = 1;
-    subscribeMessage["ty"] = 1;
-    subscribeMessage["to"] = currentChatId;
-    sendJsonMessage(subscribeMessage);
+    subscribeToChat(currentChatId);
     qDebug() << "Подписались на чат с ID:" << currentChatId;
 
-    QJsonObject historyMessage;
-    historyMessage["topic"] = 6;
-    historyMessage["ty"] = 6;
-    historyMessage["to"] = currentChatId;
-    sendJsonMessage(historyMessage);
-    qDebug() << "Запросили историю сообщений для чата с ID:" << currentChatId;
-
     QSettings settings("MyApp", "ChatClient");
     settings.setValue("currentChatId", currentChatId);
     messageInput->clear();
     messageDisplay->verticalScrollBar()->setValue(messageDisplay->verticalScrollBar()->maximum());
 }
 
+void ChatClient::resubscribeCurrentChat()
+{
+    if (currentChatId == -1) {
+        return;
+    }
+    subscribeToChat(currentChatId);
+}
+
+// With a known position in the room the server replays only what we missed;
+// otherwise (or if the gap is too old) it answers replayed=false and the
+// history is loaded in the topic 1 handler.
+void ChatClient::subscribeToChat(int chatId)
+{
+    QJsonObject subscribeMessage;
+    subscribeMessage["topic"] = 1;
+    subscribeMessage["ty"] = 1;
+    subscribeMessage["to"] = chatId;
+    if (roomEpoch.contains(chatId)) {
+        subscribeMessage["epoch"] = QString::number(roomEpoch.value(chatId));
+        subscribeMessage["since"] = QString::number(roomSeq.value(chatId));
+    }
+    sendJsonMessage(subscribeMessage);
+}
+
+// История загружается по HTTP (/api/history), чтобы не занимать WebSocket;
+// без токена или при ошибке - старый запрос через WebSocket.
+void ChatClient::requestHistory(int chatId)
+{
+    if (resumeToken.isEmpty()) {
+        QJsonObject historyMessage;
+        historyMessage["topic"] = 6;
+        historyMessage["ty"] = 6;
+        historyMessage["to"] = chatId;
+        sendJsonMessage(historyMessage);
+        return;
+    }
+    requestHistoryPage(chatId, -1, QJsonArray());
+}
+
+// Страницы идут по next_before, пока он не станет null: обработчик topic 6
+// удаляет из кэша всё, чего нет в ответе, поэтому ему нужна вся история.
+void ChatClient::requestHistoryPage(int chatId, qint64 before, QJsonArray newestFirst)
+{
+    QUrl url(serverUrl);
+    url.setScheme(url.scheme() == "wss" ? "https" : "http");
+    url.setPath("/api/history");
+    QUrlQuery query;
+    query.addQueryItem("chat", QString::number(chatId));
+    if (before >= 0) {
+        query.addQueryItem("before", QString::number(before));
+    }
+    query.addQueryItem("limit", "500");
+    url.setQuery(query);
+
+    QNetworkRequest request(url);
+    request.setRawHeader("Authorization", "Bearer " + resumeToken.toUtf8());
+    QNetworkReply *reply = http->get(request);
+    connect(reply, &QNetworkReply::finished, this, [this, reply, chatId, newestFirst]() mutable {
+        reply->deleteLater();
+        if (reply->error() != QNetworkReply::NoError) {
+            qDebug() << "HTTP history failed:" << reply->errorString() << ", using WebSocket";
+            QJsonObject historyMessage;
+            historyMessage["topic"] = 6;
+            historyMessage["ty"] = 6;
+            historyMessage["to"] = chatId;
+            sendJsonMessage(historyMessage);
+            return;
+        }
+        if (chatId != currentChatId) {
+            return;
+        }
+        // Сервер отдаёт от новых к старым, обработчик topic 6 ждёт по возрастанию.
+        QJsonObject page = QJsonDocument::fromJson(reply->readAll()).object();
+        for (const auto &msg : page["messages"].toArray()) {
+            newestFirst.append(msg);
+        }
+        if (!page["next_before"].isNull() && !page["next_before"].isUndefined()) {
+            requestHistoryPage(chatId, page["next_before"].toVariant().toLongLong(), newestFirst);
+            return;
+        }
+        QJsonArray messages;
+        for (int i = newestFirst.size() - 1; i >= 0; --i) {
+            messages.append(newestFirst[i]);
+        }
+        QJsonObject obj;
+        obj["topic"] = 6;
+        obj["messages"] = messages;
+        onTextMessageReceived(QString::fromUtf8(QJsonDocument(obj).toJson(QJsonDocument::Compact)));
+    });
+}
+
 void ChatClient::onSendMessageButtonClicked() {
     QString messageText = messageInput->text().trimmed();
     if (messageText.isEmpty()) {
@@ -1714,15 +1886,18 @@ bool ChatClient::checkConnection(const QString &channel_id)
 
 }
 
-bool ChatClient::registerWithServer(const QString &channel_id)
+bool ChatClient::registerWithServer(const QString &channel_id, const QString &token)
 {
     qDebug() << "Registering with VoIP server...";
     try {
         std::string msg = "REGISTER " + channel_id.toStdString();
+        if (!token.isEmpty()) {
+            msg += " " + token.toStdString();
+        }
         socket_->send_to(boost::asio::buffer(msg), endpoint_);
 
         socket_->non_blocking(true);
-        std::array<char, 13> recv_buf;
+        std::array<char, 32> recv_buf;
         udp::endpoint sender_endpoint;
         bool registered = false;
 
@@ -1731,11 +1906,22 @@ bool ChatClient::registerWithServer(const QString &channel_id)
             boost::system::error_code ec;
             size_t bytes_recvd = socket_->receive_from(boost::asio::buffer(recv_buf), sender_endpoint, 0, ec);
             if (!ec && bytes_recvd >= 10) {
+                // "REGISTERED <id>" или "RE-REGISTERED <id>": id идёт в заголовок голосовых пакетов
                 std::string response(recv_buf.data(), bytes_recvd);
-                if (response.substr(0, 10) == "REGISTERED" || response.substr(0, 13) == "RE-REGISTERED") {
+                size_t space = response.find(' ');
+                if (space != std::string::npos &&
+                    (response.compare(0, space, "REGISTERED") == 0 || response.compare(0, space, "RE-REGISTERED") == 0)) {
+                    voice_header_ = VoiceHeader();
+                    voice_header_.channel = static_cast<std::uint32_t>(std::strtoul(response.c_str() + space + 1, nullptr, 10));
+                    voice_header_.ssrc = std::random_device()();
                     registered = true;
                     break;
                 }
+                if (response.compare(0, 6, "ERROR:") == 0) {
+                    // ERROR:UNAUTHORIZED - токен просрочен или не для этого канала
+                    qDebug() << "VoIP registration rejected:" << response.c_str();
+                    break;
+                }
             }
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
         }
@@ -1842,28 +2028,8 @@ int ChatClient::portAudioCallback(const void *inputBuffer, void *outputBuffer,
         }
     }
 
-    {
-        std::unique_lock<std::mutex> lock(client->playback_mutex_);
-        client->playback_cv_.wait_for(lock, std::chrono::milliseconds(10),
-                                     [client]() { return !client->playbackQueue_.empty() || !client->running_; });
-
-        int16_t *output = static_cast<int16_t *>(outputBuffer);
-
-        if (!client->playbackQueue_.empty()) {
-            std::vector<int16_t> &playbackData = client->playbackQueue_.front();
-            size_t copySize = std::min(playbackData.size(), static_cast<size_t>(framesPerBuffer));
-            std::copy(playbackData.begin(), playbackData.begin() + copySize, output);
-
-            if (copySize < framesPerBuffer) {
-                std::fill(output + copySize, output + framesPerBuffer, 0);
-                client->playbackQueue_.pop();
-            } else if (copySize == framesPerBuffer) {
-                client->playbackQueue_.pop();
-            }
-        } else {
-            std::fill_n(output, framesPerBuffer, 0);
-        }
-    }
+    // Один кадр от каждого говорящего, сумма с насыщением; без ожидания в callback
+    client->playout_.render(static_cast<int16_t *>(outputBuffer), framesPerBuffer);
 
     return client->running_ ? paContinue : paComplete;
 }
@@ -1900,21 +2066,18 @@ void ChatClient::sendAudio()
         }
 
         if (!audioData.empty()) {
-            std::string channel_header = "AUDIO " + channel_id_.toStdString() + " ";
-            std::vector<char> packet;
-            packet.insert(packet.end(), channel_header.begin(), channel_header.end());
-            packet.insert(packet.end(),
-                          reinterpret_cast<char *>(audioData.data()),
-                          reinterpret_cast<char *>(audioData.data() + audioData.size()));
-
-            socket_->async_send_to(
-                boost::asio::buffer(packet), endpoint_,
-                boost::asio::bind_executor(strand_,
-                    [this](const boost::system::error_code &error, std::size_t) {
-                        if (error) {
-                            qDebug() << "Send error:" << error.message().c_str();
-                        }
-                    }));
+            std::vector<char> packet(VOICE_HEADER_SIZE + audioData.size() * sizeof(int16_t));
+            writeVoiceHeader(packet.data(), voice_header_);
+            std::memcpy(packet.data() + VOICE_HEADER_SIZE, audioData.data(), audioData.size() * sizeof(int16_t));
+            ++voice_header_.sequence;
+            voice_header_.timestamp += static_cast<std::uint32_t>(audioData.size());
+
+            // Синхронно: packet живёт только до конца итерации
+            boost::system::error_code error;
+            socket_->send_to(boost::asio::buffer(packet), endpoint_, 0, error);
+            if (error) {
+                qDebug() << "Send error:" << error.message().c_str();
+            }
         }
     }
 }
@@ -1943,32 +2106,14 @@ void ChatClient::startReceive()
 
 void ChatClient::handleReceive(std::size_t bytes_recvd)
 {
-    std::string header(buffer_.data(), 6);
-    if (header == "AUDIO ") {
-        size_t channel_end = std::find(buffer_.data() + 6, buffer_.data() + bytes_recvd, ' ') - buffer_.data();
-        if (channel_end >= bytes_recvd)
-            return;
-
-        size_t audio_start = channel_end + 1;
-        size_t audio_size = bytes_recvd - audio_start;
-
-        if (audio_size % sizeof(int16_t) != 0) {
+    if (isVoicePacket(buffer_.data(), bytes_recvd)) {
+        if ((bytes_recvd - VOICE_HEADER_SIZE) % sizeof(int16_t) != 0) {
             qDebug() << "Received incomplete audio sample";
             return;
         }
-
-        std::vector<int16_t> audioData(audio_size / sizeof(int16_t));
-        std::memcpy(audioData.data(), buffer_.data() + audio_start, audio_size);
-
-        {
-            std::unique_lock<std::mutex> lock(playback_mutex_);
-            if (playbackQueue_.size() < 100) {
-                playbackQueue_.push(std::move(audioData));
-                lock.unlock();
-                playback_cv_.notify_one();
-            }
-        }
-    } else if (std::string(buffer_.data(), 4) == "PONG") {
+        // Источник - SSRC: у каждого свой буфер с упорядочиванием по номеру пакета
+        playout_.push(buffer_.data(), bytes_recvd);
+    } else if (bytes_recvd >= 4 && std::string(buffer_.data(), 4) == "PONG") {
         return;
     }
 }
@@ -1984,17 +2129,28 @@ void ChatClient::onStartCallButtonClicked()
         QMessageBox::warning(this, "Ошибка", "Этот чат не является голосовым");
         return;
     }
+    // Канал и токен допуска выдаёт сервер чата (topic 23), звонок начинается в startCall()
+    QJsonObject message;
+    message["ty"] = 23;
+    message["chat_id"] = currentChatId;
+    sendJsonMessage(message);
+    startCallButton->setEnabled(false);
+}
+
+void ChatClient::startCall(const QString &channel_id, const QString &token)
+{
     if (running_) {
         stop();
     }
-    channel_id_ = QString("voice_chat_%1").arg(currentChatId);
+    channel_id_ = channel_id;
     running_ = true;
-    if (!checkConnection(channel_id_) || !registerWithServer(channel_id_)) {
+    if (!checkConnection(channel_id_) || !registerWithServer(channel_id_, token)) {
         qDebug() << "Не удалось подключиться к VoIP-серверу";
         running_ = false;
         voipStatusLabel->setText("VoIP: Disconnected");
         voipStatusLabel->setStyleSheet("color: red;");
         QMessageBox::critical(this, "Ошибка", "Не удалось подключиться к VoIP-серверу");
+        startCallButton->setEnabled(true);
         return;
     }
     try {
@@ -2009,6 +2165,7 @@ void ChatClient::onStartCallButtonClicked()
         });
         startCallButton->setEnabled(false);
         stopCallButton->setEnabled(true);
+        voipStatsTimer->start();
         qDebug() << "Голосовой звонок начат для канала:" << channel_id_;
     } catch (const std::exception &e) {
         qDebug() << "Ошибка запуска VoIP:" << e.what();
@@ -2019,6 +2176,19 @@ void ChatClient::onStartCallButtonClicked()
     }
 }
 
+void ChatClient::updateVoipStats()
+{
+    PlayoutStats s = playout_.stats();
+    voipStatsLabel->setText(QString("Говорят: %1, буфер: %2/%3 кадр., джиттер: %4 мс, опоздали: %5, восстановлено: %6, отброшено: %7")
+        .arg(s.sources)
+        .arg(s.depth)
+        .arg(s.target_depth)
+        .arg(s.jitter_ms, 0, 'f', 1)
+        .arg(s.late)
+        .arg(s.concealed)
+        .arg(s.dropped));
+}
+
 void ChatClient::onStopCallButtonClicked()
 {
     stop();
@@ -2041,7 +2211,8 @@ void ChatClient::stop()
     }
 
     audio_cv_.notify_all();
-    playback_cv_.notify_all();
+    voipStatsTimer->stop();
+    voipStatsLabel->clear();
 
     io_context_.stop();
 
@@ -2060,11 +2231,7 @@ void ChatClient::stop()
         std::queue<std::vector<int16_t>> empty;
         std::swap(audioQueue_, empty);
     }
-    {
-        std::lock_guard<std::mutex> lock(playback_mutex_);
-        std::queue<std::vector<int16_t>> empty;
-        std::swap(playbackQueue_, empty);
-    }
+    playout_.clear();
 
     terminatePortAudio();
     io_context_.restart();
@@ -3,6 +3,7 @@
 
 #include <QMainWindow>
 #include <QWebSocket>
+#include <QNetworkAccessManager>
 #include <QJsonObject>
 #include <QJsonDocument>
 #include <QListWidget>
@@ -18,6 +19,8 @@
 #include <QInputDialog>
 #include <boost/asio.hpp>
 #include <portaudio.h>
+#include "voice_packet.hpp"
+#include "voice_playout.hpp"
 #include <queue>
 #include <mutex>
 #include <condition_variable>
@@ -81,10 +84,15 @@ private:
     void sendSearchUsersRequest(const QString &searchTerm);
     void onSearchResultReceived(const QJsonArray &users);
     void requestFriendsList();
+    void resubscribeCurrentChat();
+    void subscribeToChat(int chatId);
+    void requestHistory(int chatId);
+    void requestHistoryPage(int chatId, qint64 before, QJsonArray newestFirst);
     void onFriendsListReceived(const QJsonArray &friends);
     void onFriendRequestsReceived(const QJsonArray &requests);
     bool checkConnection(const QString &channel_id);
-    bool registerWithServer(const QString &channel_id);
+    bool registerWithServer(const QString &channel_id, const QString &token);
+    void startCall(const QString &channel_id, const QString &token);
     void initPortAudio();
     void terminatePortAudio();
     static int portAudioCallback(const void *inputBuffer, void *outputBuffer,
@@ -97,10 +105,12 @@ private:
     void receive();
     void startReceive();
     void handleReceive(std::size_t bytes_recvd);
+    void updateVoipStats();
     void stop();
 
     // Поля класса
     QWebSocket *webSocket;
+    QNetworkAccessManager *http;
     boost::asio::io_context io_context_;
     boost::asio::strand<boost::asio::io_context::executor_type> strand_;
     udp::resolver resolver_; 
@@ -108,12 +118,18 @@ private:
     QMap<int, QString> lastMessages;
     QMap<int, QSet<int>> displayedMessageIds;
     QMap<int, QList<QJsonObject>> chatMessages;
+    QMap<int, quint64> roomEpoch;
+    QMap<int, quint64> roomSeq;
     QTimer *reconnectTimer;
     QString serverUrl = "ws://127.0.0.1:8080";
     bool isConnected = false;
     bool isAuthenticated = false;
     QString savedLogin;
     QString savedPassword;
+    QString resumeToken;
+    quint64 eventEpoch = 0;
+    quint64 lastEventSeq = 0;
+    bool resumeAttempt = false;
     int currentChatId = -1;
     int currentUserId = -1;
     int lastProcessedChatId = -1;
@@ -152,6 +168,8 @@ private:
     QPushButton *startCallButton;
     QPushButton *stopCallButton;
     QLabel *voipStatusLabel;
+    QLabel *voipStatsLabel;
+    QTimer *voipStatsTimer;
     QPushButton *updateAccountButton; 
     QPushButton *deleteVoiceChatButton;
 
@@ -163,16 +181,15 @@ private:
     std::array<char, 65536> buffer_;
     PaStream *stream_ = nullptr;
     QString channel_id_;
+    VoiceHeader voice_header_;  // канал и SSRC из регистрации, seq/timestamp растут в sendAudio
     std::atomic<bool> running_ = false;
     std::thread send_thread_;
     std::thread receive_thread_;
     std::thread keepalive_thread_;
     std::mutex audio_mutex_;
-    std::mutex playback_mutex_;
     std::condition_variable audio_cv_;
-    std::condition_variable playback_cv_;
     std::queue<std::vector<int16_t>> audioQueue_;
-    std::queue<std::vector<int16_t>> playbackQueue_;
+    VoicePlayout playout_;  // буфер джиттера на каждый SSRC, микшируется в portAudioCallback
 };
 
 class ChatItemDelegate : public QStyledItemDelegate
@@ -1,14 +1,19 @@
-QT += core gui websockets
+QT += core gui websockets network
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++17
 
 HEADERS += \
-    chat_client.hpp
+    chat_client.hpp \
+    voice_playout.hpp
 
 SOURCES += \
     chat_client.cpp \
-    main.cpp
+    main.cpp \
+    voice_playout.cpp
+
+# Общий с сервером формат голосовых пакетов (server2/voice_packet.hpp)
+INCLUDEPATH += ../server2
 
 # Boost
 INCLUDEPATH += /mingw64/include
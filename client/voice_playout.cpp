@@ -0,0 +1,189 @@
+#include "voice_playout.hpp"
+#include "voice_packet.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void SourceJitterBuffer::push(std::uint16_t sequence, std::uint32_t timestamp, const char *pcm, std::size_t samples,
+                              std::chrono::steady_clock::time_point arrival, PlayoutStats &counters)
+{
+    idle_ = 0;
+    samples = std::min(samples, PLAYOUT_FRAME_SAMPLES);
+
+    // D = разница интервалов прихода и отправки, в отсчётах
+    double const arrived = std::chrono::duration<double>(arrival.time_since_epoch()).count() * PLAYOUT_SAMPLE_RATE;
+    if (have_arrival_) {
+        double const d = (arrived - last_arrival_) - static_cast<std::int32_t>(timestamp - last_timestamp_);
+        jitter_ += (std::fabs(d) - jitter_) / 16;
+    }
+    have_arrival_ = true;
+    last_arrival_ = arrived;
+    last_timestamp_ = timestamp;
+
+    if (!started_) {
+        next_ = sequence;
+        started_ = true;
+    }
+    auto const ahead = static_cast<std::int16_t>(sequence - next_);
+    if (ahead < 0) {
+        ++counters.late;
+        return;
+    }
+    if (static_cast<std::size_t>(ahead) >= PLAYOUT_SLOTS) {
+        // Разрыв больше окна: начинаем заново с этого кадра
+        reset(counters);
+        next_ = sequence;
+        started_ = true;
+    }
+
+    Slot &slot = slots_[sequence % PLAYOUT_SLOTS];
+    if (slot.full) {
+        ++counters.dropped;
+        return;
+    }
+    slot.full = true;
+    slot.sequence = sequence;
+    slot.samples = samples;
+    std::memcpy(slot.pcm.data(), pcm, samples * sizeof(std::int16_t));
+    ++buffered_;
+}
+
+bool SourceJitterBuffer::pop(std::int32_t *mix, std::size_t samples, PlayoutStats &counters)
+{
+    ++idle_;
+    std::size_t const target = targetDepth();
+    if (!playing_) {
+        if (buffered_ < target) {
+            return false;
+        }
+        playing_ = true;
+    }
+    // Джиттер спал, а задержка осталась: выбрасываем кадр, чтобы догнать
+    if (buffered_ > target + 2) {
+        Slot &stale = slots_[next_ % PLAYOUT_SLOTS];
+        if (stale.full) {
+            stale.full = false;
+            --buffered_;
+            ++counters.dropped;
+        }
+        ++next_;
+    }
+
+    Slot &slot = slots_[next_ % PLAYOUT_SLOTS];
+    ++next_;
+    if (slot.full) {
+        slot.full = false;
+        --buffered_;
+        last_ = slot.pcm;
+        last_samples_ = slot.samples;
+        lost_run_ = 0;
+        std::size_t const n = std::min(samples, slot.samples);
+        for (std::size_t i = 0; i < n; ++i) {
+            mix[i] += slot.pcm[i];
+        }
+        ++counters.played;
+        return true;
+    }
+
+    // Кадр потерян или опаздывает: повтор последнего, каждый раз тише
+    if (lost_run_ < PLAYOUT_PLC_FRAMES && last_samples_ > 0) {
+        ++lost_run_;
+        std::int32_t const gain = static_cast<std::int32_t>(PLAYOUT_PLC_FRAMES + 1 - lost_run_);
+        std::size_t const n = std::min(samples, last_samples_);
+        for (std::size_t i = 0; i < n; ++i) {
+            mix[i] += last_[i] * gain / static_cast<std::int32_t>(PLAYOUT_PLC_FRAMES + 1);
+        }
+        ++counters.concealed;
+        return true;
+    }
+    if (buffered_ == 0) {
+        // Конец фразы: следующую снова набираем до целевой глубины
+        started_ = false;
+        playing_ = false;
+        last_samples_ = 0;
+        lost_run_ = 0;
+    }
+    return false;
+}
+
+std::size_t SourceJitterBuffer::targetDepth() const
+{
+    // Запас в три джиттера сверх минимума
+    auto const extra = static_cast<std::size_t>(std::ceil(3 * jitter_ / PLAYOUT_FRAME_SAMPLES));
+    return std::min(PLAYOUT_MAX_DEPTH, PLAYOUT_MIN_DEPTH + extra);
+}
+
+double SourceJitterBuffer::jitterMs() const
+{
+    return jitter_ * 1000 / PLAYOUT_SAMPLE_RATE;
+}
+
+void SourceJitterBuffer::reset(PlayoutStats &counters)
+{
+    for (auto &slot : slots_) {
+        if (slot.full) {
+            slot.full = false;
+            ++counters.dropped;
+        }
+    }
+    buffered_ = 0;
+    started_ = false;
+    playing_ = false;
+}
+
+VoicePlayout::VoicePlayout()
+    : mix_(PLAYOUT_FRAME_SAMPLES)
+{
+}
+
+void VoicePlayout::push(const char *packet, std::size_t size)
+{
+    if (!isVoicePacket(packet, size) || (size - VOICE_HEADER_SIZE) % sizeof(std::int16_t) != 0) {
+        return;
+    }
+    VoiceHeader const h = readVoiceHeader(packet);
+    auto const now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    sources_[h.ssrc].push(h.sequence, h.timestamp, packet + VOICE_HEADER_SIZE,
+                          (size - VOICE_HEADER_SIZE) / sizeof(std::int16_t), now, counters_);
+}
+
+void VoicePlayout::render(std::int16_t *out, std::size_t frames)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (mix_.size() < frames) {
+        mix_.resize(frames);
+    }
+    std::fill_n(mix_.begin(), frames, 0);
+    for (auto it = sources_.begin(); it != sources_.end();) {
+        it->second.pop(mix_.data(), frames, counters_);
+        if (it->second.idle() >= PLAYOUT_IDLE_FRAMES) {
+            it = sources_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (std::size_t i = 0; i < frames; ++i) {
+        out[i] = static_cast<std::int16_t>(std::min<std::int32_t>(32767, std::max<std::int32_t>(-32768, mix_[i])));
+    }
+}
+
+void VoicePlayout::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    sources_.clear();
+    counters_ = PlayoutStats();
+}
+
+PlayoutStats VoicePlayout::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    PlayoutStats s = counters_;
+    s.sources = sources_.size();
+    for (const auto &source : sources_) {
+        s.depth = std::max(s.depth, source.second.depth());
+        s.target_depth = std::max(s.target_depth, source.second.targetDepth());
+        s.jitter_ms = std::max(s.jitter_ms, source.second.jitterMs());
+    }
+    return s;
+}
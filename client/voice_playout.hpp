@@ -0,0 +1,95 @@
+#ifndef VOICE_PLAYOUT_HPP
+#define VOICE_PLAYOUT_HPP
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// Формат совпадает с захватом: моно 16 бит, 44.1 кГц, кадры по 1024 отсчёта
+const std::size_t PLAYOUT_SAMPLE_RATE = 44100;
+const std::size_t PLAYOUT_FRAME_SAMPLES = 1024;
+const std::size_t PLAYOUT_SLOTS = 16;          // окно переупорядочивания, ~370 мс
+const std::size_t PLAYOUT_MIN_DEPTH = 2;       // кадров до начала воспроизведения
+const std::size_t PLAYOUT_MAX_DEPTH = 8;
+const unsigned PLAYOUT_PLC_FRAMES = 3;         // потерянных кадров подряд маскируется, дальше тишина
+const unsigned PLAYOUT_IDLE_FRAMES = 100;      // ~2.3 с без пакетов - источник удаляется
+
+struct PlayoutStats {
+    std::size_t sources = 0;
+    std::size_t depth = 0;          // кадров в буфере, максимум по источникам
+    std::size_t target_depth = 0;   // целевая глубина, максимум по источникам
+    double jitter_ms = 0;           // оценка джиттера (RFC 3550), максимум по источникам
+    std::uint64_t played = 0;       // кадров воспроизведено
+    std::uint64_t late = 0;         // пришли после своего времени воспроизведения
+    std::uint64_t concealed = 0;    // кадров восстановлено PLC
+    std::uint64_t dropped = 0;      // повторы и сброшенные при переполнении
+};
+
+// Буфер одного источника (SSRC): упорядочивает кадры по номеру и отдаёт по
+// одному на каждый вызов PortAudio. Глубина подстраивается под джиттер
+// прихода пакетов. Пропущенный кадр заменяется повтором последнего с
+// затуханием, после PLAYOUT_PLC_FRAMES подряд - тишина до следующего пакета.
+class SourceJitterBuffer {
+public:
+    void push(std::uint16_t sequence, std::uint32_t timestamp, const char *pcm, std::size_t samples,
+              std::chrono::steady_clock::time_point arrival, PlayoutStats &counters);
+    // Добавляет следующий кадр к mix; false, если источнику нечего играть.
+    bool pop(std::int32_t *mix, std::size_t samples, PlayoutStats &counters);
+
+    unsigned idle() const { return idle_; }
+    std::size_t depth() const { return buffered_; }
+    std::size_t targetDepth() const;
+    double jitterMs() const;
+
+private:
+    struct Slot {
+        bool full = false;
+        std::uint16_t sequence = 0;
+        std::size_t samples = 0;
+        std::array<std::int16_t, PLAYOUT_FRAME_SAMPLES> pcm;
+    };
+
+    void reset(PlayoutStats &counters);
+
+    std::array<Slot, PLAYOUT_SLOTS> slots_;
+    std::size_t buffered_ = 0;
+    std::uint16_t next_ = 0;
+    bool started_ = false;
+    bool playing_ = false;
+
+    std::array<std::int16_t, PLAYOUT_FRAME_SAMPLES> last_{};
+    std::size_t last_samples_ = 0;
+    unsigned lost_run_ = 0;
+    unsigned idle_ = 0;
+
+    // Межпакетный джиттер в отсчётах (RFC 3550): J += (|D| - J) / 16
+    bool have_arrival_ = false;
+    double last_arrival_ = 0;
+    std::uint32_t last_timestamp_ = 0;
+    double jitter_ = 0;
+};
+
+// Все источники звонка. push() вызывается из потока приёма, render() - из
+// callback PortAudio, stats() - из GUI.
+class VoicePlayout {
+public:
+    VoicePlayout();
+
+    void push(const char *packet, std::size_t size);
+    // Сумма всех источников с насыщением в out.
+    void render(std::int16_t *out, std::size_t frames);
+    void clear();
+    PlayoutStats stats() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::uint32_t, SourceJitterBuffer> sources_;
+    std::vector<std::int32_t> mix_;
+    PlayoutStats counters_;
+};
+
+#endif // VOICE_PLAYOUT_HPP
@@ -0,0 +1,333 @@
+#include "auth.hpp"
+#include "chat_metrics.hpp"
+#include "logger.hpp"
+#include "util.hpp"
+#include <cryptopp/hex.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/misc.h>
+#include <cryptopp/osrng.h>
+#include <cryptopp/scrypt.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+// N = 2^14, r = 8: 16 MiB and a few tens of milliseconds per hash, which is
+// why hashing only happens on the bounded worker_pool.
+static unsigned const scrypt_log_n = 14;
+static unsigned const scrypt_r = 8;
+static unsigned const scrypt_p = 1;
+static std::size_t const salt_size = 16;
+static std::size_t const key_size = 32;
+
+static std::string
+base64_encode(CryptoPP::byte const* data, std::size_t size)
+{
+    std::string out;
+    CryptoPP::StringSource(data, size, true,
+        new CryptoPP::Base64Encoder(new CryptoPP::StringSink(out), false));
+    return out;
+}
+
+static std::string
+base64_decode(std::string const& in)
+{
+    std::string out;
+    CryptoPP::StringSource(in, true,
+        new CryptoPP::Base64Decoder(new CryptoPP::StringSink(out)));
+    return out;
+}
+
+static std::string
+derive(std::string const& password, std::string const& salt, unsigned log_n, unsigned r, unsigned p)
+{
+    std::string key(key_size, '\0');
+    CryptoPP::Scrypt scrypt;
+    scrypt.DeriveKey(
+        reinterpret_cast<CryptoPP::byte*>(&key[0]), key.size(),
+        reinterpret_cast<CryptoPP::byte const*>(password.data()), password.size(),
+        reinterpret_cast<CryptoPP::byte const*>(salt.data()), salt.size(),
+        CryptoPP::word64(1) << log_n, r, p);
+    return key;
+}
+
+static bool
+equal(std::string const& a, std::string const& b)
+{
+    return a.size() == b.size() &&
+        CryptoPP::VerifyBufsEqual(
+            reinterpret_cast<CryptoPP::byte const*>(a.data()),
+            reinterpret_cast<CryptoPP::byte const*>(b.data()),
+            a.size());
+}
+
+std::string
+hash_password(std::string const& password)
+{
+    CryptoPP::byte salt[salt_size];
+    CryptoPP::AutoSeededRandomPool rng;
+    rng.GenerateBlock(salt, sizeof(salt));
+    std::string const key = derive(password,
+        std::string(reinterpret_cast<char const*>(salt), sizeof(salt)),
+        scrypt_log_n, scrypt_r, scrypt_p);
+
+    return "scrypt$" + std::to_string(scrypt_log_n) + "$" + std::to_string(scrypt_r) + "$" +
+        std::to_string(scrypt_p) + "$" + base64_encode(salt, sizeof(salt)) + "$" +
+        base64_encode(reinterpret_cast<CryptoPP::byte const*>(key.data()), key.size());
+}
+
+bool
+verify_password(std::string const& password, std::string const& stored, bool& needs_rehash)
+{
+    needs_rehash = false;
+    if (stored.compare(0, 7, "scrypt$") != 0) {
+        needs_rehash = true;
+        return equal(SHA256HashString(password), stored);
+    }
+
+    std::vector<std::string> parts;
+    boost::split(parts, stored, boost::is_any_of("$"));
+    if (parts.size() != 6)
+        return false;
+    unsigned const log_n = std::strtoul(parts[1].c_str(), nullptr, 10);
+    unsigned const r = std::strtoul(parts[2].c_str(), nullptr, 10);
+    unsigned const p = std::strtoul(parts[3].c_str(), nullptr, 10);
+    if (log_n == 0 || log_n > 20 || r == 0 || r > 32 || p == 0 || p > 16)
+        return false;
+
+    bool const ok = equal(derive(password, base64_decode(parts[4]), log_n, r, p), base64_decode(parts[5]));
+    needs_rehash = ok && (log_n != scrypt_log_n || r != scrypt_r || p != scrypt_p);
+    return ok;
+}
+
+boost::optional<int>
+validate_auth(sqlite3* db, std::string const& login, std::string const& password)
+{
+    sqlite3_stmt* stmt = nullptr;
+    metrics::scoped_timer timer(chat_metrics::sqlite_latency(chat_metrics::statement::login));
+    if (sqlite3_prepare_v2(db, "SELECT id, pass FROM Users WHERE login=?", -1, &stmt, nullptr) != SQLITE_OK) {
+        CHAT_LOG(error, "SQL prepare error (auth)", {{ "error", sqlite3_errmsg(db) }});
+        sqlite3_finalize(stmt);
+        return boost::none;
+    }
+    sqlite3_bind_text(stmt, 1, login.c_str(), -1, SQLITE_TRANSIENT);
+
+    boost::optional<int> id;
+    bool needs_rehash = false;
+    int const rc = sqlite3_step(stmt);
+    timer.stop();
+    if (rc == SQLITE_ROW) {
+        auto const pass = reinterpret_cast<char const*>(sqlite3_column_text(stmt, 1));
+        if (pass && verify_password(password, pass, needs_rehash))
+            id = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if (id && needs_rehash) {
+        std::string const hashed = hash_password(password);
+        if (sqlite3_prepare_v2(db, "UPDATE Users SET pass=? WHERE id=?", -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, hashed.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 2, *id);
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                CHAT_LOG(error, "Unable to upgrade password hash", {{ "error", sqlite3_errmsg(db) }});
+        }
+        sqlite3_finalize(stmt);
+    }
+    return id;
+}
+
+boost::optional<std::pair<int, std::string>>
+register_user(sqlite3* db, std::string const& login, std::string const& password, std::string const& name)
+{
+    std::string const hashed = hash_password(password);
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "INSERT INTO Users(login,pass,name) VALUES(?,?,?)", -1, &stmt, nullptr) != SQLITE_OK) {
+        CHAT_LOG(error, "SQL prepare error (register)", {{ "error", sqlite3_errmsg(db) }});
+        sqlite3_finalize(stmt);
+        return boost::none;
+    }
+    sqlite3_bind_text(stmt, 1, login.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, hashed.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, name.c_str(), -1, SQLITE_TRANSIENT);
+
+    boost::optional<std::pair<int, std::string>> ans;
+    if (sqlite3_step(stmt) == SQLITE_DONE)
+        ans = std::make_pair(static_cast<int>(sqlite3_last_insert_rowid(db)), name);
+    sqlite3_finalize(stmt);
+    return ans;
+}
+
+static std::string token_secret;
+static std::int64_t token_ttl = 24 * 60 * 60;
+static std::mutex revoked_mutex;
+static std::unordered_map<std::uint32_t, std::int64_t> revoked;
+static std::atomic<std::int64_t> last_stamp{ 0 };
+
+static std::int64_t
+unix_now()
+{
+    return static_cast<std::int64_t>(std::time(nullptr));
+}
+
+// Wall-clock microseconds, strictly increasing across calls: a token issued
+// right after a revocation always gets a later stamp than the revocation.
+static std::int64_t
+next_stamp()
+{
+    std::int64_t const now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::int64_t last = last_stamp.load(std::memory_order_relaxed);
+    std::int64_t next;
+    do {
+        next = std::max(now, last + 1);
+    } while (!last_stamp.compare_exchange_weak(last, next, std::memory_order_relaxed));
+    return next;
+}
+
+static std::string
+sign(std::string const& secret, std::string const& payload)
+{
+    CryptoPP::byte mac[CryptoPP::HMAC<CryptoPP::SHA256>::DIGESTSIZE];
+    CryptoPP::HMAC<CryptoPP::SHA256> hmac(
+        reinterpret_cast<CryptoPP::byte const*>(secret.data()), secret.size());
+    hmac.CalculateDigest(mac, reinterpret_cast<CryptoPP::byte const*>(payload.data()), payload.size());
+
+    std::string out;
+    CryptoPP::StringSource(mac, sizeof(mac), true,
+        new CryptoPP::HexEncoder(new CryptoPP::StringSink(out), false));
+    return out;
+}
+
+void
+init_resume_tokens()
+{
+    std::string secret;
+    if (char const* env = std::getenv("CHAT_TOKEN_SECRET"); env && *env) {
+        secret = env;
+    }
+    else {
+        std::cerr << "CHAT_TOKEN_SECRET is not set, resume tokens will not survive a restart" << std::endl;
+        CryptoPP::byte random[32];
+        CryptoPP::AutoSeededRandomPool rng;
+        rng.GenerateBlock(random, sizeof(random));
+        secret.assign(reinterpret_cast<char const*>(random), sizeof(random));
+    }
+    token_secret = std::move(secret);
+    token_ttl = getenv_or("CHAT_TOKEN_TTL", static_cast<int>(token_ttl));
+}
+
+std::string
+issue_resume_token(std::uint32_t user_id)
+{
+    std::string const payload = std::to_string(user_id) + "." + std::to_string(next_stamp()) + "." +
+        std::to_string(unix_now() + token_ttl);
+    return payload + "." + sign(token_secret, payload);
+}
+
+boost::optional<std::uint32_t>
+verify_resume_token(std::string const& token)
+{
+    auto const dot = token.rfind('.');
+    if (dot == std::string::npos || token_secret.empty())
+        return boost::none;
+    std::string const payload = token.substr(0, dot);
+    if (!equal(sign(token_secret, payload), token.substr(dot + 1)))
+        return boost::none;
+
+    char* end = nullptr;
+    unsigned long const user_id = std::strtoul(payload.c_str(), &end, 10);
+    if (*end != '.')
+        return boost::none;
+    std::int64_t const issued = std::strtoll(end + 1, &end, 10);
+    if (*end != '.')
+        return boost::none;
+    std::int64_t const expiry = std::strtoll(end + 1, nullptr, 10);
+    if (expiry < unix_now())
+        return boost::none;
+
+    std::lock_guard<std::mutex> lock(revoked_mutex);
+    auto it = revoked.find(static_cast<std::uint32_t>(user_id));
+    if (it != revoked.end() && issued < it->second)
+        return boost::none;
+    return static_cast<std::uint32_t>(user_id);
+}
+
+// Tokens issued up to now stop working. The list lives in memory only, so
+// after a restart a revoked token is accepted again until it expires; rotate
+// CHAT_TOKEN_SECRET if that matters.
+void
+revoke_resume_tokens(std::uint32_t user_id)
+{
+    std::lock_guard<std::mutex> lock(revoked_mutex);
+    revoked[user_id] = next_stamp();
+}
+
+static std::string voice_secret;
+static std::int64_t voice_ttl = 120;
+
+void
+init_voice_tokens()
+{
+    if (char const* env = std::getenv("CHAT_VOICE_SECRET"); env && *env)
+        voice_secret = env;
+    else
+        std::cerr << "CHAT_VOICE_SECRET is not set, voice channels are not access-controlled" << std::endl;
+    voice_ttl = getenv_or("CHAT_VOICE_TOKEN_TTL", static_cast<int>(voice_ttl));
+}
+
+boost::optional<std::string>
+issue_voice_token(std::uint32_t user_id, std::string const& channel, std::int64_t& expires)
+{
+    if (voice_secret.empty())
+        return boost::none;
+    expires = unix_now() + voice_ttl;
+    std::string const payload = std::to_string(user_id) + "." + channel + "." + std::to_string(expires);
+    return payload + "." + sign(voice_secret, payload);
+}
+
+rate_limiter::
+rate_limiter(double rate, double burst)
+    : rate_(rate)
+    , burst_(burst)
+{
+}
+
+bool
+rate_limiter::
+allow(std::string const& key)
+{
+    auto const now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buckets_.size() > 10000)
+        sweep(now);
+
+    auto it = buckets_.find(key);
+    if (it == buckets_.end())
+        it = buckets_.emplace(key, bucket{ burst_, now }).first;
+
+    auto& b = it->second;
+    double const elapsed = std::chrono::duration<double>(now - b.last).count();
+    b.tokens = std::min(burst_, b.tokens + elapsed * rate_);
+    b.last = now;
+    if (b.tokens < 1.0)
+        return false;
+    b.tokens -= 1.0;
+    return true;
+}
+
+// Buckets that have refilled completely carry no state worth keeping.
+void
+rate_limiter::
+sweep(std::chrono::steady_clock::time_point now)
+{
+    for (auto it = buckets_.begin(); it != buckets_.end();) {
+        double const elapsed = std::chrono::duration<double>(now - it->second.last).count();
+        if (it->second.tokens + elapsed * rate_ >= burst_)
+            it = buckets_.erase(it);
+        else
+            ++it;
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef SRAVZ_AUTH_HPP
+#define SRAVZ_AUTH_HPP
+
+#include "sqlite/sqlite3.h"
+#include <boost/optional.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Stored as "scrypt$<log2 N>$<r>$<p>$<salt>$<hash>" (base64). Hashes written
+// before this format are a bare base64 SHA-256 and are still accepted.
+std::string hash_password(std::string const& password);
+bool verify_password(std::string const& password, std::string const& stored, bool& needs_rehash);
+
+// Both run on a worker_pool thread with that worker's connection.
+boost::optional<int> validate_auth(sqlite3* db, std::string const& login, std::string const& password);
+boost::optional<std::pair<int, std::string>> register_user(sqlite3* db, std::string const& login, std::string const& password, std::string const& name);
+
+// Resume tokens are "<user id>.<issued>.<expiry>.<hex HMAC-SHA256>", signed with
+// CHAT_TOKEN_SECRET, so a reconnect can be authenticated without touching the
+// database or hashing a password. Without the variable a random secret is
+// used and tokens do not survive a restart. <issued> is a microsecond stamp
+// that revocation compares against.
+void init_resume_tokens();
+std::string issue_resume_token(std::uint32_t user_id);
+boost::optional<std::uint32_t> verify_resume_token(std::string const& token);
+void revoke_resume_tokens(std::uint32_t user_id);
+
+// Voice tokens are "<user id>.<channel>.<expiry>.<hex HMAC-SHA256>", signed
+// with CHAT_VOICE_SECRET, which rtp_server shares: it checks the token once at
+// REGISTER. They only need to outlive call setup, so CHAT_VOICE_TOKEN_TTL
+// defaults to two minutes. Without the variable no token is issued and
+// rtp_server must run without one as well.
+void init_voice_tokens();
+boost::optional<std::string> issue_voice_token(std::uint32_t user_id, std::string const& channel, std::int64_t& expires);
+
+// Token bucket per key: `burst` attempts at once, refilled at `rate` per second.
+class rate_limiter
+{
+    struct bucket
+    {
+        double tokens;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    double const rate_;
+    double const burst_;
+    std::mutex mutex_;
+    std::unordered_map<std::string, bucket> buckets_;
+
+    void sweep(std::chrono::steady_clock::time_point now);
+
+public:
+    rate_limiter(double rate, double burst);
+    bool allow(std::string const& key);
+};
+
+#endif
@@ -0,0 +1,150 @@
+// Connection-storm benchmark: opens N connections at once (like clients
+// reconnecting after a deploy) and measures how fast the server accepts them.
+// A connection counts as accepted once the server has answered its first HTTP
+// request, which also covers TCP_DEFER_ACCEPT, where the accept itself only
+// completes after the request bytes arrive.
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+struct client : std::enable_shared_from_this<client>
+{
+    net::io_context& ioc;
+    tcp::socket socket;
+    std::string request;
+    net::streambuf response;
+    clock_type::time_point start;
+    double connect_ms = -1;
+    double accept_ms = -1;
+    std::atomic<int>& pending;
+
+    client(net::io_context& ioc, std::string req, std::atomic<int>& p)
+        : ioc(ioc), socket(ioc), request(std::move(req)), pending(p)
+    {
+    }
+
+    void run(tcp::resolver::results_type const& endpoints, clock_type::time_point t0)
+    {
+        start = t0;
+        net::async_connect(socket, endpoints,
+            [self = shared_from_this()](boost::system::error_code ec, tcp::endpoint const&)
+            {
+                if (ec)
+                    return self->done();
+                self->connect_ms = self->elapsed_ms();
+                net::async_write(self->socket, net::buffer(self->request),
+                    [self](boost::system::error_code ec, std::size_t)
+                    {
+                        if (ec)
+                            return self->done();
+                        net::async_read_until(self->socket, self->response, "\r\n\r\n",
+                            [self](boost::system::error_code ec, std::size_t)
+                            {
+                                if (!ec)
+                                    self->accept_ms = self->elapsed_ms();
+                                self->done();
+                            });
+                    });
+            });
+    }
+
+    double elapsed_ms() const
+    {
+        return std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+    }
+
+    void done()
+    {
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            ioc.stop();
+    }
+};
+
+static double
+percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::size_t i = static_cast<std::size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr <<
+            "Usage: accept_storm <host> <port> <clients> [threads] [target]\n" <<
+            "Example:\n" <<
+            "    accept_storm 127.0.0.1 8080 20000 4 /index.html\n";
+        return EXIT_FAILURE;
+    }
+    std::string const host = argv[1];
+    std::string const port = argv[2];
+    int const clients = std::max(1, std::atoi(argv[3]));
+    int const threads = argc > 4 ? std::max(1, std::atoi(argv[4])) : 4;
+    std::string const target = argc > 5 ? argv[5] : "/";
+
+    net::io_context ioc;
+    auto const endpoints = tcp::resolver(ioc).resolve(host, port);
+    std::string const request =
+        "GET " + target + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: close\r\n\r\n";
+
+    std::atomic<int> pending{ clients };
+    std::vector<std::shared_ptr<client>> all;
+    all.reserve(clients);
+    auto const t0 = clock_type::now();
+    for (int i = 0; i < clients; ++i)
+    {
+        all.push_back(std::make_shared<client>(ioc, request, pending));
+        all.back()->run(endpoints, t0);
+    }
+
+    // Connections stuck in a full backlog are retried by the kernel with
+    // exponential backoff; give up on them instead of waiting forever.
+    net::steady_timer deadline(ioc, std::chrono::seconds(60));
+    deadline.async_wait([&ioc](boost::system::error_code) { ioc.stop(); });
+
+    std::vector<std::thread> v;
+    for (int i = 0; i < threads; ++i)
+        v.emplace_back([&ioc] { ioc.run(); });
+    for (auto& t : v)
+        t.join();
+    auto const total_ms = std::chrono::duration<double, std::milli>(clock_type::now() - t0).count();
+
+    std::vector<double> connect, accept;
+    for (auto const& c : all)
+    {
+        if (c->connect_ms >= 0)
+            connect.push_back(c->connect_ms);
+        if (c->accept_ms >= 0)
+            accept.push_back(c->accept_ms);
+    }
+    double const last = accept.empty() ? 0 : *std::max_element(accept.begin(), accept.end());
+
+    std::cout
+        << "clients:            " << clients << "\n"
+        << "connected:          " << connect.size() << "\n"
+        << "accepted:           " << accept.size() << "\n"
+        << "failed:             " << clients - static_cast<int>(accept.size()) << "\n"
+        << "total time:         " << total_ms << " ms\n"
+        << "all accepted after: " << last << " ms\n"
+        << "accepts/s:          " << (last > 0 ? accept.size() * 1000.0 / last : 0) << "\n"
+        << "connect p50/p99:    " << percentile(connect, 0.50) << " / " << percentile(connect, 0.99) << " ms\n"
+        << "accept  p50/p99:    " << percentile(accept, 0.50) << " / " << percentile(accept, 0.99) << " ms\n";
+    return accept.size() == static_cast<std::size_t>(clients) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,545 @@
+// End-to-end load generator for the chat server. N synthetic users register
+// through the HTTP upgrade, room owners create rooms and invite the rest,
+// everyone subscribes and then sends messages at a fixed rate. Every message
+// carries its send time, so each delivery gives a send-to-receive latency.
+// Reports connect time, latency percentiles, throughput and server RSS.
+//
+// Given the path to chat_server, the tool starts it on a temporary doc root
+// and SQLite file and removes both afterwards; given a pid it only samples
+// that process's memory.
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <csignal>
+#include <filesystem>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace net = boost::asio;
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+using tcp = boost::asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+static std::int64_t
+now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        clock_type::now().time_since_epoch()).count();
+}
+
+// The server serializes with Boost.JSON, which writes "key":value without
+// spaces; a scan is enough here and keeps the generator off the profile.
+static long long
+json_int(std::string const& s, char const* key)
+{
+    std::string const k = std::string("\"") + key + "\":";
+    auto pos = s.find(k);
+    if (pos == std::string::npos)
+        return -1;
+    return std::strtoll(s.c_str() + pos + k.size(), nullptr, 10);
+}
+
+static std::string
+json_str(std::string const& s, char const* key)
+{
+    std::string const k = std::string("\"") + key + "\":\"";
+    auto pos = s.find(k);
+    if (pos == std::string::npos)
+        return {};
+    pos += k.size();
+    return s.substr(pos, s.find('"', pos) - pos);
+}
+
+struct config
+{
+    std::string host;
+    std::string port;
+    std::string prefix;
+    int users = 100;
+    int rooms = 10;
+    double rate = 1;
+    int seconds = 10;
+    std::size_t size = 64;
+};
+
+struct bench;
+
+struct user : std::enable_shared_from_this<user>
+{
+    bench& b;
+    int const index;
+    websocket::stream<beast::tcp_stream> ws;
+    net::steady_timer timer;
+    beast::flat_buffer buffer;
+    std::vector<std::string> queue;
+    int id = -1;
+    int room = -1;
+    bool sending = false;
+    std::uint64_t sent = 0;
+    std::uint64_t received = 0;
+    std::uint64_t errors = 0;
+    double connect_ms = 0;
+    std::vector<double> latency_ms;
+    std::int64_t started = 0;
+
+    user(bench& b, int index, net::io_context& ioc)
+        : b(b)
+        , index(index)
+        , ws(net::make_strand(ioc))
+        , timer(ws.get_executor())
+    {
+    }
+
+    void run(tcp::resolver::results_type const& endpoints);
+    void on_message(std::string const& text);
+    void send(std::string text);
+    void write_next();
+    void do_read();
+    void start_sending();
+    void wait();
+    void tick();
+
+    std::int64_t
+    interval_us() const;
+};
+
+struct bench
+{
+    config const cfg;
+    net::io_context ioc;
+    std::vector<std::shared_ptr<user>> users;
+    std::vector<int> room_ids;
+    std::atomic<int> connected{ 0 };
+    std::atomic<int> rooms_created{ 0 };
+    std::atomic<int> subscribed{ 0 };
+    std::atomic<int> failed{ 0 };
+    std::atomic<std::int64_t> stop_at{ 0 };
+
+    explicit bench(config c)
+        : cfg(std::move(c))
+        , room_ids(static_cast<std::size_t>(cfg.rooms), -1)
+    {
+    }
+
+    // Runs f on every user's strand.
+    void
+    each(std::function<void(user&)> f)
+    {
+        for (auto& u : users)
+            net::post(u->ws.get_executor(), [u, f] { f(*u); });
+    }
+
+    void
+    on_connected()
+    {
+        if (++connected != cfg.users)
+            return;
+        std::cout << "connected:       " << cfg.users << " users\n";
+        // User r < rooms owns room r and invites everyone with index % rooms == r.
+        each([this](user& u)
+        {
+            if (u.index >= cfg.rooms)
+                return;
+            std::string invited;
+            for (int j = u.index + cfg.rooms; j < cfg.users; j += cfg.rooms)
+                invited += (invited.empty() ? "" : ",") + std::to_string(users[j]->id);
+            u.send("{\"ty\":4,\"chatName\":\"" + cfg.prefix + "_room" + std::to_string(u.index) +
+                "\",\"Invited\":[" + invited + "]}");
+        });
+    }
+
+    void
+    on_room_created(int room, int chat_id)
+    {
+        room_ids[room] = chat_id;
+        if (++rooms_created != cfg.rooms)
+            return;
+        each([this](user& u)
+        {
+            u.room = room_ids[u.index % cfg.rooms];
+            u.send("{\"ty\":1,\"to\":" + std::to_string(u.room) + "}");
+        });
+    }
+
+    void
+    on_subscribed()
+    {
+        if (++subscribed != cfg.users)
+            return;
+        stop_at = now_us() + std::int64_t(cfg.seconds) * 1000000;
+        std::cout << "subscribed:      " << cfg.users << " users in " << cfg.rooms << " rooms\n";
+        each([](user& u) { u.start_sending(); });
+    }
+
+    // Without every user the rooms never fill; stop instead of waiting for
+    // the deadline.
+    void
+    on_failed(char const* what, beast::error_code ec)
+    {
+        if (++failed == 1)
+            std::cerr << what << ": " << ec.message() << "\n";
+        ioc.stop();
+    }
+};
+
+std::int64_t
+user::
+interval_us() const
+{
+    return static_cast<std::int64_t>(1e6 / b.cfg.rate);
+}
+
+void
+user::
+run(tcp::resolver::results_type const& endpoints)
+{
+    started = now_us();
+    beast::get_lowest_layer(ws).async_connect(endpoints,
+        [self = shared_from_this()](beast::error_code ec, tcp::endpoint const&)
+        {
+            if (ec)
+                return self->b.on_failed("connect", ec);
+            beast::get_lowest_layer(self->ws).socket().set_option(tcp::no_delay(true), ec);
+            std::string const name = self->b.cfg.prefix + "_" + std::to_string(self->index);
+            self->ws.async_handshake(self->b.cfg.host,
+                "/?login_reg=" + name + "&password=bench-password&name=" + name,
+                [self](beast::error_code ec)
+                {
+                    if (ec)
+                        return self->b.on_failed("handshake", ec);
+                    self->do_read();
+                });
+        });
+}
+
+void
+user::
+do_read()
+{
+    ws.async_read(buffer,
+        [self = shared_from_this()](beast::error_code ec, std::size_t)
+        {
+            if (ec)
+                return;
+            self->on_message(beast::buffers_to_string(self->buffer.data()));
+            self->buffer.consume(self->buffer.size());
+            self->do_read();
+        });
+}
+
+void
+user::
+on_message(std::string const& text)
+{
+    auto const topic = json_int(text, "topic");
+    if (text.find("\"error\"") != std::string::npos) {
+        ++errors;
+        return;
+    }
+    switch (topic) {
+    case 7:
+        if (id < 0) {
+            id = static_cast<int>(json_int(text, "user_id"));
+            connect_ms = (now_us() - started) / 1000.0;
+            b.on_connected();
+        }
+        break;
+    case 4:
+        if (index < b.cfg.rooms && b.room_ids[index] < 0 &&
+            json_str(text, "chat_name") == b.cfg.prefix + "_room" + std::to_string(index))
+            b.on_room_created(index, static_cast<int>(json_int(text, "chat_id")));
+        break;
+    case 1:
+        b.on_subscribed();
+        break;
+    case 3:
+    {
+        // text is "<sender>:<sent_us>:<padding>"
+        auto const body = json_str(text, "text");
+        auto const colon = body.find(':');
+        if (colon == std::string::npos)
+            break;
+        auto const sent_us = std::strtoll(body.c_str() + colon + 1, nullptr, 10);
+        ++received;
+        latency_ms.push_back((now_us() - sent_us) / 1000.0);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void
+user::
+send(std::string text)
+{
+    queue.push_back(std::move(text));
+    if (!sending)
+        write_next();
+}
+
+void
+user::
+write_next()
+{
+    if (queue.empty()) {
+        sending = false;
+        return;
+    }
+    sending = true;
+    ws.async_write(net::buffer(queue.front()),
+        [self = shared_from_this()](beast::error_code ec, std::size_t)
+        {
+            if (ec) {
+                ++self->errors;
+                return;
+            }
+            self->queue.erase(self->queue.begin());
+            self->write_next();
+        });
+}
+
+void
+user::
+start_sending()
+{
+    // Spread the first messages over one interval so users don't send in lockstep.
+    std::minstd_rand rng(static_cast<unsigned>(index) + 1);
+    timer.expires_after(std::chrono::microseconds(rng() % (interval_us() + 1)));
+    wait();
+}
+
+void
+user::
+wait()
+{
+    timer.async_wait(
+        [self = shared_from_this()](beast::error_code ec)
+        {
+            if (!ec)
+                self->tick();
+        });
+}
+
+void
+user::
+tick()
+{
+    if (now_us() >= b.stop_at)
+        return;
+    std::string body = std::to_string(id) + ":" + std::to_string(now_us()) + ":";
+    if (body.size() < b.cfg.size)
+        body.append(b.cfg.size - body.size(), 'x');
+    send("{\"ty\":3,\"msg\":\"" + body + "\"}");
+    ++sent;
+    // Fixed schedule: a slow write does not lower the offered rate.
+    timer.expires_at(timer.expiry() + std::chrono::microseconds(interval_us()));
+    wait();
+}
+
+static double
+percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::size_t i = static_cast<std::size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+// VmRSS and VmHWM in MB, or -1 where /proc is not available.
+static std::pair<double, double>
+server_memory(long pid)
+{
+    std::pair<double, double> mem{ -1, -1 };
+    if (pid <= 0)
+        return mem;
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string key;
+    while (status >> key) {
+        double kb = 0;
+        if (key == "VmRSS:" && status >> kb)
+            mem.first = kb / 1024;
+        else if (key == "VmHWM:" && status >> kb)
+            mem.second = kb / 1024;
+    }
+    return mem;
+}
+
+#ifdef __linux__
+// Starts chat_server on a temporary doc root and database; returns its pid.
+static pid_t
+spawn_server(std::string const& binary, config const& cfg, std::string& dir)
+{
+    char tmpl[] = "/tmp/chat_bench.XXXXXX";
+    if (!mkdtemp(tmpl))
+        return -1;
+    dir = tmpl;
+    pid_t const pid = fork();
+    if (pid == 0) {
+        // One host registers every synthetic user, so lift the per-IP login limit.
+        setenv("CHAT_LOGIN_RATE", "1000000", 1);
+        setenv("CHAT_LOGIN_BURST", "1000000", 1);
+        if (!std::getenv("CHAT_LOG_LEVEL"))
+            setenv("CHAT_LOG_LEVEL", "warn", 1);
+        std::string const threads = std::to_string(std::max(2u, std::thread::hardware_concurrency()));
+        std::string const db = dir + "/bench.db";
+        execl(binary.c_str(), binary.c_str(), cfg.host.c_str(), cfg.port.c_str(),
+            dir.c_str(), threads.c_str(), db.c_str(), static_cast<char*>(nullptr));
+        std::perror("execl");
+        std::_Exit(127);
+    }
+    // Wait until the listener is up.
+    net::io_context ioc;
+    auto const endpoints = tcp::resolver(ioc).resolve(cfg.host, cfg.port);
+    for (int i = 0; i < 100; ++i) {
+        tcp::socket s(ioc);
+        boost::system::error_code ec;
+        net::connect(s, endpoints, ec);
+        if (!ec)
+            return pid;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+#endif
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr <<
+            "Usage: chat_bench <host> <port> [users] [rooms] [msgs/s per user] [seconds] [msg bytes] [threads] [server]\n" <<
+            "  server: path to chat_server to start on a temporary database,\n" <<
+            "          or the pid of a running server to sample its memory\n" <<
+            "Example:\n" <<
+            "    chat_bench 127.0.0.1 8090 200 20 5 10 64 4 ./chat_server\n";
+        return EXIT_FAILURE;
+    }
+    config cfg;
+    cfg.host = argv[1];
+    cfg.port = argv[2];
+    cfg.users = argc > 3 ? std::max(1, std::atoi(argv[3])) : cfg.users;
+    cfg.rooms = argc > 4 ? std::max(1, std::atoi(argv[4])) : cfg.rooms;
+    cfg.rooms = std::min(cfg.rooms, cfg.users);
+    cfg.rate = argc > 5 ? std::max(0.01, std::atof(argv[5])) : cfg.rate;
+    cfg.seconds = argc > 6 ? std::max(1, std::atoi(argv[6])) : cfg.seconds;
+    cfg.size = argc > 7 ? static_cast<std::size_t>(std::max(16, std::atoi(argv[7]))) : cfg.size;
+    int const threads = argc > 8 ? std::max(1, std::atoi(argv[8])) : 4;
+    std::string const server = argc > 9 ? argv[9] : "";
+    cfg.prefix = "bench" + std::to_string(now_us() % 1000000000);
+
+    long pid = 0;
+    std::string tmp_dir;
+    if (!server.empty() && server.find_first_not_of("0123456789") == std::string::npos) {
+        pid = std::atol(server.c_str());
+    } else if (!server.empty()) {
+#ifdef __linux__
+        pid = spawn_server(server, cfg, tmp_dir);
+        if (pid <= 0) {
+            std::cerr << "unable to start " << server << "\n";
+            return EXIT_FAILURE;
+        }
+#else
+        std::cerr << "starting the server is only supported on Linux\n";
+        return EXIT_FAILURE;
+#endif
+    }
+    auto const idle_mem = server_memory(pid);
+
+    bench b(cfg);
+    auto const endpoints = tcp::resolver(b.ioc).resolve(cfg.host, cfg.port);
+    for (int i = 0; i < cfg.users; ++i)
+        b.users.push_back(std::make_shared<user>(b, i, b.ioc));
+    for (auto& u : b.users)
+        u->run(endpoints);
+
+    // Registration runs scrypt on the server, so connecting may take a while;
+    // the deadline covers it plus the send period and a second to drain.
+    double peak_rss = -1;
+    net::steady_timer sampler(b.ioc);
+    std::function<void()> sample = [&]
+    {
+        peak_rss = std::max(peak_rss, server_memory(pid).first);
+        auto const stop = b.stop_at.load();
+        if (stop != 0 && now_us() > stop + 1000000)
+            return b.ioc.stop();
+        sampler.expires_after(std::chrono::milliseconds(250));
+        sampler.async_wait([&](beast::error_code ec) { if (!ec) sample(); });
+    };
+    sample();
+    net::steady_timer deadline(b.ioc, std::chrono::seconds(cfg.seconds + 120));
+    deadline.async_wait([&b](beast::error_code ec) { if (!ec) b.ioc.stop(); });
+
+    std::vector<std::thread> v;
+    for (int i = 0; i < threads; ++i)
+        v.emplace_back([&b] { b.ioc.run(); });
+    for (auto& t : v)
+        t.join();
+    double const send_s = cfg.seconds;
+    auto const end_mem = server_memory(pid);
+
+#ifdef __linux__
+    if (!tmp_dir.empty()) {
+        kill(static_cast<pid_t>(pid), SIGTERM);
+        for (int i = 0; i < 40 && waitpid(static_cast<pid_t>(pid), nullptr, WNOHANG) == 0; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        kill(static_cast<pid_t>(pid), SIGKILL);
+        waitpid(static_cast<pid_t>(pid), nullptr, WNOHANG);
+        std::error_code ec;
+        std::filesystem::remove_all(tmp_dir, ec);
+    }
+#endif
+
+    std::vector<double> connect_ms, latency;
+    std::uint64_t sent = 0, received = 0, errors = 0;
+    for (auto const& u : b.users) {
+        if (u->id >= 0)
+            connect_ms.push_back(u->connect_ms);
+        latency.insert(latency.end(), u->latency_ms.begin(), u->latency_ms.end());
+        sent += u->sent;
+        received += u->received;
+        errors += u->errors;
+    }
+    if (connect_ms.size() != static_cast<std::size_t>(cfg.users) || b.subscribed < cfg.users) {
+        std::cerr << "setup incomplete: " << connect_ms.size() << "/" << cfg.users << " connected, "
+                  << b.rooms_created << "/" << cfg.rooms << " rooms, "
+                  << b.subscribed << "/" << cfg.users << " subscribed\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout
+        << "connect p50/p99: " << percentile(connect_ms, 0.50) << " / " << percentile(connect_ms, 0.99) << " ms\n"
+        << "messages sent:   " << sent << " (" << sent / send_s << "/s)\n"
+        << "deliveries:      " << received << " (" << received / send_s << "/s)\n"
+        << "errors:          " << errors << "\n"
+        << "latency p50/p99/p999/max: " << percentile(latency, 0.50) << " / " << percentile(latency, 0.99)
+        << " / " << percentile(latency, 0.999) << " / " << percentile(latency, 1.0) << " ms\n";
+    if (pid > 0)
+        std::cout
+            << "server RSS:      idle " << idle_mem.first << " MB, peak " << std::max(peak_rss, end_mem.first)
+            << " MB, end " << end_mem.first << " MB, high-water " << end_mem.second << " MB\n";
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,197 @@
+// Keep-alive HTTP load generator for static files: N connections each send
+// GET requests back to back for a fixed time, and the tool reports
+// requests/s, throughput and latency percentiles.
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+using tcp = boost::asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+struct client : std::enable_shared_from_this<client>
+{
+    net::io_context& ioc;
+    tcp::socket socket;
+    std::string const& request;
+    clock_type::time_point const& stop_at;
+    std::atomic<int>& pending;
+    net::streambuf response;
+    clock_type::time_point sent;
+    std::vector<double> latency_ms;
+    std::size_t bytes = 0;
+    std::size_t errors = 0;
+
+    client(net::io_context& ioc, std::string const& req, clock_type::time_point const& stop, std::atomic<int>& p)
+        : ioc(ioc), socket(ioc), request(req), stop_at(stop), pending(p)
+    {
+    }
+
+    void fail()
+    {
+        ++errors;
+        done();
+    }
+
+    void done()
+    {
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            ioc.stop();
+    }
+
+    void run(tcp::resolver::results_type const& endpoints)
+    {
+        net::async_connect(socket, endpoints,
+            [self = shared_from_this()](boost::system::error_code ec, tcp::endpoint const&)
+            {
+                if (ec)
+                    return self->fail();
+                self->socket.set_option(tcp::no_delay(true), ec);
+                self->send();
+            });
+    }
+
+    void send()
+    {
+        if (clock_type::now() >= stop_at)
+            return done();
+        sent = clock_type::now();
+        net::async_write(socket, net::buffer(request),
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t)
+            {
+                if (ec)
+                    return self->fail();
+                self->read_header();
+            });
+    }
+
+    void read_header()
+    {
+        net::async_read_until(socket, response, "\r\n\r\n",
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t header_size)
+            {
+                if (ec)
+                    return self->fail();
+                std::string header(
+                    net::buffers_begin(self->response.data()),
+                    net::buffers_begin(self->response.data()) + header_size);
+                self->response.consume(header_size);
+
+                std::size_t length = 0;
+                std::transform(header.begin(), header.end(), header.begin(),
+                    [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+                auto const pos = header.find("\r\ncontent-length:");
+                if (pos != std::string::npos)
+                    length = std::strtoull(header.c_str() + pos + 17, nullptr, 10);
+                if (header.compare(0, 12, "http/1.1 200") != 0 && header.compare(0, 12, "http/1.1 304") != 0)
+                    ++self->errors;
+                self->read_body(length);
+            });
+    }
+
+    void read_body(std::size_t length)
+    {
+        if (response.size() < length)
+        {
+            net::async_read(socket, response, net::transfer_exactly(length - response.size()),
+                [self = shared_from_this(), length](boost::system::error_code ec, std::size_t)
+                {
+                    if (ec)
+                        return self->fail();
+                    self->read_body(length);
+                });
+            return;
+        }
+        response.consume(length);
+        bytes += length;
+        latency_ms.push_back(
+            std::chrono::duration<double, std::milli>(clock_type::now() - sent).count());
+        send();
+    }
+};
+
+static double
+percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::size_t i = static_cast<std::size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr <<
+            "Usage: http_load <host> <port> <target> [connections] [seconds] [threads] [accept-encoding]\n" <<
+            "Example:\n" <<
+            "    http_load 127.0.0.1 8080 /10k.html 64 10 4 gzip\n";
+        return EXIT_FAILURE;
+    }
+    std::string const host = argv[1];
+    std::string const port = argv[2];
+    std::string const target = argv[3];
+    int const connections = argc > 4 ? std::max(1, std::atoi(argv[4])) : 64;
+    int const seconds = argc > 5 ? std::max(1, std::atoi(argv[5])) : 10;
+    int const threads = argc > 6 ? std::max(1, std::atoi(argv[6])) : 4;
+    std::string const encoding = argc > 7 ? argv[7] : "";
+
+    net::io_context ioc;
+    auto const endpoints = tcp::resolver(ioc).resolve(host, port);
+    std::string request = "GET " + target + " HTTP/1.1\r\nHost: " + host + "\r\n";
+    if (!encoding.empty())
+        request += "Accept-Encoding: " + encoding + "\r\n";
+    request += "\r\n";
+
+    auto const t0 = clock_type::now();
+    auto const stop_at = t0 + std::chrono::seconds(seconds);
+    std::atomic<int> pending{ connections };
+    std::vector<std::shared_ptr<client>> all;
+    all.reserve(connections);
+    for (int i = 0; i < connections; ++i)
+    {
+        all.push_back(std::make_shared<client>(ioc, request, stop_at, pending));
+        all.back()->run(endpoints);
+    }
+
+    // A request in flight when time runs out may never be answered.
+    net::steady_timer deadline(ioc, std::chrono::seconds(seconds + 5));
+    deadline.async_wait([&ioc](boost::system::error_code) { ioc.stop(); });
+
+    std::vector<std::thread> v;
+    for (int i = 0; i < threads; ++i)
+        v.emplace_back([&ioc] { ioc.run(); });
+    for (auto& t : v)
+        t.join();
+    auto const total_s = std::chrono::duration<double>(clock_type::now() - t0).count();
+
+    std::vector<double> latency;
+    std::size_t bytes = 0, errors = 0;
+    for (auto const& c : all)
+    {
+        latency.insert(latency.end(), c->latency_ms.begin(), c->latency_ms.end());
+        bytes += c->bytes;
+        errors += c->errors;
+    }
+
+    std::cout
+        << "connections:     " << connections << "\n"
+        << "requests:        " << latency.size() << "\n"
+        << "errors:          " << errors << "\n"
+        << "requests/s:      " << latency.size() / total_s << "\n"
+        << "MB/s:            " << bytes / total_s / (1024 * 1024) << "\n"
+        << "latency p50/p99: " << percentile(latency, 0.50) << " / " << percentile(latency, 0.99) << " ms\n";
+    return latency.empty() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
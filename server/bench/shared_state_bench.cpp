@@ -0,0 +1,419 @@
+// Microbenchmarks for shared_state::parse() and the handlers behind it,
+// without sockets.
+//
+// This file stands in for websocket_session.cpp: a session owns its SQLite
+// connection as usual, and send() still posts to the session's executor, but
+// the delivery only counts the frame. Every operation is measured up to and
+// including those deliveries (io_context::poll()).
+//
+// The database is a shared-cache in-memory SQLite unless CHAT_BENCH_DB names
+// a file (put it on tmpfs to keep the disk out of the numbers). Besides ns/op
+// each benchmark reports operator new calls (allocs/op), SQLite allocations
+// (sqlite_allocs/op) and frames delivered per operation.
+//
+//     ./shared_state_bench --benchmark_filter=send --benchmark_repetitions=5
+
+#include "shared_state.hpp"
+#include "websocket_session.hpp"
+#include "logger.hpp"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Only allocations made by the benchmark thread while counting is on are
+// attributed to the operation; the pools and the log writer are idle anyway.
+thread_local bool counting = false;
+thread_local std::uint64_t cxx_allocs = 0;
+thread_local std::uint64_t sqlite_allocs = 0;
+
+std::uint64_t frames_delivered = 0;
+std::uint64_t bytes_delivered = 0;
+
+sqlite3_mem_methods sqlite_default;
+
+void*
+sqlite_malloc(int n)
+{
+    if (counting)
+        ++sqlite_allocs;
+    return sqlite_default.xMalloc(n);
+}
+
+void*
+sqlite_realloc(void* p, int n)
+{
+    if (counting)
+        ++sqlite_allocs;
+    return sqlite_default.xRealloc(p, n);
+}
+
+// Must run before anything opens a database.
+void
+configure_sqlite()
+{
+    sqlite3_config(SQLITE_CONFIG_GETMALLOC, &sqlite_default);
+    sqlite3_mem_methods counted = sqlite_default;
+    counted.xMalloc = &sqlite_malloc;
+    counted.xRealloc = &sqlite_realloc;
+    sqlite3_config(SQLITE_CONFIG_MALLOC, &counted);
+    sqlite3_config(SQLITE_CONFIG_URI, 1);
+}
+
+} // (anon)
+
+void*
+operator new(std::size_t n)
+{
+    if (counting)
+        ++cxx_allocs;
+    if (void* p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void
+operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+//------------------------------------------------------------------------------
+
+websocket_session::
+websocket_session(
+    tcp::socket&& socket,
+    boost::shared_ptr<shared_state> const& state,int id,
+    boost::optional<resume_point> resume)
+    : ws_(std::move(socket))
+    , state_(state),id(id)
+    , resume_(resume)
+{
+    if (sqlite3_open(state_->db_root().c_str(), &db) != SQLITE_OK)
+        throw std::runtime_error(sqlite3_errmsg(db));
+    sqlite3_busy_timeout(db, 5000);
+}
+
+websocket_session::
+~websocket_session()
+{
+    state_->leave(this);
+    sqlite3_close(db);
+}
+
+void
+websocket_session::
+send(boost::shared_ptr<std::string const> const& ss)
+{
+    net::post(
+        ws_.get_executor(),
+        beast::bind_front_handler(
+            &websocket_session::on_send,
+            shared_from_this(),
+            ss));
+}
+
+void
+websocket_session::
+on_send(boost::shared_ptr<std::string const> const& ss)
+{
+    ++frames_delivered;
+    bytes_delivered += ss->size();
+}
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+constexpr int user_count = 1000;
+constexpr int session_count = 128;  // users 1..128 are connected
+constexpr int room_chat = 1;        // everyone connected is a member
+constexpr int history_chat = 2;     // history_size messages, user 1 only
+constexpr int invite_chat = 3;      // owned by user 1
+constexpr int history_size = 200;
+constexpr int first_stranger = 201; // users from here on are in no chat
+
+void
+exec(sqlite3* db, std::string const& sql)
+{
+    char* err = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+        std::string what = err ? err : sqlite3_errmsg(db);
+        sqlite3_free(err);
+        throw std::runtime_error(what + ": " + sql);
+    }
+}
+
+struct world
+{
+    std::string db_root;
+    sqlite3* anchor = nullptr;  // keeps the in-memory database alive
+    net::io_context ioc;
+    boost::shared_ptr<shared_state> state;
+    std::vector<boost::shared_ptr<websocket_session>> sessions;
+
+    world()
+    {
+        char const* file = std::getenv("CHAT_BENCH_DB");
+        db_root = file ? file : "file:shared_state_bench?mode=memory&cache=shared";
+        if (file)
+            std::remove(file);
+        if (sqlite3_open(db_root.c_str(), &anchor) != SQLITE_OK)
+            throw std::runtime_error(sqlite3_errmsg(anchor));
+
+        state = boost::make_shared<shared_state>(".", db_root);
+
+        exec(anchor, "BEGIN");
+        for (int id = 1; id <= user_count; ++id)
+            exec(anchor, "INSERT INTO Users(id, login, pass, name) VALUES(" + std::to_string(id) +
+                ", 'bench_" + std::to_string(id) + "', '-', 'user " + std::to_string(id) + "')");
+        exec(anchor, "INSERT INTO Chat(id, name, adminid, isVoiceChat) VALUES"
+            "(1, 'room', 1, 0), (2, 'history', 1, 0), (3, 'invite', 1, 0)");
+        for (int id = 1; id <= session_count; ++id)
+            exec(anchor, "INSERT INTO UserInChat VALUES(1, " + std::to_string(id) + ", 1, 0)");
+        exec(anchor, "INSERT INTO UserInChat VALUES(2, 1, 1, 0), (3, 1, 1, 0)");
+        for (int i = 0; i < history_size; ++i)
+            exec(anchor, "INSERT INTO Message(text, date, chatid, userid) VALUES('history message " +
+                std::to_string(i) + "', " + std::to_string(1000 + i) + ", 2, 1)");
+        exec(anchor, "COMMIT");
+
+        for (int id = 1; id <= session_count; ++id) {
+            sessions.push_back(boost::make_shared<websocket_session>(tcp::socket(ioc), state, id));
+            state->join(sessions.back().get());
+        }
+        poll();
+    }
+
+    ~world()
+    {
+        sessions.clear();
+        poll();
+        state.reset();
+        sqlite3_close(anchor);
+    }
+
+    void
+    poll()
+    {
+        ioc.restart();
+        ioc.poll();
+        // No subscriber thread here; keep the persistence queue from filling up.
+        state->spsc_queue_subscriber_.consume_all([](persistence_job const&) {});
+    }
+
+    // One inbound frame, handled the way websocket_session::on_read does.
+    void
+    handle(std::size_t session, char const* frame, std::size_t size)
+    {
+        state->parse(std::string(frame, size), sessions[session].get());
+        poll();
+    }
+
+    void
+    handle(std::size_t session, std::string const& frame)
+    {
+        handle(session, frame.data(), frame.size());
+    }
+};
+
+std::unique_ptr<world> the_world;
+
+} // (anon)
+
+class chat : public benchmark::Fixture
+{
+    std::uint64_t frames_ = 0;
+    std::uint64_t bytes_ = 0;
+
+protected:
+    world* w = nullptr;
+
+    void
+    subscribe(std::size_t session, int chat_id)
+    {
+        w->handle(session, "{\"ty\":1,\"to\":" + std::to_string(chat_id) + "}");
+    }
+
+    void
+    unsubscribe(std::size_t session)
+    {
+        w->handle(session, "{\"ty\":2}");
+    }
+
+    void
+    start_counting()
+    {
+        frames_ = frames_delivered;
+        bytes_ = bytes_delivered;
+        cxx_allocs = 0;
+        sqlite_allocs = 0;
+        counting = true;
+    }
+
+    void
+    report(benchmark::State& st)
+    {
+        counting = false;
+        auto const per_op = benchmark::Counter::kAvgIterations;
+        st.counters["allocs/op"] = benchmark::Counter(double(cxx_allocs), per_op);
+        st.counters["sqlite_allocs/op"] = benchmark::Counter(double(sqlite_allocs), per_op);
+        st.counters["frames/op"] = benchmark::Counter(double(frames_delivered - frames_), per_op);
+        st.SetBytesProcessed(static_cast<std::int64_t>(bytes_delivered - bytes_));
+    }
+
+    // Runs f with the clock and the allocation counters stopped.
+    template<class F>
+    void
+    untimed(benchmark::State& st, F&& f)
+    {
+        st.PauseTiming();
+        counting = false;
+        f();
+        counting = true;
+        st.ResumeTiming();
+    }
+
+public:
+    void
+    SetUp(benchmark::State const&) override
+    {
+        if (!the_world)
+            the_world = std::make_unique<world>();
+        w = the_world.get();
+    }
+};
+
+// ty 1 + ty 2: switching into a room and out again.
+BENCHMARK_DEFINE_F(chat, subscribe)(benchmark::State& st)
+{
+    start_counting();
+    for (auto _ : st) {
+        subscribe(0, room_chat);
+        unsubscribe(0);
+    }
+    report(st);
+}
+BENCHMARK_REGISTER_F(chat, subscribe);
+
+// ty 3 into a room with range(0) subscribed sessions.
+BENCHMARK_DEFINE_F(chat, send)(benchmark::State& st)
+{
+    auto const members = static_cast<std::size_t>(st.range(0));
+    for (std::size_t i = 0; i < members; ++i)
+        subscribe(i, room_chat);
+
+    // The text must differ: Message has a unique (chat, user, text, date) index.
+    static std::uint64_t n = 0;
+    char frame[96];
+    start_counting();
+    for (auto _ : st) {
+        int const size = std::snprintf(frame, sizeof(frame),
+            "{\"ty\":3,\"msg\":\"benchmark message %llu\"}", static_cast<unsigned long long>(++n));
+        w->handle(0, frame, static_cast<std::size_t>(size));
+    }
+    report(st);
+
+    for (std::size_t i = 0; i < members; ++i)
+        unsubscribe(i);
+}
+BENCHMARK_REGISTER_F(chat, send)->Arg(1)->Arg(16)->Arg(session_count);
+
+// ty 6 for a room with history_size messages.
+BENCHMARK_DEFINE_F(chat, history)(benchmark::State& st)
+{
+    subscribe(0, history_chat);
+    start_counting();
+    for (auto _ : st)
+        w->handle(0, "{\"ty\":6}");
+    report(st);
+    unsubscribe(0);
+}
+BENCHMARK_REGISTER_F(chat, history);
+
+// ty 5, also sent to every new session.
+BENCHMARK_DEFINE_F(chat, chat_list)(benchmark::State& st)
+{
+    start_counting();
+    for (auto _ : st)
+        w->handle(0, "{\"ty\":5}");
+    report(st);
+}
+BENCHMARK_REGISTER_F(chat, chat_list);
+
+// ty 10 inviting one user who is not in the room yet. Invited users are
+// removed again, outside the measurement, once the strangers run out.
+BENCHMARK_DEFINE_F(chat, invite)(benchmark::State& st)
+{
+    subscribe(0, invite_chat);
+    int next = first_stranger;
+    char frame[64];
+    start_counting();
+    for (auto _ : st) {
+        if (next > user_count) {
+            untimed(st, [&]
+                {
+                    exec(w->anchor, "DELETE FROM UserInChat WHERE chatid = 3 AND userid != 1");
+                    next = first_stranger;
+                });
+        }
+        int const size = std::snprintf(frame, sizeof(frame), "{\"ty\":10,\"Invited\":[%d]}", next++);
+        w->handle(0, frame, static_cast<std::size_t>(size));
+    }
+    report(st);
+    exec(w->anchor, "DELETE FROM UserInChat WHERE chatid = 3 AND userid != 1");
+    unsubscribe(0);
+}
+BENCHMARK_REGISTER_F(chat, invite);
+
+// ty 13 + ty 16: a friend request (stored and pushed to the other user)
+// and its rejection, so the tables stay the same size.
+BENCHMARK_DEFINE_F(chat, friend_request)(benchmark::State& st)
+{
+    int next = first_stranger;
+    char add[80];
+    char reject[80];
+    start_counting();
+    for (auto _ : st) {
+        int const friend_id = next;
+        next = next == user_count ? first_stranger : next + 1;
+        int const add_size = std::snprintf(add, sizeof(add),
+            "{\"ty\":13,\"user_id\":1,\"friend_id\":%d}", friend_id);
+        int const reject_size = std::snprintf(reject, sizeof(reject),
+            "{\"ty\":16,\"user_id\":%d,\"friend_id\":1}", friend_id);
+        w->handle(0, add, static_cast<std::size_t>(add_size));
+        w->handle(0, reject, static_cast<std::size_t>(reject_size));
+    }
+    report(st);
+}
+BENCHMARK_REGISTER_F(chat, friend_request);
+
+int
+main(int argc, char** argv)
+{
+    configure_sqlite();
+    logging::options opts;
+    opts.level = logging::parse_severity(std::getenv("CHAT_LOG_LEVEL"), logging::severity::error);
+    logging::start(opts);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    the_world.reset();
+    logging::stop();
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include "chat_metrics.hpp"
+
+namespace chat_metrics {
+
+metrics::counter connections_accepted{ "chat_connections_accepted_total",
+    "TCP connections accepted." };
+metrics::counter accept_errors{ "chat_accept_errors_total",
+    "Failed accepts (usually EMFILE during a reconnect storm)." };
+metrics::gauge websocket_sessions{ "chat_websocket_sessions",
+    "Open WebSocket sessions." };
+metrics::counter frames_received{ "chat_websocket_frames_received_total",
+    "WebSocket messages read from clients." };
+metrics::counter messages{ "chat_messages_total",
+    "Chat messages stored and fanned out; rate() gives messages per second." };
+metrics::histogram fanout_size{ "chat_fanout_size",
+    "Sessions a room message is delivered to.", "", 1, 17 };
+metrics::histogram send_queue_depth{ "chat_send_queue_depth",
+    "Outgoing messages queued on a session, sampled on each enqueue.", "", 1, 13 };
+metrics::histogram persistence_lag{ "chat_persistence_lag_seconds",
+    "Time from accepting a message to the subscriber writing it.", "", 1e-6, 24 };
+
+namespace {
+
+char const* const sqlite_name = "chat_sqlite_query_seconds";
+char const* const sqlite_help = "SQLite statement latency, prepare to last step.";
+
+metrics::histogram sqlite_[] = {
+    { sqlite_name, sqlite_help, "statement=\"check_member\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"insert_message\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"select_user_name\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"persist_message\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"login\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"api_history\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"api_chats\"", 1e-6, 24 },
+    { sqlite_name, sqlite_help, "statement=\"api_users\"", 1e-6, 24 },
+};
+
+} // (anon)
+
+metrics::histogram&
+sqlite_latency(statement s)
+{
+    return sqlite_[static_cast<std::size_t>(s)];
+}
+
+} // chat_metrics
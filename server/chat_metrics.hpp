@@ -0,0 +1,36 @@
+#ifndef SRAVZ_CHAT_METRICS_HPP
+#define SRAVZ_CHAT_METRICS_HPP
+
+#include "metrics.hpp"
+
+// Instruments of the chat server, exported on GET /metrics next to the
+// worker pool statistics.
+namespace chat_metrics {
+
+extern metrics::counter connections_accepted;
+extern metrics::counter accept_errors;
+extern metrics::gauge websocket_sessions;
+extern metrics::counter frames_received;
+extern metrics::counter messages;
+extern metrics::histogram fanout_size;
+extern metrics::histogram send_queue_depth;
+extern metrics::histogram persistence_lag;
+
+enum class statement
+{
+    check_member,
+    insert_message,
+    select_user_name,
+    persist_message,
+    login,
+    api_history,
+    api_chats,
+    api_users,
+};
+
+// Latency of one SQLite statement, prepare to last step, in microseconds.
+metrics::histogram& sqlite_latency(statement s);
+
+} // chat_metrics
+
+#endif
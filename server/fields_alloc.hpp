@@ -0,0 +1,171 @@
+#ifndef BOOST_BEAST_EXAMPLE_WEBSOCKET_CHAT_MULTI_FIELDS_ALLOC_HPP
+#define BOOST_BEAST_EXAMPLE_WEBSOCKET_CHAT_MULTI_FIELDS_ALLOC_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+namespace detail {
+
+// Bump allocator that rewinds once every allocation has been returned, so a
+// connection that handles one request at a time keeps reusing the same bytes.
+// Requests that do not fit fall back to the heap.
+class static_pool
+{
+    std::size_t size_;
+    std::size_t refs_ = 1;
+    std::size_t count_ = 0;
+    char* p_;
+
+    char*
+    end()
+    {
+        return reinterpret_cast<char*>(this + 1) + size_;
+    }
+
+    char*
+    begin()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    explicit
+    static_pool(std::size_t size)
+        : size_(size)
+        , p_(reinterpret_cast<char*>(this + 1))
+    {
+    }
+
+public:
+    static
+    static_pool&
+    construct(std::size_t size)
+    {
+        auto p = new char[sizeof(static_pool) + size];
+        return *(::new(p) static_pool{ size });
+    }
+
+    static_pool&
+    share()
+    {
+        ++refs_;
+        return *this;
+    }
+
+    void
+    destroy()
+    {
+        if (--refs_)
+            return;
+        this->~static_pool();
+        delete[] reinterpret_cast<char*>(this);
+    }
+
+    void*
+    alloc(std::size_t n)
+    {
+        auto const align = alignof(std::max_align_t);
+        n = (n + align - 1) & ~(align - 1);
+        if (static_cast<std::size_t>(end() - p_) < n)
+            return ::operator new(n);
+        auto last = p_;
+        p_ += n;
+        ++count_;
+        return last;
+    }
+
+    void
+    dealloc(void* p)
+    {
+        auto c = static_cast<char*>(p);
+        if (c < begin() || c >= end())
+            return ::operator delete(p);
+        if (--count_ == 0)
+            p_ = begin();
+    }
+};
+
+} // detail
+
+// Allocator for http::basic_fields backed by a detail::static_pool. Copies
+// share the pool, which lives until the last copy is gone.
+template<class T>
+class fields_alloc
+{
+    template<class U>
+    friend class fields_alloc;
+
+    detail::static_pool* pool_;
+
+public:
+    using value_type = T;
+    using is_always_equal = std::false_type;
+    using pointer = T*;
+    using reference = T&;
+    using const_pointer = T const*;
+    using const_reference = T const&;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+
+    template<class U>
+    struct rebind
+    {
+        using other = fields_alloc<U>;
+    };
+
+    explicit
+    fields_alloc(std::size_t size)
+        : pool_(&detail::static_pool::construct(size))
+    {
+    }
+
+    fields_alloc(fields_alloc const& other)
+        : pool_(&other.pool_->share())
+    {
+    }
+
+    template<class U>
+    fields_alloc(fields_alloc<U> const& other)
+        : pool_(&other.pool_->share())
+    {
+    }
+
+    fields_alloc& operator=(fields_alloc const&) = delete;
+
+    ~fields_alloc()
+    {
+        pool_->destroy();
+    }
+
+    value_type*
+    allocate(size_type n)
+    {
+        return static_cast<value_type*>(
+            pool_->alloc(n * sizeof(T)));
+    }
+
+    void
+    deallocate(value_type* p, size_type)
+    {
+        pool_->dealloc(p);
+    }
+
+    template<class U>
+    friend
+    bool
+    operator==(fields_alloc const& lhs, fields_alloc<U> const& rhs)
+    {
+        return lhs.pool_ == rhs.pool_;
+    }
+
+    template<class U>
+    friend
+    bool
+    operator!=(fields_alloc const& lhs, fields_alloc<U> const& rhs)
+    {
+        return !(lhs == rhs);
+    }
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "file_cache.hpp"
+#include <sys/stat.h>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+static std::string
+http_date(std::time_t t)
+{
+    char buf[64];
+    std::tm tm{};
+#ifdef _WIN32
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+static std::string_view
+trim(std::string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+static bool
+iequals(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (std::size_t i = 0; i < a.size(); ++i)
+        if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+            return false;
+    return true;
+}
+
+// Accept-Encoding is a comma-separated list of codings, each with an
+// optional ";q=" weight (RFC 9110, 12.5.3). A weight of zero refuses the
+// coding; "*" covers every coding the list does not name.
+bool
+accepts_encoding(std::string_view accept_encoding, std::string_view coding)
+{
+    int wildcard = -1;
+    while (!accept_encoding.empty()) {
+        auto const comma = accept_encoding.find(',');
+        std::string_view item = accept_encoding.substr(0, comma);
+        accept_encoding.remove_prefix(comma == std::string_view::npos ? accept_encoding.size() : comma + 1);
+
+        auto semi = item.find(';');
+        std::string_view const name = trim(item.substr(0, semi));
+        bool allowed = true;
+        while (semi != std::string_view::npos) {
+            item.remove_prefix(semi + 1);
+            semi = item.find(';');
+            std::string_view const param = trim(item.substr(0, semi));
+            if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                // qvalue is "0", "1" or either with up to three decimals:
+                // zero unless some digit is non-zero.
+                auto const q = trim(param.substr(2));
+                allowed = q.find_first_of("123456789") != std::string_view::npos;
+            }
+        }
+
+        if (iequals(name, coding))
+            return allowed;
+        if (name == "*")
+            wildcard = allowed;
+    }
+    return wildcard == 1;
+}
+
+// If-None-Match is "*" or a comma-separated list of entity-tags, each a
+// quoted string with an optional W/ prefix (RFC 9110, 8.8.3). The tags may
+// themselves contain commas, so the list is split on the quotes. Matching
+// uses the weak comparison: W/ is ignored on both sides.
+bool
+etag_matches(std::string_view if_none_match, std::string_view etag)
+{
+    if (trim(if_none_match) == "*")
+        return true;
+    if (etag.substr(0, 2) == "W/")
+        etag.remove_prefix(2);
+    while (!if_none_match.empty()) {
+        auto const start = if_none_match.find('"');
+        if (start == std::string_view::npos)
+            break;
+        auto const end = if_none_match.find('"', start + 1);
+        if (end == std::string_view::npos)
+            break;
+        if (if_none_match.substr(start, end + 1 - start) == etag)
+            return true;
+        if_none_match.remove_prefix(end + 1);
+    }
+    return false;
+}
+
+file_cache::
+file_cache(std::size_t budget)
+    : budget_(budget)
+{
+}
+
+std::shared_ptr<file_cache::entry const>
+file_cache::
+lookup(std::string const& path, std::string_view accept_encoding)
+{
+    // Variant names are built in a per-thread buffer so a hit allocates nothing.
+    thread_local std::string variant;
+    if (accepts_encoding(accept_encoding, "br")) {
+        variant.assign(path).append(".br");
+        if (auto e = find(variant, "br"))
+            return e;
+    }
+    if (accepts_encoding(accept_encoding, "gzip")) {
+        variant.assign(path).append(".gz");
+        if (auto e = find(variant, "gzip"))
+            return e;
+    }
+    return find(path, nullptr);
+}
+
+std::shared_ptr<file_cache::entry const>
+file_cache::
+find(std::string const& key, char const* encoding)
+{
+    auto const now = std::chrono::steady_clock::now();
+    std::shared_ptr<entry const> old;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = slots_.find(key);
+        if (it != slots_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            if (now - it->second.checked < std::chrono::seconds(1))
+                return it->second.value;
+            old = it->second.value;
+        }
+    }
+
+    // stat() and reading happen outside the lock.
+    auto fresh = load(key, encoding, old);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(key);
+    if (it == slots_.end()) {
+        lru_.push_front(key);
+        it = slots_.emplace(key, slot{ nullptr, now, lru_.begin() }).first;
+    }
+    if (it->second.value && it->second.value->cached)
+        used_ -= it->second.value->body.size();
+    if (fresh && fresh->cached)
+        used_ += fresh->body.size();
+    it->second.value = fresh;
+    it->second.checked = now;
+    evict();
+    return fresh;
+}
+
+std::shared_ptr<file_cache::entry const>
+file_cache::
+load(std::string const& path, char const* encoding, std::shared_ptr<entry const> const& old)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+        return nullptr;
+
+    auto const size = static_cast<std::uint64_t>(st.st_size);
+    if (old && old->size == size && old->mtime == st.st_mtime)
+        return old;
+
+    auto e = std::make_shared<entry>();
+    e->path = path;
+    e->encoding = encoding;
+    e->size = size;
+    e->mtime = st.st_mtime;
+    char etag[64];
+    std::snprintf(etag, sizeof(etag), "\"%llx-%llx%s\"",
+        static_cast<unsigned long long>(size),
+        static_cast<unsigned long long>(st.st_mtime),
+        encoding ? (encoding[0] == 'b' ? "-br" : "-gz") : "");
+    e->etag = etag;
+    e->last_modified = http_date(st.st_mtime);
+    e->cached = false;
+
+    if (size <= max_cached_file) {
+        std::ifstream in(path, std::ios::binary);
+        std::string body((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (in.good() || in.eof()) {
+            if (body.size() == size) {
+                e->body = std::move(body);
+                e->cached = true;
+            }
+        }
+    }
+    return e;
+}
+
+// Called with mutex_ held. Drops least recently used bodies (and stale
+// metadata) until the cached bytes fit in the budget again.
+void
+file_cache::
+evict()
+{
+    while ((used_ > budget_ || slots_.size() > 4096) && !lru_.empty()) {
+        auto it = slots_.find(lru_.back());
+        if (it->second.value && it->second.value->cached)
+            used_ -= it->second.value->body.size();
+        slots_.erase(it);
+        lru_.pop_back();
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef SRAVZ_FILE_CACHE_HPP
+#define SRAVZ_FILE_CACHE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Whether an Accept-Encoding header value allows `coding`.
+bool accepts_encoding(std::string_view accept_encoding, std::string_view coding);
+
+// Whether an If-None-Match header value is "*" or lists `etag`.
+bool etag_matches(std::string_view if_none_match, std::string_view etag);
+
+// Metadata (and, for small files, the contents) of files under doc_root.
+// Entries are re-validated with stat() at most once per second, so a hot
+// asset costs neither an open() nor a read() per request.
+class file_cache
+{
+public:
+    struct entry
+    {
+        std::string path;          // file actually served (may end in .gz/.br)
+        char const* encoding;      // "gzip", "br" or nullptr
+        std::uint64_t size;
+        std::time_t mtime;
+        std::string etag;
+        std::string last_modified;
+        std::string body;          // empty unless cached
+        bool cached;
+    };
+
+    static constexpr std::uint64_t max_cached_file = 64 * 1024;
+
+    explicit file_cache(std::size_t budget);
+
+    // Picks the best representation of `path` for the Accept-Encoding value.
+    std::shared_ptr<entry const> lookup(std::string const& path, std::string_view accept_encoding);
+
+private:
+    struct slot
+    {
+        std::shared_ptr<entry const> value;   // null: file does not exist
+        std::chrono::steady_clock::time_point checked;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::shared_ptr<entry const> find(std::string const& key, char const* encoding);
+    std::shared_ptr<entry const> load(std::string const& path, char const* encoding, std::shared_ptr<entry const> const& old);
+    void evict();
+
+    std::size_t const budget_;
+    std::size_t used_ = 0;
+    std::mutex mutex_;
+    std::unordered_map<std::string, slot> slots_;
+    std::list<std::string> lru_;
+};
+
+#endif
@@ -1,53 +1,71 @@
 #include "http_session.hpp"
+#include "logger.hpp"
 #include "websocket_session.hpp"
 #include <boost/config.hpp>
-#include <iostream>
 #include "util.hpp"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 
+struct mime_mapping
+{
+    char const* ext;
+    char const* type;
+};
+
+static constexpr mime_mapping mime_types[] = {
+    { ".htm",  "text/html" },
+    { ".html", "text/html" },
+    { ".php",  "text/html" },
+    { ".css",  "text/css" },
+    { ".txt",  "text/plain" },
+    { ".js",   "application/javascript" },
+    { ".json", "application/json" },
+    { ".xml",  "application/xml" },
+    { ".swf",  "application/x-shockwave-flash" },
+    { ".flv",  "video/x-flv" },
+    { ".png",  "image/png" },
+    { ".jpe",  "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".jpg",  "image/jpeg" },
+    { ".gif",  "image/gif" },
+    { ".bmp",  "image/bmp" },
+    { ".ico",  "image/vnd.microsoft.icon" },
+    { ".tiff", "image/tiff" },
+    { ".tif",  "image/tiff" },
+    { ".svg",  "image/svg+xml" },
+    { ".svgz", "image/svg+xml" },
+};
 
 beast::string_view
 mime_type(beast::string_view path)
 {
-    using beast::iequals;
-    auto const ext = [&path]
-        {
-            auto const pos = path.rfind(".");
-            if (pos == beast::string_view::npos)
-                return beast::string_view{};
-            return path.substr(pos);
-        }();
-        if (iequals(ext, ".htm"))  return "text/html";
-        if (iequals(ext, ".html")) return "text/html";
-        if (iequals(ext, ".php"))  return "text/html";
-        if (iequals(ext, ".css"))  return "text/css";
-        if (iequals(ext, ".txt"))  return "text/plain";
-        if (iequals(ext, ".js"))   return "application/javascript";
-        if (iequals(ext, ".json")) return "application/json";
-        if (iequals(ext, ".xml"))  return "application/xml";
-        if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-        if (iequals(ext, ".flv"))  return "video/x-flv";
-        if (iequals(ext, ".png"))  return "image/png";
-        if (iequals(ext, ".jpe"))  return "image/jpeg";
-        if (iequals(ext, ".jpeg")) return "image/jpeg";
-        if (iequals(ext, ".jpg"))  return "image/jpeg";
-        if (iequals(ext, ".gif"))  return "image/gif";
-        if (iequals(ext, ".bmp"))  return "image/bmp";
-        if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-        if (iequals(ext, ".tiff")) return "image/tiff";
-        if (iequals(ext, ".tif"))  return "image/tiff";
-        if (iequals(ext, ".svg"))  return "image/svg+xml";
-        if (iequals(ext, ".svgz")) return "image/svg+xml";
+    auto const pos = path.rfind(".");
+    if (pos == beast::string_view::npos)
         return "application/text";
+    auto const ext = path.substr(pos);
+    for (auto const& m : mime_types)
+        if (beast::iequals(ext, m.ext))
+            return m.type;
+    return "application/text";
 }
 
-std::string
+// Builds doc_root + target into result, reusing its capacity.
+void
 path_cat(
+    std::string& result,
     beast::string_view base,
     beast::string_view path)
 {
-    if (base.empty())
-        return std::string(path);
-    std::string result(base);
+    result.assign(base.data(), base.size());
+    if (result.empty()) {
+        result.append(path.data(), path.size());
+        return;
+    }
 #ifdef BOOST_MSVC
     char constexpr path_separator = '\\';
     if (result.back() == path_separator)
@@ -62,151 +80,133 @@ path_cat(
         result.resize(result.size() - 1);
     result.append(path.data(), path.size());
 #endif
-    return result;
 }
 
 
+http_session::
+http_session(
+    tcp::socket&& socket,
+    boost::shared_ptr<shared_state> const& state)
+    : stream_(std::move(socket))
+    , state_(state)
+{
+}
 
+void
+http_session::
+run()
+{
+    net::dispatch(
+        stream_.get_executor(),
+        beast::bind_front_handler(
+            &http_session::do_read,
+            shared_from_this()));
+}
 
 
+void
+http_session::
+fail(beast::error_code ec, char const* what)
+{
 
+    if (ec == net::error::operation_aborted)
+        return;
 
+    CHAT_LOG(warn, what, {{ "error", ec.message() }});
+}
 
+void
+http_session::
+do_read()
+{
+    // One read at a time, and none while the response queue is full or an
+    // upgrade is waiting for it to drain.
+    if (reading_ || closing_ || eof_ || upgrade_pending_ || queued_ >= queue_limit)
+        return;
+    reading_ = true;
 
+    // The parser lives in place and its fields come from request_alloc_,
+    // which rewinds once the previous request is destroyed here.
+    parser_.emplace(std::piecewise_construct, std::make_tuple(), std::make_tuple(request_alloc_));
 
 
 
+    parser_->body_limit(10000);
 
 
+    stream_.expires_after(std::chrono::seconds(30));
 
 
+    http::async_read(
+        stream_,
+        buffer_,
+        *parser_,
+        beast::bind_front_handler(
+            &http_session::on_read,
+            shared_from_this()));
+}
 
+void
+http_session::
+on_read(beast::error_code ec, std::size_t)
+{
+    reading_ = false;
 
 
+    if (ec == http::error::end_of_stream)
+    {
+        if (queued_ > 0) {
+            eof_ = true;
+            return;
+        }
+        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        return;
+    }
 
 
+    if (ec)
+        return fail(ec, "read");
 
+    // The socket is handed over on upgrade, so earlier responses have to
+    // be on the wire first.
+    if (websocket::is_upgrade(parser_->get()))
+    {
+        if (queued_ > 0) {
+            upgrade_pending_ = true;
+            return;
+        }
+        return handle_upgrade();
+    }
 
+    closing_ = !parser_->get().keep_alive();
+    handle_request();
+    do_read();
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-template <class Body, class Allocator>
-boost::optional<int>
-validate_auth(http::request<Body, http::basic_fields<Allocator>>& req,sqlite3* db)
+void
+http_session::
+handle_upgrade()
 {
-    
-    auto const unauthorized =
-        [&req](beast::string_view why)
-        {
-            http::response<http::string_body> res{ http::status::bad_request, req.version() };
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(http::field::content_type, "text/html");
-            res.keep_alive(req.keep_alive());
-            res.body() = std::string(why);
-            res.prepare_payload();
-            return res;
-        };
+    auto self = shared_from_this();
+    auto const& req = parser_->get();
 
     boost::urls::url_view uv(req.base().target());
-   std::optional< std::string> login=std::nullopt, password=std::nullopt;
+    std::optional< std::string> login = std::nullopt, login_reg = std::nullopt, password = std::nullopt,name=std::nullopt;
+    std::optional<std::string> resume = std::nullopt, epoch = std::nullopt, since = std::nullopt;
     for (auto v : uv.params()) {
-        if (v.key == "login") {
-            login.emplace(v.value);
+        if (v.key == "resume") {
+            resume.emplace(v.value);
         }
-        else if (v.key == "password") {
-            password.emplace(v.value);
+        else if (v.key == "epoch") {
+            epoch.emplace(v.value);
         }
-    }
-    if (login.has_value() && password.has_value()) {
-        
-        std::string sql = "SELECT id FROM Users WHERE login=? AND pass=?";
-        sqlite3_stmt* stmt = NULL;
-        std::hash<std::string> str_hash;
-        std::string hashed_pass = SHA256HashString(password.value());
-        int rc=sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-        std::cout << login.value().c_str() << " log , pass " << password.value().c_str()<<std::endl;
-        sqlite3_bind_text(stmt, 1, login.value().c_str(), std::strlen(login.value().c_str()), NULL);
-        sqlite3_bind_text(stmt, 2, hashed_pass.c_str(), std::strlen(hashed_pass.c_str()), NULL);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            int ans = sqlite3_column_int(stmt, 0);
-            sqlite3_finalize(stmt);
-            boost::optional<int> r = boost::make_optional<int&>(ans);
-            return r;
-
+        else if (v.key == "since") {
+            since.emplace(v.value);
         }
-        else {
-            sqlite3_finalize(stmt);
-            return boost::none;
+        else if (v.key == "login_reg") {
+            login_reg.emplace(v.value);
         }
-    }
-    else {
-        return boost::none;
-    }
-}
-template <class Body, class Allocator>
-boost::optional<std::pair<int,std::string>>
-register_user(http::request<Body, http::basic_fields<Allocator>>& req,sqlite3* db)
-{
-    
-    auto const unauthorized =
-        [&req](beast::string_view why)
-        {
-            http::response<http::string_body> res{ http::status::bad_request, req.version() };
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(http::field::content_type, "text/html");
-            res.keep_alive(req.keep_alive());
-            res.body() = std::string(why);
-            res.prepare_payload();
-            return res;
-        };
-
-    boost::urls::url_view uv(req.base().target());
-    std::optional< std::string> login = std::nullopt, password = std::nullopt,name=std::nullopt;
-    for (auto v : uv.params()) {
-        if (v.key == "login_reg") {
+        else if (v.key == "login") {
             login.emplace(v.value);
         }
         else if (v.key == "password") {
@@ -216,364 +216,503 @@ register_user(http::request<Body, http::basic_fields<Allocator>>& req,sqlite3* d
             name.emplace(v.value);
         }
     }
-    if (login.has_value() && password.has_value()&&name.has_value()) {
-        
-        std::string sql = "INSERT INTO Users(login,pass,name) VALUES(?,?,?)";
-        sqlite3_stmt* stmt = NULL;
-        std::hash<std::string> str_hash;
-        std::string hashed_pass = SHA256HashString(password.value());
-        
-        int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-        sqlite3_bind_text(stmt, 1, login.value().c_str(), std::strlen(login.value().c_str()), NULL);
-        sqlite3_bind_text(stmt, 2, (hashed_pass).c_str(), std::strlen(hashed_pass.c_str()), NULL);
-        sqlite3_bind_text(stmt, 3, name.value().c_str(), std::strlen(name.value().c_str()), NULL);
-        if (sqlite3_step(stmt)== SQLITE_DONE) {
-            sqlite3_reset(stmt);
-            sqlite3_clear_bindings(stmt);
-            sql = "SELECT id FROM Users WHERE login=? AND pass=? AND name=?";
-            int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-            sqlite3_bind_text(stmt, 1, login.value().c_str(), std::strlen(login.value().c_str()), NULL);
-            sqlite3_bind_text(stmt, 2, (hashed_pass).c_str(), std::strlen(hashed_pass.c_str()), NULL);
-            sqlite3_bind_text(stmt, 3, name.value().c_str(), std::strlen(name.value().c_str()), NULL);
-            auto a = sqlite3_step(stmt);
-            if (a != SQLITE_DONE) {
-                std::pair<int, std::string> ans = { sqlite3_column_int(stmt, 0), 
-                name.value()};
-                sqlite3_finalize(stmt);
-                return boost::make_optional<std::pair<int, std::string>&>(ans);
-            }
-            else {
-                sqlite3_finalize(stmt);
-                return boost::none;
-            }
-            
-            
-            
-        }
-        else {
-            sqlite3_finalize(stmt);
-            return boost::none;
-        }
-    }
-    else {
-        return boost::none;
+
+    // A resume token is checked with an HMAC only: no hashing, no database.
+    if (resume.has_value()) {
+        auto const uid = verify_resume_token(resume.value());
+        if (!uid.has_value())
+            return send_error(http::status::unauthorized, "Invalid or expired token");
+        boost::optional<resume_point> from;
+        if (epoch.has_value() && since.has_value())
+            from = resume_point{
+                std::strtoull(epoch.value().c_str(), nullptr, 10),
+                std::strtoull(since.value().c_str(), nullptr, 10) };
+        boost::make_shared<websocket_session>(
+            stream_.release_socket(),
+            state_, static_cast<int>(uid.value()), from)->run(parser_->release());
+        return;
     }
+
+    bool const registering = login_reg.has_value() && password.has_value() && name.has_value();
+    if (!registering && !(login.has_value() && password.has_value()))
+        return send_error(http::status::bad_request, "Incorrect data");
+
+    beast::error_code ep_ec;
+    auto const ip = stream_.socket().remote_endpoint(ep_ec).address().to_string();
+    auto const& user = registering ? login_reg.value() : login.value();
+    if (!state_->allow_login(ip, user))
+        return send_error(http::status::too_many_requests, "Too many attempts, try again later");
+
+    // Hashing and the Users lookup run on the auth pool; the result is
+    // posted back to this session's executor.
+    auto ex = stream_.get_executor();
+    bool const queued = state_->auth_pool().post(
+        [self, ex, registering, user, password = password.value(), name = name.value_or("")](sqlite3* db)
+        {
+            boost::optional<int> id;
+            if (db) {
+                if (registering) {
+                    auto ans = register_user(db, user, password, name);
+                    if (ans)
+                        id = ans->first;
+                }
+                else {
+                    id = validate_auth(db, user, password);
+                }
+            }
+            net::post(ex,
+                [self, id, registering, name]
+                {
+                    self->on_auth(id, registering, name);
+                });
+        });
+    if (!queued)
+        return send_error(http::status::service_unavailable, "Server is busy, try again later");
 }
 
+void
+http_session::
+on_auth(boost::optional<int> id, bool registered, std::string const& name)
+{
+    if (!id.has_value())
+        return send_error(http::status::bad_request,
+            registered ? "That user already exists" : "Incorrect login or password");
 
+    if (registered)
+        state_->newUser(name, id.value());
 
+    boost::make_shared<websocket_session>(
+        stream_.release_socket(),
+        state_,id.value())->run(parser_->release());
+}
 
+void
+http_session::
+handle_request()
+{
+    auto const& req = parser_->get();
 
 
-template <class Body, class Allocator>
-http::message_generator
-handle_request(
-    beast::string_view doc_root,
-    http::request<Body, http::basic_fields<Allocator>>&& req)
-{
-    
-    auto const bad_request =
-        [&req](beast::string_view why)
-        {
-            http::response<http::string_body> res{ http::status::bad_request, req.version() };
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(http::field::content_type, "text/html");
-            res.keep_alive(req.keep_alive());
-            res.body() = std::string(why);
-            res.prepare_payload();
-            return res;
-        };
-
-    
-    auto const not_found =
-        [&req](beast::string_view target)
-        {
-            http::response<http::string_body> res{ http::status::not_found, req.version() };
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(http::field::content_type, "text/html");
-            res.keep_alive(req.keep_alive());
-            res.body() = "The resource '" + std::string(target) + "' was not found.";
-            res.prepare_payload();
-            return res;
-        };
-
-    
-    auto const server_error =
-        [&req](beast::string_view what)
-        {
-            http::response<http::string_body> res{ http::status::internal_server_error, req.version() };
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-            res.set(http::field::content_type, "text/html");
-            res.keep_alive(req.keep_alive());
-            res.body() = "An error occurred: '" + std::string(what) + "'";
-            res.prepare_payload();
-            return res;
-        };
-
-    
     if (req.method() != http::verb::get &&
         req.method() != http::verb::head&&req.method()!=http::verb::post)
-        return bad_request("Unknown HTTP-method");
+        return send_error(http::status::bad_request, "Unknown HTTP-method");
 
-    
-    if (req.target().empty() ||
-        req.target()[0] != '/' ||
-        req.target().find("..") != beast::string_view::npos)
-        return bad_request("Illegal request-target");
 
-    
-    std::string path = path_cat(doc_root, req.target());
-    if (req.target().back() == '/')
-        path.append("index.html");
+    auto target = req.target();
+    auto const query = target.find('?');
+    if (query != beast::string_view::npos)
+        target = target.substr(0, query);
+    if (target.empty() ||
+        target[0] != '/' ||
+        target.find("..") != beast::string_view::npos)
+        return send_error(http::status::bad_request, "Illegal request-target");
 
-    
-    beast::error_code ec;
-    http::file_body::value_type body;
-    body.open(path.c_str(), beast::file_mode::scan, ec);
+    if (target == "/metrics" && req.method() == http::verb::get)
+    {
+        auto& slot = prepare(http::status::ok);
+        slot.text = state_->metrics();
+        return send_text(slot, "text/plain; version=0.0.4");
+    }
 
-    
-    if (ec == boost::system::errc::no_such_file_or_directory)
-        return not_found(req.target());
+    if (target.substr(0, 5) == "/api/")
+        return handle_api(target.substr(5));
 
-    
-    if (ec)
-        return server_error(ec.message());
+    if (serve_file(target))
+        return;
 
-    
-    auto const size = body.size();
+    auto& slot = prepare(http::status::not_found);
+    slot.text.assign("The resource '");
+    slot.text.append(req.target().data(), req.target().size());
+    slot.text.append("' was not found.");
+    send_text(slot, "text/html");
+}
 
-    
-    if (req.method() == http::verb::head)
-    {
-        http::response<http::empty_body> res{ http::status::ok, req.version() };
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        res.set(http::field::content_type, mime_type(path));
-        res.content_length(size);
-        res.keep_alive(req.keep_alive());
-        return res;
+// Files under doc_root, answered from the file cache. Returns false when
+// there is no such file.
+bool
+http_session::
+serve_file(beast::string_view target)
+{
+    auto const& req = parser_->get();
+    path_cat(path_, state_->doc_root(), target);
+    if (target.back() == '/')
+        path_.append("index.html");
+
+    auto const accept_encoding = req[http::field::accept_encoding];
+    auto file = state_->files().lookup(path_,
+        std::string_view(accept_encoding.data(), accept_encoding.size()));
+    if (!file)
+        return false;
+
+    bool not_modified;
+#ifndef __linux__
+    beast::error_code ec;
+    http::file_body::value_type body;
+    if (!file->cached && req.method() != http::verb::head) {
+        body.open(file->path.c_str(), beast::file_mode::scan, ec);
+        if (ec) {
+            send_error(http::status::internal_server_error, ec.message());
+            return true;
+        }
+    }
+#endif
+    auto const if_none_match = req[http::field::if_none_match];
+    if (!if_none_match.empty())
+        not_modified = etag_matches(
+            std::string_view(if_none_match.data(), if_none_match.size()), file->etag);
+    else
+        not_modified = req[http::field::if_modified_since] == file->last_modified;
+
+    auto& slot = prepare(not_modified ? http::status::not_modified : http::status::ok);
+    auto& res = *slot.res;
+    res.set(http::field::content_type, mime_type(path_));
+    res.set(http::field::etag, file->etag);
+    res.set(http::field::last_modified, file->last_modified);
+    res.set(http::field::vary, "Accept-Encoding");
+    if (file->encoding)
+        res.set(http::field::content_encoding, file->encoding);
+
+    if (not_modified) {
+        slot.header_only = true;
+        commit(slot);
+        return true;
     }
 
-    
-    http::response<http::file_body> res{
-        std::piecewise_construct,
-        std::make_tuple(std::move(body)),
-        std::make_tuple(http::status::ok, req.version()) };
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, mime_type(path));
-    res.content_length(size);
-    res.keep_alive(req.keep_alive());
-    return res;
+    res.content_length(file->size);
+    if (req.method() == http::verb::head) {
+        slot.header_only = true;
+    }
+    else if (file->cached) {
+        // The body points into the cache entry, which the slot keeps alive.
+        res.body() = { file->body.data(), file->body.size() };
+        slot.file = std::move(file);
+    }
+    else {
+#ifdef __linux__
+        // Large files: header through Beast, body straight from the page cache.
+        slot.header_only = true;
+        slot.use_sendfile = true;
+        slot.file = std::move(file);
+#else
+        http::response<http::file_body> msg{
+            std::piecewise_construct,
+            std::make_tuple(std::move(body)),
+            std::make_tuple(http::status::ok, req.version()) };
+        for (auto const& field : res)
+            msg.set(field.name_string(), field.value());
+        msg.content_length(file->size);
+        slot.generic.emplace(std::move(msg));
+#endif
+    }
+    commit(slot);
+    return true;
 }
 
+// Authenticated with the resume token as a bearer token. The query runs on
+// the read pool; the slot is reserved now so the reply keeps its place in a
+// pipelined sequence.
+void
+http_session::
+handle_api(beast::string_view endpoint)
+{
+    auto const& req = parser_->get();
+    if (req.method() != http::verb::get)
+        return send_error(http::status::method_not_allowed, "Only GET is supported");
+
+    boost::optional<std::uint32_t> uid;
+    auto const authorization = req[http::field::authorization];
+    if (authorization.substr(0, 7) == "Bearer ")
+        uid = verify_resume_token(std::string(authorization.substr(7)));
+    if (!uid.has_value())
+    {
+        auto& slot = prepare(http::status::unauthorized);
+        slot.res->set(http::field::www_authenticate, "Bearer");
+        slot.text.assign("Invalid or expired token");
+        return send_text(slot, "text/html");
+    }
 
+    api_request request;
+    request.endpoint.assign(endpoint.data(), endpoint.size());
+    request.user_id = uid.value();
+    boost::urls::url_view uv(req.base().target());
+    for (auto v : uv.params())
+        request.params.emplace(std::string(v.key), std::string(v.value));
+    auto const if_none_match = req[http::field::if_none_match];
+    request.if_none_match.assign(if_none_match.data(), if_none_match.size());
+    auto const accept_encoding = req[http::field::accept_encoding];
+    request.accept_gzip = accepts_encoding(
+        std::string_view(accept_encoding.data(), accept_encoding.size()), "gzip");
+
+    auto& slot = prepare(http::status::ok);
+    std::size_t const index = &slot - queue_.data();
+    auto ex = stream_.get_executor();
+    bool const queued = state_->read_pool().post(
+        [self = shared_from_this(), ex, index, request = std::move(request)](sqlite3* db)
+        {
+            api_response res;
+            if (db)
+                res = ::handle_api(db, request);
+            else
+                res.status = http::status::service_unavailable;
+            net::post(ex,
+                [self, index, res = std::move(res)]() mutable
+                {
+                    self->on_api(index, std::move(res));
+                });
+        });
+    if (!queued)
+    {
+        slot.res->result(http::status::service_unavailable);
+        slot.text.assign("Server is busy, try again later");
+        send_text(slot, "text/html");
+    }
+}
 
-
+void
 http_session::
-http_session(
-    tcp::socket&& socket,
-    boost::shared_ptr<shared_state> const& state)
-    : stream_(std::move(socket))
-    , state_(state)
+on_api(std::size_t index, api_response res)
 {
-    int res = sqlite3_open(state_->db_root().c_str(), &db);
-    if (res != SQLITE_OK) {
-        sqlite3_close(db);
-        fail(boost::asio::error::fault, "unable to connect with db");
-        
+    auto& slot = queue_[index];
+    slot.res->result(res.status);
+    if (!res.etag.empty())
+        slot.res->set(http::field::etag, res.etag);
+    slot.res->set(http::field::cache_control, "private, no-cache");
+    slot.res->set(http::field::vary, "Accept-Encoding, Authorization");
+    if (res.status == http::status::not_modified)
+    {
+        slot.header_only = true;
+        return commit(slot);
     }
-    sqlite3_busy_timeout(db, 5000);
+    if (res.gzip)
+        slot.res->set(http::field::content_encoding, "gzip");
+    slot.text.swap(res.body);
+    send_text(slot, "application/json");
 }
+
+http_session::response_slot&
 http_session::
-~http_session()  
+prepare(http::status status)
 {
-    
-    sqlite3_close(db);
+    auto const& req = parser_->get();
+    auto& slot = queue_[(head_ + queued_) % queue_limit];
+    slot.res.emplace(std::piecewise_construct, std::make_tuple(), std::make_tuple(slot.alloc));
+    slot.res->result(status);
+    slot.res->version(req.version());
+    slot.res->set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    slot.res->keep_alive(req.keep_alive());
+    slot.keep_alive = slot.res->keep_alive();
+    slot.ready = false;
+    slot.header_only = false;
+    slot.use_sendfile = false;
+    ++queued_;
+    return slot;
 }
+
 void
 http_session::
-run()
+send_text(response_slot& slot, beast::string_view content_type)
 {
-    do_read();
+    slot.res->set(http::field::content_type, content_type);
+    slot.res->body() = { slot.text.data(), slot.text.size() };
+    slot.res->content_length(slot.text.size());
+    commit(slot);
 }
 
-
 void
 http_session::
-fail(beast::error_code ec, char const* what)
+send_error(http::status status, beast::string_view why)
 {
-    
-    if (ec == net::error::operation_aborted)
-        return;
-
-    std::cerr << what << ": " << ec.message() << "\n";
+    auto& slot = prepare(status);
+    slot.text.assign(why.data(), why.size());
+    send_text(slot, "text/html");
 }
 
 void
 http_session::
-do_read()
+commit(response_slot& slot)
 {
-    
-    parser_.emplace();
-
-    
-    
-    parser_->body_limit(10000);
+    slot.ready = true;
+    if (!writing_ && queue_[head_].ready)
+        do_write();
+}
 
-    
+void
+http_session::
+do_write()
+{
+    auto& slot = queue_[head_];
+    writing_ = true;
     stream_.expires_after(std::chrono::seconds(30));
+    if (slot.generic)
+    {
+        beast::async_write(
+            stream_, std::move(*slot.generic),
+            beast::bind_front_handler(
+                &http_session::on_write,
+                shared_from_this()));
+        return;
+    }
 
-    
-    http::async_read(
-        stream_,
-        buffer_,
-        parser_->get(),
-        beast::bind_front_handler(
-            &http_session::on_read,
-            shared_from_this()));
+    slot.sr.emplace(*slot.res);
+    if (slot.header_only)
+        http::async_write_header(
+            stream_, *slot.sr,
+            beast::bind_front_handler(
+                &http_session::on_write,
+                shared_from_this()));
+    else
+        http::async_write(
+            stream_, *slot.sr,
+            beast::bind_front_handler(
+                &http_session::on_write,
+                shared_from_this()));
 }
 
 void
 http_session::
-on_read(beast::error_code ec, std::size_t)
+on_write(beast::error_code ec, std::size_t)
 {
-    
-    if (ec == http::error::end_of_stream)
+
+    if (ec)
+        return fail(ec, "write");
+
+    auto& slot = queue_[head_];
+#ifdef __linux__
+    if (slot.use_sendfile)
+    {
+        slot.use_sendfile = false;
+        return send_file();
+    }
+#endif
+
+    bool const keep_alive = slot.keep_alive;
+    slot.sr.reset();
+    slot.res.reset();
+    slot.generic.reset();
+    slot.file.reset();
+    slot.ready = false;
+    head_ = (head_ + 1) % queue_limit;
+    --queued_;
+    writing_ = false;
+
+    if (!keep_alive)
     {
+
+
         stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
         return;
     }
 
-    
-    if (ec)
-        return fail(ec, "read");
-
+    if (queued_ > 0)
+    {
+        if (queue_[head_].ready)
+            do_write();
+        return do_read();
+    }
 
-    bool keep_alive;
-    auto self = shared_from_this();
+    if (upgrade_pending_)
+    {
+        upgrade_pending_ = false;
+        return handle_upgrade();
+    }
 
-    
-    auto req = parser_->get();
-    
-    if (websocket::is_upgrade(req))
+    if (eof_)
     {
-        
-        auto const unauthorized =
-            [&req](beast::string_view why)
-            {
-                http::response<http::string_body> res{ http::status::bad_request, req.version() };
-                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-                res.set(http::field::content_type, "text/html");
-                res.keep_alive(req.keep_alive());
-                res.body() = std::string(why);
-                res.prepare_payload();
-                return res;
-            };
-        boost::urls::url_view uv(req.base().target());
-        boost::optional<int> id = boost::none;
-        std::optional< std::string> login = std::nullopt, login_reg = std::nullopt, password = std::nullopt,name=std::nullopt;
-        for (auto v : uv.params()) {
-            if (v.key == "login_reg") {
-                login_reg.emplace(v.value);
-            }
-            else if (v.key == "login") {
-                login.emplace(v.value);
-            }
-            else if (v.key == "password") {
-                password.emplace(v.value);
-            }
-            else if (v.key == "name") {
-                name.emplace(v.value);
-            }
-        }
-        if (login_reg.has_value() && password.has_value()&&name.has_value()) {
-             boost::optional<std::pair<int,std::string>> ans = register_user(parser_->get(),db);
-            if (!ans.has_value()) {
-                std::cout << "Sending unauthorized response\n";
-                keep_alive = parser_->get().keep_alive();
-                auto rs = boost::make_optional<http::message_generator>(unauthorized("That user already exists"));
-                beast::async_write(
-                    stream_, std::move(*rs),
-                    [self, keep_alive](beast::error_code ec, std::size_t bytes)
-                    {
-                        self->on_write(ec, bytes, keep_alive);
-                    });
-                return;
-            }
-            else {
-                id.emplace(std::get<0>(ans.value()));
-                state_->newUser(std::get<1>(ans.value()), std::get<0>(ans.value()));
-            }
-        }
-        else if (login.has_value() && password.has_value()) {
-             id = validate_auth(parser_->get(),db);
-            if (!id.has_value()) {
-                std::cout << "Sending unauthorized response\n";
-                keep_alive = parser_->get().keep_alive();
-                auto rs = boost::make_optional<http::message_generator>(unauthorized("Incorrect login or password"));
-                beast::async_write(
-                    stream_, std::move(*rs),
-                    [self, keep_alive](beast::error_code ec, std::size_t bytes)
-                    {
-                        self->on_write(ec, bytes, keep_alive);
-                    });
-                return;
-            }
-        }
-        else {
-            
-            auto rs = boost::make_optional<http::message_generator>(unauthorized("Incorrect data"));
-            std::cout << "Sending unauthorized response\n";
-            keep_alive = parser_->get().keep_alive();
-            
-            beast::async_write(
-                stream_, std::move(*rs),
-                [self, keep_alive](beast::error_code ec, std::size_t bytes)
-                {
-                    self->on_write(ec, bytes, keep_alive);
-                });
-            return;
-        }
-        
-        
-        boost::make_shared<websocket_session>(
-            stream_.release_socket(),
-            state_,id.value())->run(parser_->release());
+        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
         return;
     }
 
-    
-    http::message_generator msg =
-        handle_request(state_->doc_root(), parser_->release());
 
-    
-    keep_alive = msg.keep_alive();
+    do_read();
+}
 
-    
-    beast::async_write(
-        stream_, std::move(msg),
-        [self, keep_alive](beast::error_code ec, std::size_t bytes)
-        {
-            self->on_write(ec, bytes, keep_alive);
-        });
+#ifdef __linux__
+struct http_session::file_transfer
+{
+    int fd = -1;
+    off_t offset = 0;
+    off_t size = 0;
+    // The raw socket wait is outside tcp_stream, so its timeout does not apply.
+    net::steady_timer deadline;
+
+    explicit file_transfer(net::any_io_executor ex)
+        : deadline(std::move(ex))
+    {
+    }
 
-}
+    ~file_transfer()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+};
 
 void
 http_session::
-on_write(beast::error_code ec, std::size_t, bool keep_alive)
+send_file()
 {
-    
-    if (ec)
-        return fail(ec, "write");
+    auto const& file = queue_[head_].file;
+    int const fd = ::open(file->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return fail(beast::error_code(errno, beast::system_category()), "open");
 
-    if (!keep_alive)
+    beast::error_code ec;
+    stream_.socket().native_non_blocking(true, ec);
+    if (ec)
     {
-        
-        
-        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
-        return;
+        ::close(fd);
+        return fail(ec, "sendfile");
     }
+    auto transfer = std::make_shared<file_transfer>(stream_.get_executor());
+    transfer->fd = fd;
+    transfer->size = static_cast<off_t>(file->size);
+    do_sendfile(std::move(transfer));
+}
 
-    
-    do_read();
-}
\ No newline at end of file
+void
+http_session::
+do_sendfile(std::shared_ptr<file_transfer> transfer)
+{
+    auto& socket = stream_.socket();
+    while (transfer->offset < transfer->size)
+    {
+        auto const chunk = std::min<off_t>(transfer->size - transfer->offset, 1 << 20);
+        auto const n = ::sendfile(socket.native_handle(), transfer->fd, &transfer->offset, chunk);
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // A peer that stops reading for 30 s loses the connection, as in do_write.
+            transfer->deadline.expires_after(std::chrono::seconds(30));
+            transfer->deadline.async_wait(
+                [self = shared_from_this()](beast::error_code ec)
+                {
+                    if (ec)
+                        return;
+                    self->fail(beast::error::timeout, "sendfile");
+                    self->stream_.socket().close(ec);
+                });
+            socket.async_wait(tcp::socket::wait_write,
+                [self = shared_from_this(), transfer](beast::error_code ec)
+                {
+                    transfer->deadline.cancel();
+                    if (ec)
+                        return self->fail(ec, "sendfile");
+                    self->do_sendfile(transfer);
+                });
+            return;
+        }
+        // The file shrank under us or the peer went away; the length we
+        // promised can no longer be honoured, so drop the connection.
+        beast::error_code const error = n < 0
+            ? beast::error_code(errno, beast::system_category())
+            : beast::error_code(net::error::eof);
+        beast::error_code ec;
+        socket.shutdown(tcp::socket::shutdown_both, ec);
+        return fail(error, "sendfile");
+    }
+    on_write({}, static_cast<std::size_t>(transfer->size));
+}
+#endif
@@ -4,34 +4,86 @@
 #include "net.hpp"
 #include "beast.hpp"
 #include "shared_state.hpp"
+#include "file_cache.hpp"
+#include "fields_alloc.hpp"
+#include "rest_api.hpp"
 #include <boost/optional.hpp>
 #include <boost/smart_ptr.hpp>
+#include <array>
 #include <cstdlib>
 #include <memory>
-#include <boost/optional.hpp>
-#include "sqlite/sqlite3.h"
+#include <string>
 
 class http_session : public boost::enable_shared_from_this<http_session>
 {
+    using fields_type = http::basic_fields<fields_alloc<char>>;
+    using response_type = http::response<http::span_body<char const>, fields_type>;
+
+    // One queued response. The body is a span into text (generated replies)
+    // or into a cached file; large files follow the header via sendfile.
+    // A slot is taken when its request is parsed and may be filled later
+    // (API reads); it is written once it is ready and at the head.
+    // Everything here is reused by the next response in the same slot.
+    struct response_slot
+    {
+        fields_alloc<char> alloc{ 4096 };
+        boost::optional<response_type> res;
+        boost::optional<http::response_serializer<http::span_body<char const>, fields_type>> sr;
+        boost::optional<http::message_generator> generic;
+        std::shared_ptr<file_cache::entry const> file;
+        std::string text;
+        bool ready = false;
+        bool header_only = false;
+        bool use_sendfile = false;
+        bool keep_alive = true;
+    };
+
+    // Requests are read ahead while earlier responses are still being
+    // written (HTTP/1.1 pipelining); responses leave in request order.
+    static constexpr std::size_t queue_limit = 8;
+
     beast::tcp_stream stream_;
     beast::flat_buffer buffer_;
     boost::shared_ptr<shared_state> state_;
-    sqlite3* db;
-    boost::optional<http::request_parser<http::string_body>> parser_;
+    fields_alloc<char> request_alloc_{ 8192 };
+    boost::optional<http::request_parser<http::string_body, fields_alloc<char>>> parser_;
+    std::array<response_slot, queue_limit> queue_;
+    std::size_t head_ = 0;
+    std::size_t queued_ = 0;
+    bool reading_ = false;
+    bool writing_ = false;
+    bool closing_ = false;
+    bool upgrade_pending_ = false;
+    bool eof_ = false;
+    std::string path_;
 
-    struct send_lambda;
+#ifdef __linux__
+    struct file_transfer;
+    void send_file();
+    void do_sendfile(std::shared_ptr<file_transfer> transfer);
+#endif
 
     void fail(beast::error_code ec, char const* what);
     void do_read();
     void on_read(beast::error_code ec, std::size_t);
-    void on_write(beast::error_code ec, std::size_t, bool close);
+    void do_write();
+    void on_write(beast::error_code ec, std::size_t);
+    void handle_request();
+    void handle_upgrade();
+    void on_auth(boost::optional<int> id, bool registered, std::string const& name);
+    bool serve_file(beast::string_view target);
+    void handle_api(beast::string_view target);
+    void on_api(std::size_t index, api_response res);
+    response_slot& prepare(http::status status);
+    void send_text(response_slot& slot, beast::string_view content_type);
+    void send_error(http::status status, beast::string_view why);
+    void commit(response_slot& slot);
 
 public:
     http_session(
         tcp::socket&& socket,
         boost::shared_ptr<shared_state> const& state);
-    ~http_session();
     void run();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,54 @@
+#include "io_context_pool.hpp"
+#include <iostream>
+#include <thread>
+
+io_context_pool::
+io_context_pool(std::size_t contexts, std::size_t threads_per_context)
+    : threads_per_context_(threads_per_context == 0 ? 1 : threads_per_context)
+{
+    if (contexts == 0)
+        contexts = 1;
+    contexts_.reserve(contexts);
+    work_.reserve(contexts);
+    for (std::size_t i = 0; i < contexts; ++i) {
+        contexts_.emplace_back(std::make_unique<net::io_context>(
+            threads_per_context_ == 1 ? 1 : static_cast<int>(threads_per_context_)));
+        work_.emplace_back(net::make_work_guard(*contexts_.back()));
+    }
+}
+
+net::io_context&
+io_context_pool::
+get_io_context()
+{
+    return *contexts_[next_.fetch_add(1, std::memory_order_relaxed) % contexts_.size()];
+}
+
+void
+io_context_pool::
+run()
+{
+    std::vector<std::thread> v;
+    v.reserve(contexts_.size() * threads_per_context_);
+    for (auto& ioc : contexts_)
+        for (std::size_t i = 0; i < threads_per_context_; ++i)
+            v.emplace_back(
+                [&ioc]
+                {
+                    std::cout << "Starting ioc" << std::endl;
+                    ioc->run();
+                });
+
+    for (auto& t : v)
+        t.join();
+}
+
+void
+io_context_pool::
+stop()
+{
+    for (auto& w : work_)
+        w.reset();
+    for (auto& ioc : contexts_)
+        ioc->stop();
+}
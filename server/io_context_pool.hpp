@@ -0,0 +1,34 @@
+#ifndef BOOST_BEAST_EXAMPLE_WEBSOCKET_CHAT_MULTI_IO_CONTEXT_POOL_HPP
+#define BOOST_BEAST_EXAMPLE_WEBSOCKET_CHAT_MULTI_IO_CONTEXT_POOL_HPP
+
+#include "net.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Either one io_context shared by several threads, or one io_context per
+// thread (thread-per-core). In the latter mode a socket created on a context
+// stays on that thread for its whole life.
+class io_context_pool
+{
+    std::vector<std::unique_ptr<net::io_context>> contexts_;
+    std::vector<net::executor_work_guard<net::io_context::executor_type>> work_;
+    std::size_t threads_per_context_;
+    std::atomic<std::size_t> next_{ 0 };
+
+public:
+    io_context_pool(std::size_t contexts, std::size_t threads_per_context);
+    io_context_pool(io_context_pool const&) = delete;
+    io_context_pool& operator=(io_context_pool const&) = delete;
+
+    net::io_context& get_io_context();
+    net::io_context& at(std::size_t i) { return *contexts_[i]; }
+    std::size_t size() const noexcept { return contexts_.size(); }
+    bool concurrent() const noexcept { return threads_per_context_ > 1; }
+
+    void run();
+    void stop();
+};
+
+#endif
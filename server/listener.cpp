@@ -1,14 +1,29 @@
 #include "listener.hpp"
+#include "chat_metrics.hpp"
+#include "logger.hpp"
 #include "http_session.hpp"
+#include "io_context_pool.hpp"
 #include <iostream>
 
+#if defined(SO_REUSEPORT)
+typedef net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+#if defined(TCP_DEFER_ACCEPT)
+typedef net::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT> defer_accept;
+#endif
+
 listener::
 listener(
-    net::io_context& ioc,
+    io_context_pool& pool,
+    std::size_t index,
     tcp::endpoint endpoint,
-    boost::shared_ptr<shared_state> const& state)
-    : ioc_(ioc)
-    , acceptor_(ioc)
+    boost::shared_ptr<shared_state> const& state,
+    listener_options const& options)
+    : pool_(pool)
+    , index_(index)
+    , options_(options)
+    , acceptor_(pool.at(index))
+    , backoff_(pool.at(index))
     , state_(state)
 {
     beast::error_code ec;
@@ -16,29 +31,54 @@ listener(
     acceptor_.open(endpoint.protocol(), ec);
     if (ec)
     {
-        fail(ec, "open");
+        abandon(ec, "open");
         return;
     }
 
     acceptor_.set_option(net::socket_base::reuse_address(true), ec);
     if (ec)
     {
-        fail(ec, "set_option");
+        abandon(ec, "set_option");
         return;
     }
 
+    if (options_.reuse_port)
+    {
+#if defined(SO_REUSEPORT)
+        acceptor_.set_option(reuse_port(true), ec);
+        if (ec)
+        {
+            abandon(ec, "set_option(SO_REUSEPORT)");
+            return;
+        }
+#else
+        std::cerr << "SO_REUSEPORT is not supported on this platform\n";
+        options_.reuse_port = false;
+#endif
+    }
+
+    if (options_.defer_accept > 0)
+    {
+#if defined(TCP_DEFER_ACCEPT)
+        acceptor_.set_option(defer_accept(options_.defer_accept), ec);
+        if (ec)
+            fail(ec, "set_option(TCP_DEFER_ACCEPT)");
+#else
+        std::cerr << "TCP_DEFER_ACCEPT is not supported on this platform\n";
+#endif
+    }
+
     acceptor_.bind(endpoint, ec);
     if (ec)
     {
-        fail(ec, "bind");
+        abandon(ec, "bind");
         return;
     }
 
-    acceptor_.listen(
-        net::socket_base::max_listen_connections, ec);
+    acceptor_.listen(options_.backlog, ec);
     if (ec)
     {
-        fail(ec, "listen");
+        abandon(ec, "listen");
         return;
     }
 }
@@ -47,11 +87,32 @@ void
 listener::
 run()
 {
-    acceptor_.async_accept(
-        net::make_strand(ioc_),
-        beast::bind_front_handler(
-            &listener::on_accept,
-            shared_from_this()));
+    // The constructor closes the acceptor when it cannot listen.
+    if (acceptor_.is_open())
+        do_accept();
+}
+
+void
+listener::
+do_accept()
+{
+    // With one acceptor per context the session stays on the context that
+    // accepted it; otherwise connections are spread round-robin.
+    auto& ioc = options_.reuse_port && !pool_.concurrent()
+        ? pool_.at(index_)
+        : pool_.get_io_context();
+    if (pool_.concurrent())
+        acceptor_.async_accept(
+            net::make_strand(ioc),
+            beast::bind_front_handler(
+                &listener::on_accept,
+                shared_from_this()));
+    else
+        acceptor_.async_accept(
+            ioc,
+            beast::bind_front_handler(
+                &listener::on_accept,
+                shared_from_this()));
 }
 
 void
@@ -60,7 +121,27 @@ fail(beast::error_code ec, char const* what)
 {
     if (ec == net::error::operation_aborted)
         return;
-    std::cerr << what << ": " << ec.message() << "\n";
+    CHAT_LOG(warn, what, {{ "error", ec.message() }});
+}
+
+// Logs a setup failure and closes the acceptor, so run() does nothing.
+void
+listener::
+abandon(beast::error_code ec, char const* what)
+{
+    fail(ec, what);
+    beast::error_code ignored;
+    acceptor_.close(ignored);
+}
+
+// Out of descriptors or kernel memory: accepting again may succeed shortly.
+static bool
+is_transient(beast::error_code ec)
+{
+    return ec == boost::system::errc::too_many_files_open
+        || ec == boost::system::errc::too_many_files_open_in_system
+        || ec == boost::system::errc::no_buffer_space
+        || ec == boost::system::errc::not_enough_memory;
 }
 
 void
@@ -68,16 +149,32 @@ listener::
 on_accept(beast::error_code ec, tcp::socket socket)
 {
     if (ec)
-        return fail(ec, "accept");
-    else
-        boost::make_shared<http_session>(
-            std::move(socket),
-            state_)->run();
+    {
+        if (ec == net::error::operation_aborted || !acceptor_.is_open())
+            return;
+        fail(ec, "accept");
+        chat_metrics::accept_errors.inc();
+        // The peer reset the connection before we took it; the acceptor is fine.
+        if (ec == net::error::connection_aborted)
+            return do_accept();
+        if (!is_transient(ec))
+            return;
+        // Typically EMFILE/ENFILE during a reconnect storm: back off briefly
+        // instead of either spinning or giving up on the acceptor.
+        backoff_.expires_after(std::chrono::milliseconds(50));
+        backoff_.async_wait(
+            [self = shared_from_this()](beast::error_code ec)
+            {
+                if (!ec)
+                    self->do_accept();
+            });
+        return;
+    }
 
-    acceptor_.async_accept(
-        net::make_strand(ioc_),
-        beast::bind_front_handler(
-            &listener::on_accept,
-            shared_from_this()));
+    chat_metrics::connections_accepted.inc();
+    boost::make_shared<http_session>(
+        std::move(socket),
+        state_)->run();
 
+    do_accept();
 }
\ No newline at end of file
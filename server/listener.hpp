@@ -4,27 +4,47 @@
 #include "beast.hpp"
 #include "net.hpp"
 #include <boost/smart_ptr.hpp>
+#include <cstddef>
 #include <memory>
 #include <string>
 
 class shared_state;
+class io_context_pool;
+
+struct listener_options
+{
+    // One acceptor per IO thread bound with SO_REUSEPORT; the kernel spreads
+    // incoming connections across them.
+    bool reuse_port = false;
+    int backlog = net::socket_base::max_listen_connections;
+    // Seconds to wait for the first request bytes before the accept completes
+    // (TCP_DEFER_ACCEPT, Linux only). 0 disables it.
+    int defer_accept = 0;
+};
 
 class listener : public boost::enable_shared_from_this<listener>
 {
-    net::io_context& ioc_;
+    io_context_pool& pool_;
+    std::size_t index_;
+    listener_options options_;
     tcp::acceptor acceptor_;
+    net::steady_timer backoff_;
     boost::shared_ptr<shared_state> state_;
 
     void fail(beast::error_code ec, char const* what);
+    void abandon(beast::error_code ec, char const* what);
+    void do_accept();
     void on_accept(beast::error_code ec, tcp::socket socket);
 
 public:
     listener(
-        net::io_context& ioc,
+        io_context_pool& pool,
+        std::size_t index,
         tcp::endpoint endpoint,
-        boost::shared_ptr<shared_state> const& state);
+        boost::shared_ptr<shared_state> const& state,
+        listener_options const& options = {});
 
     void run();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,344 @@
+#include "logger.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace logging {
+
+namespace detail {
+std::atomic<std::uint8_t> min_level{ static_cast<std::uint8_t>(severity::info) };
+}
+
+namespace {
+
+metrics::counter dropped_records{ "log_dropped_records_total",
+    "Log records dropped because the ring was full." };
+
+constexpr std::size_t max_fields = 8;
+constexpr std::size_t text_size = 224;
+
+// Fixed-size binary record; string values live in text.
+struct record
+{
+    struct stored_field
+    {
+        char const* key;
+        field::kind type;
+        std::uint16_t offset;
+        std::uint16_t length;
+        union
+        {
+            std::int64_t i;
+            std::uint64_t u;
+            double d;
+            bool b;
+        };
+    };
+
+    std::int64_t time_us;
+    char const* message;
+    std::uint32_t thread;
+    std::uint32_t sample;
+    severity level;
+    std::uint8_t count;
+    stored_field fields[max_fields];
+    char text[text_size];
+};
+
+std::uint32_t
+this_thread_index()
+{
+    static std::atomic<std::uint32_t> next{ 0 };
+    thread_local std::uint32_t const index = next.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+void
+fill(record& r, severity level, char const* message,
+    std::initializer_list<field> fields, std::uint32_t sample)
+{
+    r.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    r.message = message;
+    r.thread = this_thread_index();
+    r.sample = sample;
+    r.level = level;
+    r.count = 0;
+    std::size_t used = 0;
+    for (auto const& f : fields) {
+        if (r.count == max_fields)
+            break;
+        auto& out = r.fields[r.count++];
+        out.key = f.key;
+        out.type = f.type;
+        switch (f.type) {
+        case field::kind::i64: out.i = f.i; break;
+        case field::kind::u64: out.u = f.u; break;
+        case field::kind::f64: out.d = f.d; break;
+        case field::kind::boolean: out.b = f.b; break;
+        case field::kind::str: break;
+        }
+        if (f.type == field::kind::str) {
+            std::size_t const n = std::min(f.s.size(), text_size - used);
+            std::memcpy(r.text + used, f.s.data(), n);
+            out.offset = static_cast<std::uint16_t>(used);
+            out.length = static_cast<std::uint16_t>(n);
+            used += n;
+        }
+    }
+}
+
+char const*
+severity_name(severity level)
+{
+    switch (level) {
+    case severity::trace: return "trace";
+    case severity::debug: return "debug";
+    case severity::info:  return "info";
+    case severity::warn:  return "warn";
+    case severity::error: return "error";
+    default:              return "off";
+    }
+}
+
+void
+append_quoted(std::string& out, char const* p, std::size_t n)
+{
+    bool plain = n > 0;
+    for (std::size_t i = 0; i < n && plain; ++i)
+        plain = p[i] > ' ' && p[i] != '"' && p[i] != '=' && p[i] != '\\';
+    if (plain) {
+        out.append(p, n);
+        return;
+    }
+    out += '"';
+    for (std::size_t i = 0; i < n; ++i) {
+        switch (p[i]) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:   out += p[i];
+        }
+    }
+    out += '"';
+}
+
+// ts=2026-10-19T03:09:32.123456Z level=info thread=3 msg="..." key=value ...
+void
+format(std::string& out, record const& r)
+{
+    std::time_t const secs = static_cast<std::time_t>(r.time_us / 1000000);
+    std::tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &secs);
+#else
+    gmtime_r(&secs, &tm);
+#endif
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "ts=%04d-%02d-%02dT%02d:%02d:%02d.%06dZ level=",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        static_cast<int>(r.time_us % 1000000));
+    out += buf;
+    out += severity_name(r.level);
+    out += " thread=";
+    out += std::to_string(r.thread);
+    out += " msg=";
+    append_quoted(out, r.message, std::strlen(r.message));
+    for (std::size_t i = 0; i < r.count; ++i) {
+        auto const& f = r.fields[i];
+        out += ' ';
+        out += f.key;
+        out += '=';
+        switch (f.type) {
+        case field::kind::i64: out += std::to_string(f.i); break;
+        case field::kind::u64: out += std::to_string(f.u); break;
+        case field::kind::f64:
+            std::snprintf(buf, sizeof(buf), "%.6g", f.d);
+            out += buf;
+            break;
+        case field::kind::boolean: out += f.b ? "true" : "false"; break;
+        case field::kind::str: append_quoted(out, r.text + f.offset, f.length); break;
+        }
+    }
+    if (r.sample > 1) {
+        out += " sample=1/";
+        out += std::to_string(r.sample);
+    }
+    out += '\n';
+}
+
+// Bounded multi-producer queue (Vyukov): each slot carries a sequence number
+// that tells producers and the consumer whose turn it is, so a push is one
+// CAS on the tail plus a copy into the slot.
+class logger
+{
+    struct alignas(64) slot
+    {
+        std::atomic<std::size_t> seq;
+        record r;
+    };
+
+    std::unique_ptr<slot[]> slots_;
+    std::size_t const mask_;
+    alignas(64) std::atomic<std::size_t> tail_{ 0 };
+    alignas(64) std::size_t head_ = 0;
+    std::FILE* out_;
+    bool const owns_out_;
+    std::atomic<bool> stopped_{ false };
+    std::thread thread_;
+
+    static std::size_t
+    round_up(std::size_t n)
+    {
+        std::size_t c = 64;
+        while (c < n)
+            c <<= 1;
+        return c;
+    }
+
+    bool
+    pop(std::string& line)
+    {
+        auto& s = slots_[head_ & mask_];
+        if (s.seq.load(std::memory_order_acquire) != head_ + 1)
+            return false;
+        format(line, s.r);
+        s.seq.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+        return true;
+    }
+
+    void
+    run()
+    {
+        std::string batch;
+        for (;;) {
+            bool const stopping = stopped_.load(std::memory_order_acquire);
+            batch.clear();
+            while (batch.size() < 64 * 1024 && pop(batch))
+                ;
+            if (!batch.empty()) {
+                std::fwrite(batch.data(), 1, batch.size(), out_);
+                std::fflush(out_);
+                continue;
+            }
+            if (stopping)
+                return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+
+public:
+    logger(options const& opts, std::FILE* out, bool owns_out)
+        : slots_(new slot[round_up(opts.capacity)])
+        , mask_(round_up(opts.capacity) - 1)
+        , out_(out)
+        , owns_out_(owns_out)
+    {
+        for (std::size_t i = 0; i <= mask_; ++i)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~logger()
+    {
+        stopped_.store(true, std::memory_order_release);
+        thread_.join();
+        if (owns_out_)
+            std::fclose(out_);
+    }
+
+    bool
+    push(severity level, char const* message,
+        std::initializer_list<field> fields, std::uint32_t sample)
+    {
+        auto pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            auto& s = slots_[pos & mask_];
+            auto const seq = s.seq.load(std::memory_order_acquire);
+            auto const diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(s.r, level, message, fields, sample);
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+std::mutex instance_mutex;
+std::atomic<logger*> instance{ nullptr };
+
+} // (anon)
+
+severity
+parse_severity(char const* name, severity fallback)
+{
+    if (!name)
+        return fallback;
+    for (auto level : { severity::trace, severity::debug, severity::info,
+        severity::warn, severity::error, severity::off })
+        if (std::strcmp(name, severity_name(level)) == 0)
+            return level;
+    return fallback;
+}
+
+void
+start(options const& opts)
+{
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    if (instance.load())
+        return;
+    std::FILE* out = stderr;
+    bool owns = false;
+    if (!opts.file.empty()) {
+        if (auto f = std::fopen(opts.file.c_str(), "a")) {
+            out = f;
+            owns = true;
+        } else {
+            std::fprintf(stderr, "Unable to open log file %s, logging to stderr\n", opts.file.c_str());
+        }
+    }
+    detail::min_level.store(static_cast<std::uint8_t>(opts.level), std::memory_order_relaxed);
+    instance.store(new logger(opts, out, owns), std::memory_order_release);
+}
+
+void
+stop()
+{
+    std::lock_guard<std::mutex> lock(instance_mutex);
+    delete instance.exchange(nullptr);
+}
+
+void
+write(severity level, char const* message,
+    std::initializer_list<field> fields, std::uint32_t sample)
+{
+    if (auto l = instance.load(std::memory_order_acquire)) {
+        if (!l->push(level, message, fields, sample))
+            dropped_records.inc();
+        return;
+    }
+    record r;
+    fill(r, level, message, fields, sample);
+    std::string line;
+    format(line, r);
+    std::fwrite(line.data(), 1, line.size(), stderr);
+}
+
+} // logging
@@ -0,0 +1,116 @@
+#ifndef SRAVZ_LOGGER_HPP
+#define SRAVZ_LOGGER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Asynchronous structured logging. A record is a constant message plus a few
+// typed key/value fields; the caller copies it into a fixed-size slot of a
+// bounded lock-free ring and returns, and a background thread formats the
+// records as logfmt lines and writes them in batches. When the ring is full
+// records are dropped and counted (log_dropped_records_total) rather than
+// blocking an IO thread.
+//
+//     CHAT_LOG(info, "message stored", {{ "chat", chat_id }, { "bytes", n }});
+//     CHAT_LOG_EVERY(1000, debug, "packet relayed", {{ "channel", name }});
+//
+// The macros skip evaluating the fields when the level is disabled.
+namespace logging {
+
+enum class severity : std::uint8_t
+{
+    trace,
+    debug,
+    info,
+    warn,
+    error,
+    off
+};
+
+struct options
+{
+    severity level = severity::info;
+    std::string file;             // empty: stderr
+    std::size_t capacity = 8192;  // records, rounded up to a power of two
+};
+
+// Parses trace|debug|info|warn|error|off; anything else gives fallback.
+severity parse_severity(char const* name, severity fallback);
+
+// Starts the writer thread. Records written before start() go straight to
+// stderr. stop() drains the ring, joins the thread and frees the ring, so
+// every thread that logs must have stopped before it is called.
+void start(options const& opts);
+void stop();
+
+struct field
+{
+    enum class kind : std::uint8_t { i64, u64, f64, boolean, str };
+
+    char const* key;
+    kind type;
+    union
+    {
+        std::int64_t i;
+        std::uint64_t u;
+        double d;
+        bool b;
+    };
+    std::string_view s;
+
+    template<class T, typename std::enable_if<
+        std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0>
+    field(char const* k, T v) : key(k), type(kind::i64), i(v) {}
+
+    template<class T, typename std::enable_if<
+        std::is_integral<T>::value && !std::is_signed<T>::value &&
+        !std::is_same<T, bool>::value, int>::type = 0>
+    field(char const* k, T v) : key(k), type(kind::u64), u(v) {}
+
+    field(char const* k, double v) : key(k), type(kind::f64), d(v) {}
+    field(char const* k, bool v) : key(k), type(kind::boolean), b(v) {}
+    field(char const* k, std::string_view v) : key(k), type(kind::str), i(0), s(v) {}
+    field(char const* k, std::string const& v) : key(k), type(kind::str), i(0), s(v) {}
+    field(char const* k, char const* v) : key(k), type(kind::str), i(0), s(v ? v : "") {}
+};
+
+namespace detail {
+extern std::atomic<std::uint8_t> min_level;
+}
+
+inline bool
+enabled(severity level)
+{
+    return static_cast<std::uint8_t>(level) >=
+        detail::min_level.load(std::memory_order_relaxed);
+}
+
+// message and field keys must be string literals (they are not copied);
+// string values are copied, truncated if the record runs out of room.
+// sample is the 1-in-N rate the call site was sampled at, for the reader.
+void write(severity level, char const* message,
+    std::initializer_list<field> fields = {}, std::uint32_t sample = 1);
+
+} // logging
+
+#define CHAT_LOG(lvl, ...) \
+    do { \
+        if (::logging::enabled(::logging::severity::lvl)) \
+            ::logging::write(::logging::severity::lvl, __VA_ARGS__); \
+    } while (0)
+
+// Writes one record in every n per call site and thread, without any
+// shared counter. The field list is required ({} for none).
+#define CHAT_LOG_EVERY(n, lvl, message, ...) \
+    do { \
+        static thread_local std::uint32_t chat_log_seen_ = 0; \
+        if (::logging::enabled(::logging::severity::lvl) && chat_log_seen_++ % (n) == 0) \
+            ::logging::write(::logging::severity::lvl, message, __VA_ARGS__, (n)); \
+    } while (0)
+
+#endif
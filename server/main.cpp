@@ -1,9 +1,14 @@
+#include "io_context_pool.hpp"
 #include "listener.hpp"
+#include "logger.hpp"
 #include "shared_state.hpp"
 #include "subscriber.hpp"
 #include <boost/asio/signal_set.hpp>
 #include <boost/smart_ptr.hpp>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <thread>
 #include <vector>
 
 int
@@ -14,7 +19,26 @@ main(int argc, char* argv[])
         std::cerr <<
             "Usage: websocket-chat-multi <address> <port> <doc_root> <threads> <db_root>\n" <<
             "Example:\n" <<
-            "    websocket-chat-server 0.0.0.0 8080 . 5 .\\db.db\n";
+            "    websocket-chat-server 0.0.0.0 8080 . 5 .\\db.db\n" <<
+            "Environment:\n" <<
+            "    CHAT_RUNTIME=shared|per-core  (default: shared)\n" <<
+            "    CHAT_REUSEPORT=0|1            one SO_REUSEPORT acceptor per IO thread\n" <<
+            "    CHAT_ACCEPT_BACKLOG=<n>       listen() backlog\n" <<
+            "    CHAT_DEFER_ACCEPT=<seconds>   TCP_DEFER_ACCEPT timeout, 0 disables\n" <<
+            "    CHAT_AUTH_THREADS=<n>         password hashing threads (default: cores/2)\n" <<
+            "    CHAT_AUTH_QUEUE=<n>           pending logins before 503 (default: 256)\n" <<
+            "    CHAT_LOGIN_RATE=<n>           logins per second per IP (default: 5)\n" <<
+            "    CHAT_LOGIN_BURST=<n>          login burst per IP (default: 20)\n" <<
+            "    CHAT_TOKEN_SECRET=<secret>    HMAC key for resume tokens (default: random per run)\n" <<
+            "    CHAT_TOKEN_TTL=<seconds>      resume token lifetime (default: 86400)\n" <<
+            "    CHAT_VOICE_SECRET=<secret>    HMAC key shared with rtp_server for voice tokens\n" <<
+            "    CHAT_VOICE_TOKEN_TTL=<seconds> voice token lifetime (default: 120)\n" <<
+            "    CHAT_FILE_CACHE_MB=<n>        memory for cached static files (default: 32)\n" <<
+            "    CHAT_READ_THREADS=<n>         threads serving /api/ reads (default: 2)\n" <<
+            "    CHAT_READ_QUEUE=<n>           pending /api/ reads before 503 (default: 512)\n" <<
+            "    CHAT_LOG_LEVEL=<level>        trace|debug|info|warn|error|off (default: info)\n" <<
+            "    CHAT_LOG_FILE=<path>          append log records here (default: stderr)\n" <<
+            "    CHAT_LOG_BUFFER=<n>           records buffered before dropping (default: 8192)\n";
         return EXIT_FAILURE;
     }
     auto address = net::ip::make_address(argv[1]);
@@ -23,45 +47,70 @@ main(int argc, char* argv[])
     auto const threads = std::max<int>(1, std::atoi(argv[4]));
     auto topics_ = argv[5];
 
-    net::io_context ioc;
+    logging::options log_options;
+    log_options.level = logging::parse_severity(std::getenv("CHAT_LOG_LEVEL"), log_options.level);
+    if (char const* file = std::getenv("CHAT_LOG_FILE"))
+        log_options.file = file;
+    log_options.capacity = static_cast<std::size_t>(
+        std::max(1, getenv_or("CHAT_LOG_BUFFER", static_cast<int>(log_options.capacity))));
+    logging::start(log_options);
+
+    char const* runtime = std::getenv("CHAT_RUNTIME");
+    bool const per_core = runtime && std::string(runtime) == "per-core";
+
+    // shared:   one io_context run by threads-1 threads, sessions on strands.
+    // per-core: threads io_contexts with one thread each, sessions pinned to
+    //           the context they were accepted on.
+    io_context_pool pool(
+        per_core ? threads : 1,
+        per_core ? 1 : std::max<int>(1, threads - 1));
     net::io_context ioc_subscriber;
-    net::io_context ioc_publisher;
+
+    listener_options options;
+    options.reuse_port = getenv_or("CHAT_REUSEPORT", 0) != 0;
+    options.backlog = getenv_or("CHAT_ACCEPT_BACKLOG", options.backlog);
+    options.defer_accept = getenv_or("CHAT_DEFER_ACCEPT", 0);
+    std::size_t const acceptors = options.reuse_port
+        ? (per_core ? pool.size() : static_cast<std::size_t>(std::max<int>(1, threads - 1)))
+        : 1;
 
     boost::shared_ptr<shared_state> shared_state_ = boost::make_shared<shared_state>(doc_root, topics_);
-    boost::shared_ptr<listener> listener_ = boost::make_shared<listener>(ioc, tcp::endpoint{ address, port }, shared_state_);
+    shared_state_->set_per_core(per_core);
+    std::vector<boost::shared_ptr<listener>> listeners_;
+    for (std::size_t i = 0; i < acceptors; ++i)
+        listeners_.push_back(boost::make_shared<listener>(
+            pool, per_core ? i : 0, tcp::endpoint{ address, port }, shared_state_, options));
     boost::shared_ptr<subscriber> subscriber_ = boost::make_shared<subscriber>(ioc_subscriber, shared_state_);
-   
-    listener_->run();
+
+    for (auto& l : listeners_)
+        l->run();
     subscriber_->subscribe();
+    shared_state_->run_symbol_eviction(pool.at(0));
 
-    net::signal_set signals(ioc, SIGINT, SIGTERM);
+    net::signal_set signals(pool.at(0), SIGINT, SIGTERM);
     signals.async_wait(
-        [&ioc, &ioc_subscriber, &ioc_publisher](boost::system::error_code const&, int)
+        [&pool, &ioc_subscriber](boost::system::error_code const&, int)
         {
-            ioc.stop();
+            pool.stop();
             ioc_subscriber.stop();
-            ioc_publisher.stop();
         });
 
-    std::vector<std::thread> v;
-    v.reserve(threads);
-    for (auto i = threads - 1; i > 0; --i)
-        v.emplace_back(
-            [&ioc]
-            {
-                std::cout << "Starting ioc" << std::endl;
-                ioc.run();
-            });
+    std::cout << "Runtime: " << (per_core ? "per-core" : "shared") << ", "
+              << pool.size() << " io_context(s), "
+              << acceptors << " acceptor(s)" << std::endl;
 
-    v.emplace_back(
+    std::thread subscriber_thread(
         [&ioc_subscriber]
         {
             std::cout << "Starting ioc_subscriber" << std::endl;
             ioc_subscriber.run();
         });
 
-    for (auto& t : v)
-        t.join();
+    pool.run();
+    subscriber_thread.join();
+    // The logger must outlive every thread that writes to it.
+    shared_state_->stop_workers();
+    logging::stop();
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,149 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace metrics {
+
+namespace {
+
+struct registry
+{
+    std::mutex mutex;
+    std::vector<metric const*> all;
+};
+
+registry&
+get_registry()
+{
+    static registry r;
+    return r;
+}
+
+} // (anon)
+
+metric::
+metric(char const* name, char const* help, char const* type, char const* labels)
+    : name_(name)
+    , help_(help)
+    , type_(type)
+    , labels_(labels)
+{
+    auto& r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.all.push_back(this);
+}
+
+void
+metric::
+write_name(std::ostream& out, char const* suffix, char const* extra) const
+{
+    out << name_ << suffix;
+    bool const has_labels = *labels_ != '\0';
+    bool const has_extra = *extra != '\0';
+    if (!has_labels && !has_extra)
+        return;
+    out << '{' << labels_;
+    if (has_labels && has_extra)
+        out << ',';
+    out << extra << '}';
+}
+
+std::uint64_t
+counter::
+value() const
+{
+    std::uint64_t total = 0;
+    for (auto const& s : shards_)
+        total += s.value.load(std::memory_order_relaxed);
+    return total;
+}
+
+void
+counter::
+write(std::ostream& out) const
+{
+    write_name(out, "");
+    out << ' ' << value() << '\n';
+}
+
+void
+gauge::
+write(std::ostream& out) const
+{
+    write_name(out, "");
+    out << ' ' << value() << '\n';
+}
+
+histogram::
+histogram(char const* name, char const* help, char const* labels,
+    double scale, std::size_t buckets)
+    : metric(name, help, "histogram", labels)
+    , scale_(scale)
+    , buckets_(std::min(buckets, max_buckets))
+{
+}
+
+void
+histogram::
+write(std::ostream& out) const
+{
+    // Shards are read without stopping writers, so a scrape may catch an
+    // observation in its bucket but not yet in the sum; the next one won't.
+    std::array<std::uint64_t, max_buckets + 1> counts{};
+    std::uint64_t sum = 0;
+    for (auto const& s : shards_) {
+        for (std::size_t i = 0; i <= buckets_; ++i)
+            counts[i] += s.buckets[i].load(std::memory_order_relaxed);
+        sum += s.sum.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t cumulative = 0;
+    char le[48];
+    for (std::size_t i = 0; i < buckets_; ++i) {
+        cumulative += counts[i];
+        std::snprintf(le, sizeof(le), "le=\"%.9g\"",
+            static_cast<double>(std::uint64_t(1) << i) * scale_);
+        write_name(out, "_bucket", le);
+        out << ' ' << cumulative << '\n';
+    }
+    cumulative += counts[buckets_];
+    write_name(out, "_bucket", "le=\"+Inf\"");
+    out << ' ' << cumulative << '\n';
+    write_name(out, "_sum");
+    out << ' ' << static_cast<double>(sum) * scale_ << '\n';
+    write_name(out, "_count");
+    out << ' ' << cumulative << '\n';
+}
+
+void
+render(std::ostream& out)
+{
+    std::vector<metric const*> all;
+    {
+        auto& r = get_registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        all = r.all;
+    }
+    std::stable_sort(all.begin(), all.end(),
+        [](metric const* a, metric const* b)
+        {
+            return std::strcmp(a->name(), b->name()) < 0;
+        });
+
+    auto const precision = out.precision(12);
+    char const* family = nullptr;
+    for (auto const* m : all) {
+        if (!family || std::strcmp(family, m->name()) != 0) {
+            family = m->name();
+            out << "# HELP " << family << ' ' << m->help() << '\n'
+                << "# TYPE " << family << ' ' << m->type() << '\n';
+        }
+        m->write(out);
+    }
+    out.precision(precision);
+}
+
+} // metrics
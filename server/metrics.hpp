@@ -0,0 +1,193 @@
+#ifndef SRAVZ_METRICS_HPP
+#define SRAVZ_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Counters, gauges and histograms exported in the Prometheus text format.
+// Counters and histograms are split into per-thread shards, each on its own
+// cache line: recording is one relaxed add on the caller's shard and a
+// scrape sums the shards. Metrics register themselves on construction and
+// must outlive every scrape, so they are meant to be globals.
+namespace metrics {
+
+constexpr std::size_t shard_count = 16;
+
+// Threads are numbered in order of their first recording; with more threads
+// than shards some of them share a shard, which stays correct because every
+// update is an atomic add.
+inline std::size_t
+this_shard()
+{
+    static std::atomic<std::size_t> next{ 0 };
+    thread_local std::size_t const shard =
+        next.fetch_add(1, std::memory_order_relaxed) % shard_count;
+    return shard;
+}
+
+class metric
+{
+public:
+    // labels is either empty or a Prometheus label list without braces,
+    // e.g. statement="insert_message". Metrics with the same name form one
+    // family and must have the same type.
+    metric(char const* name, char const* help, char const* type, char const* labels);
+    metric(metric const&) = delete;
+    metric& operator=(metric const&) = delete;
+    virtual ~metric() = default;
+
+    char const* name() const { return name_; }
+    char const* help() const { return help_; }
+    char const* type() const { return type_; }
+
+    virtual void write(std::ostream& out) const = 0;
+
+protected:
+    // Writes name+suffix{labels,extra} with the braces only when needed.
+    void write_name(std::ostream& out, char const* suffix, char const* extra = "") const;
+
+private:
+    char const* name_;
+    char const* help_;
+    char const* type_;
+    char const* labels_;
+};
+
+class counter : public metric
+{
+    struct alignas(64) shard
+    {
+        std::atomic<std::uint64_t> value{ 0 };
+    };
+    std::array<shard, shard_count> shards_;
+
+public:
+    counter(char const* name, char const* help, char const* labels = "")
+        : metric(name, help, "counter", labels)
+    {
+    }
+
+    void
+    inc(std::uint64_t n = 1)
+    {
+        shards_[this_shard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t value() const;
+    void write(std::ostream& out) const override;
+};
+
+// Gauges go up and down from different threads (a session opened on one
+// thread is closed on another), so they are a single atomic.
+class gauge : public metric
+{
+    std::atomic<std::int64_t> value_{ 0 };
+
+public:
+    gauge(char const* name, char const* help, char const* labels = "")
+        : metric(name, help, "gauge", labels)
+    {
+    }
+
+    void add(std::int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    void set(std::int64_t n) { value_.store(n, std::memory_order_relaxed); }
+    std::int64_t value() const { return value_.load(std::memory_order_relaxed); }
+    void write(std::ostream& out) const override;
+};
+
+// Power-of-two buckets over integer observations: bucket i counts values up
+// to 2^i, so finding the bucket is one count-leading-zeros. scale converts
+// the recorded unit into the exported one (1e-6 for microseconds recorded as
+// seconds, 1 for sizes).
+class histogram : public metric
+{
+public:
+    static constexpr std::size_t max_buckets = 32;
+
+    histogram(char const* name, char const* help, char const* labels,
+        double scale, std::size_t buckets);
+
+    void
+    record(std::uint64_t v)
+    {
+        auto& s = shards_[this_shard()];
+        s.buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    void write(std::ostream& out) const override;
+
+private:
+    struct alignas(64) shard
+    {
+        std::array<std::atomic<std::uint64_t>, max_buckets + 1> buckets{};
+        std::atomic<std::uint64_t> sum{ 0 };
+    };
+
+    std::size_t
+    bucket_of(std::uint64_t v) const
+    {
+        if (v <= 1)
+            return 0;
+#ifdef _MSC_VER
+        unsigned long msb;
+        _BitScanReverse64(&msb, v - 1);
+        std::size_t const i = msb + 1;
+#else
+        std::size_t const i = 64 - static_cast<std::size_t>(__builtin_clzll(v - 1));
+#endif
+        return i < buckets_ ? i : buckets_;
+    }
+
+    double const scale_;
+    std::size_t const buckets_;
+    std::array<shard, shard_count> shards_;
+};
+
+// Records the time until stop() or the end of the scope, in microseconds.
+class scoped_timer
+{
+    histogram* h_;
+    std::chrono::steady_clock::time_point const start_;
+
+public:
+    explicit
+    scoped_timer(histogram& h)
+        : h_(&h)
+        , start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    scoped_timer(scoped_timer const&) = delete;
+    scoped_timer& operator=(scoped_timer const&) = delete;
+
+    ~scoped_timer()
+    {
+        stop();
+    }
+
+    void
+    stop()
+    {
+        if (!h_)
+            return;
+        h_->record(static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start_).count()));
+        h_ = nullptr;
+    }
+};
+
+// Writes every registered metric, grouped by family.
+void render(std::ostream& out);
+
+} // metrics
+
+#endif
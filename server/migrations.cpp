@@ -0,0 +1,127 @@
+#include "migrations.hpp"
+#include <iostream>
+#include <iterator>
+#include <string>
+
+static migration const migrations[] = {
+    {
+        1, "baseline schema",
+        "CREATE TABLE IF NOT EXISTS Users ("
+        "id INTEGER NOT NULL UNIQUE, "
+        "login TEXT NOT NULL UNIQUE, "
+        "pass TEXT NOT NULL, "
+        "name TEXT NOT NULL, "
+        "PRIMARY KEY(id AUTOINCREMENT));"
+        "CREATE TABLE IF NOT EXISTS Chat ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "name TEXT NOT NULL, "
+        "adminid INTEGER NOT NULL, "
+        "isVoiceChat INTEGER NOT NULL, "
+        "FOREIGN KEY (adminid) REFERENCES Users(id));"
+        "CREATE TABLE IF NOT EXISTS UserInChat ("
+        "chatid INTEGER NOT NULL, "
+        "userid INTEGER NOT NULL, "
+        "parentuser INTEGER NOT NULL, "
+        "isvoicechat INTEGER NOT NULL, "
+        "PRIMARY KEY (chatid, userid), "
+        "FOREIGN KEY (chatid) REFERENCES Chat(id) ON DELETE CASCADE, "
+        "FOREIGN KEY (userid) REFERENCES Users(id) ON DELETE CASCADE, "
+        "FOREIGN KEY (parentuser) REFERENCES Users(id));"
+        "CREATE TABLE IF NOT EXISTS Message ("
+        "id INTEGER NOT NULL UNIQUE, "
+        "text TEXT NOT NULL, "
+        "files TEXT, "
+        "date INTEGER NOT NULL, "
+        "userid INTEGER NOT NULL, "
+        "chatid INTEGER NOT NULL, "
+        "PRIMARY KEY(id AUTOINCREMENT), "
+        "FOREIGN KEY(userid) REFERENCES Users(id), "
+        "FOREIGN KEY(chatid) REFERENCES Chat(id));"
+        "CREATE UNIQUE INDEX IF NOT EXISTS idx_message_unique ON Message (chatid, userid, text, date);"
+        "CREATE TABLE IF NOT EXISTS FriendRequests ("
+        "requester_id INTEGER NOT NULL, "
+        "requested_id INTEGER NOT NULL, "
+        "status TEXT NOT NULL, "
+        "PRIMARY KEY (requester_id, requested_id), "
+        "FOREIGN KEY (requester_id) REFERENCES Users(id) ON DELETE CASCADE, "
+        "FOREIGN KEY (requested_id) REFERENCES Users(id) ON DELETE CASCADE);"
+        "CREATE TABLE IF NOT EXISTS Friends ("
+        "user_id INTEGER NOT NULL, "
+        "friend_id INTEGER NOT NULL, "
+        "PRIMARY KEY (user_id, friend_id), "
+        "FOREIGN KEY (user_id) REFERENCES Users(id) ON DELETE CASCADE, "
+        "FOREIGN KEY (friend_id) REFERENCES Users(id) ON DELETE CASCADE);"
+    },
+    {
+        // UserInChat(chatid, userid) and Users(login) are already covered by
+        // their primary key and unique constraint.
+        2, "indexes for hot queries and account deletion",
+        "CREATE INDEX IF NOT EXISTS idx_message_chat_date ON Message(chatid, date);"
+        "CREATE INDEX IF NOT EXISTS idx_message_user ON Message(userid);"
+        "CREATE INDEX IF NOT EXISTS idx_userinchat_user ON UserInChat(userid);"
+        "CREATE INDEX IF NOT EXISTS idx_userinchat_parent ON UserInChat(parentuser);"
+        "CREATE INDEX IF NOT EXISTS idx_chat_admin ON Chat(adminid);"
+        "CREATE INDEX IF NOT EXISTS idx_friends_friend ON Friends(friend_id);"
+        "DROP INDEX IF EXISTS idx_friendrequests_requested;"
+        "CREATE INDEX IF NOT EXISTS idx_friendrequests_requested_status ON FriendRequests(requested_id, status);"
+    },
+    {
+        3, "drop leftover tables",
+        "DROP TABLE IF EXISTS Messages;"
+        "DROP TABLE IF EXISTS FriendRequests_new;"
+    },
+    {
+        // Keyset pages of /api/history and /api/chats walk these in order.
+        4, "indexes for paginated reads",
+        "CREATE INDEX IF NOT EXISTS idx_message_chat_id ON Message(chatid, id);"
+        "CREATE INDEX IF NOT EXISTS idx_userinchat_user_chat ON UserInChat(userid, chatid);"
+        "DROP INDEX IF EXISTS idx_userinchat_user;"
+    },
+};
+
+static int
+user_version(sqlite3* db)
+{
+    sqlite3_stmt* stmt = nullptr;
+    int version = -1;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+bool
+migrate(sqlite3* db)
+{
+    int current = user_version(db);
+    if (current < 0) {
+        std::cerr << "Unable to read schema version: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+
+    bool applied = false;
+    for (auto const& m : migrations) {
+        if (m.version <= current)
+            continue;
+
+        std::string sql = std::string("BEGIN IMMEDIATE;") + m.sql +
+            "PRAGMA user_version = " + std::to_string(m.version) + ";COMMIT;";
+        char* err = nullptr;
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+            std::cerr << "Migration " << m.version << " (" << m.description << ") failed: "
+                      << (err ? err : sqlite3_errmsg(db)) << std::endl;
+            sqlite3_free(err);
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        std::cout << "Applied migration " << m.version << ": " << m.description << std::endl;
+        current = m.version;
+        applied = true;
+    }
+
+    if (applied)
+        sqlite3_exec(db, "ANALYZE;", nullptr, nullptr, nullptr);
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef SRAVZ_MIGRATIONS_HPP
+#define SRAVZ_MIGRATIONS_HPP
+
+#include "sqlite/sqlite3.h"
+
+struct migration
+{
+    int version;
+    char const* description;
+    char const* sql;
+};
+
+// Brings the schema up to the latest version recorded in PRAGMA user_version.
+// Each migration runs in its own transaction; returns false on the first failure.
+bool migrate(sqlite3* db);
+
+#endif // SRAVZ_MIGRATIONS_HPP
@@ -33,7 +33,8 @@ public:
         DeleteFriend = 18, 
         UpdateAccount = 20,
         DeleteVoiceChat = 21,
-        Logout = 22
+        Logout = 22,
+        VoiceToken = 23
     };
 };
 
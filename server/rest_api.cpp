@@ -0,0 +1,274 @@
+#include "rest_api.hpp"
+#include "chat_metrics.hpp"
+#include "file_cache.hpp"
+#include "logger.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#ifdef CHAT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static int const default_page = 50;
+static int const max_page = 500;
+static std::size_t const min_gzip_size = 1024;
+
+static std::int64_t
+param_int(api_request const& req, char const* name, std::int64_t fallback)
+{
+    auto it = req.params.find(name);
+    if (it == req.params.end() || it->second.empty())
+        return fallback;
+    char* end = nullptr;
+    auto const v = std::strtoll(it->second.c_str(), &end, 10);
+    return *end == '\0' ? v : fallback;
+}
+
+static int
+page_size(api_request const& req)
+{
+    return static_cast<int>(std::clamp<std::int64_t>(param_int(req, "limit", default_page), 1, max_page));
+}
+
+static std::string
+column_text(sqlite3_stmt* stmt, int i)
+{
+    auto const text = sqlite3_column_text(stmt, i);
+    return text ? std::string(reinterpret_cast<char const*>(text)) : std::string();
+}
+
+static api_response
+error(http::status status, char const* what)
+{
+    boost::json::object obj;
+    obj["error"] = what;
+    api_response res;
+    res.status = status;
+    res.body = boost::json::serialize(obj);
+    return res;
+}
+
+#ifdef CHAT_HAVE_ZLIB
+static bool
+gzip(std::string const& in, std::string& out)
+{
+    z_stream zs{};
+    if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out.resize(deflateBound(&zs, static_cast<uLong>(in.size())));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = static_cast<uInt>(in.size());
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    int const rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END;
+}
+#endif
+
+// The ETag is a hash of the uncompressed JSON, so an unchanged page answers
+// 304 without being sent again; the gzip variant gets its own tag. The
+// representation is chosen first so the 304 carries the tag the client holds.
+static api_response
+reply(boost::json::object const& obj, api_request const& req)
+{
+    api_response res;
+    res.body = boost::json::serialize(obj);
+
+    std::uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : res.body)
+        h = (h ^ c) * 1099511628211ull;
+    char tag[17];
+    std::snprintf(tag, sizeof(tag), "%016llx", static_cast<unsigned long long>(h));
+
+#ifdef CHAT_HAVE_ZLIB
+    res.gzip = req.accept_gzip && res.body.size() >= min_gzip_size;
+#endif
+    res.etag = std::string("\"") + tag + (res.gzip ? "-gz\"" : "\"");
+
+    if (!req.if_none_match.empty() && etag_matches(req.if_none_match, res.etag)) {
+        res.status = http::status::not_modified;
+        res.body.clear();
+        return res;
+    }
+
+#ifdef CHAT_HAVE_ZLIB
+    std::string compressed;
+    if (res.gzip) {
+        if (gzip(res.body, compressed)) {
+            res.body.swap(compressed);
+        }
+        else {
+            res.gzip = false;
+            res.etag = std::string("\"") + tag + "\"";
+        }
+    }
+#endif
+    return res;
+}
+
+static bool
+is_member(sqlite3* db, std::int64_t chat, std::uint32_t user)
+{
+    sqlite3_stmt* stmt = nullptr;
+    bool member = false;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM UserInChat WHERE chatid = ? AND userid = ?", -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, chat);
+        sqlite3_bind_int64(stmt, 2, user);
+        member = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    return member;
+}
+
+// Same rows as topic 6 (messages of users still in the chat), newest first.
+static api_response
+history(sqlite3* db, api_request const& req)
+{
+    auto const chat = param_int(req, "chat", -1);
+    auto const before = param_int(req, "before", std::numeric_limits<std::int64_t>::max());
+    int const limit = page_size(req);
+    if (!is_member(db, chat, req.user_id))
+        return error(http::status::forbidden, "Not a member of this chat");
+
+    sqlite3_stmt* stmt = nullptr;
+    char const* sql =
+        "SELECT u.name, m.text, m.date, m.id, m.userid FROM Message m "
+        "JOIN Users u ON u.id = m.userid "
+        "WHERE m.chatid = ? AND m.id < ? "
+        "AND EXISTS (SELECT 1 FROM UserInChat c WHERE c.chatid = m.chatid AND c.userid = m.userid) "
+        "ORDER BY m.id DESC LIMIT ?";
+    metrics::scoped_timer timer(chat_metrics::sqlite_latency(chat_metrics::statement::api_history));
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        CHAT_LOG(error, "SQL prepare error (api history)", {{ "error", sqlite3_errmsg(db) }});
+        return error(http::status::internal_server_error, "Failed to fetch messages");
+    }
+    sqlite3_bind_int64(stmt, 1, chat);
+    sqlite3_bind_int64(stmt, 2, before);
+    sqlite3_bind_int(stmt, 3, limit);
+
+    boost::json::array arr;
+    std::int64_t last = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        boost::json::object ob;
+        ob["user_name"] = column_text(stmt, 0);
+        ob["text"] = column_text(stmt, 1);
+        ob["date"] = sqlite3_column_int64(stmt, 2);
+        ob["msg_id"] = sqlite3_column_int(stmt, 3);
+        ob["user_id"] = sqlite3_column_int(stmt, 4);
+        last = sqlite3_column_int64(stmt, 3);
+        arr.emplace_back(std::move(ob));
+    }
+    sqlite3_finalize(stmt);
+    timer.stop();
+
+    boost::json::object obj;
+    obj["chat_id"] = chat;
+    bool const more = static_cast<int>(arr.size()) == limit;
+    obj["messages"] = std::move(arr);
+    if (more)
+        obj["next_before"] = last;
+    else
+        obj["next_before"] = nullptr;
+    return reply(obj, req);
+}
+
+static api_response
+chats(sqlite3* db, api_request const& req)
+{
+    auto const after = param_int(req, "after", 0);
+    int const limit = page_size(req);
+
+    sqlite3_stmt* stmt = nullptr;
+    char const* sql =
+        "SELECT Chat.id, Chat.name, Chat.isVoiceChat "
+        "FROM UserInChat JOIN Chat ON Chat.id = UserInChat.chatid "
+        "WHERE UserInChat.userid = ? AND UserInChat.chatid > ? "
+        "ORDER BY UserInChat.chatid LIMIT ?";
+    metrics::scoped_timer timer(chat_metrics::sqlite_latency(chat_metrics::statement::api_chats));
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        CHAT_LOG(error, "SQL prepare error (api chats)", {{ "error", sqlite3_errmsg(db) }});
+        return error(http::status::internal_server_error, "Failed to fetch chat list");
+    }
+    sqlite3_bind_int64(stmt, 1, req.user_id);
+    sqlite3_bind_int64(stmt, 2, after);
+    sqlite3_bind_int(stmt, 3, limit);
+
+    boost::json::array arr;
+    std::int64_t last = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        boost::json::object ob;
+        ob["chat_id"] = sqlite3_column_int(stmt, 0);
+        ob["chat_name"] = column_text(stmt, 1);
+        ob["isVoiceChat"] = sqlite3_column_int(stmt, 2) == 1;
+        last = sqlite3_column_int64(stmt, 0);
+        arr.emplace_back(std::move(ob));
+    }
+    sqlite3_finalize(stmt);
+    timer.stop();
+
+    boost::json::object obj;
+    bool const more = static_cast<int>(arr.size()) == limit;
+    obj["chats"] = std::move(arr);
+    if (more)
+        obj["next_after"] = last;
+    else
+        obj["next_after"] = nullptr;
+    return reply(obj, req);
+}
+
+static api_response
+users(sqlite3* db, api_request const& req)
+{
+    auto const after = param_int(req, "after", 0);
+    int const limit = page_size(req);
+    auto it = req.params.find("q");
+    std::string const pattern = "%" + (it == req.params.end() ? std::string() : it->second) + "%";
+
+    sqlite3_stmt* stmt = nullptr;
+    char const* sql = "SELECT id, name FROM Users WHERE name LIKE ? AND id > ? ORDER BY id LIMIT ?";
+    metrics::scoped_timer timer(chat_metrics::sqlite_latency(chat_metrics::statement::api_users));
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        CHAT_LOG(error, "SQL prepare error (api users)", {{ "error", sqlite3_errmsg(db) }});
+        return error(http::status::internal_server_error, "Failed to search users");
+    }
+    sqlite3_bind_text(stmt, 1, pattern.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, after);
+    sqlite3_bind_int(stmt, 3, limit);
+
+    boost::json::array arr;
+    std::int64_t last = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        boost::json::object ob;
+        ob["user_id"] = sqlite3_column_int(stmt, 0);
+        ob["user_name"] = column_text(stmt, 1);
+        last = sqlite3_column_int64(stmt, 0);
+        arr.emplace_back(std::move(ob));
+    }
+    sqlite3_finalize(stmt);
+    timer.stop();
+
+    boost::json::object obj;
+    bool const more = static_cast<int>(arr.size()) == limit;
+    obj["users"] = std::move(arr);
+    if (more)
+        obj["next_after"] = last;
+    else
+        obj["next_after"] = nullptr;
+    return reply(obj, req);
+}
+
+api_response
+handle_api(sqlite3* db, api_request const& req)
+{
+    if (req.endpoint == "history")
+        return history(db, req);
+    if (req.endpoint == "chats")
+        return chats(db, req);
+    if (req.endpoint == "users")
+        return users(db, req);
+    return error(http::status::not_found, "Unknown endpoint");
+}
@@ -0,0 +1,40 @@
+#ifndef SRAVZ_REST_API_HPP
+#define SRAVZ_REST_API_HPP
+
+#include "beast.hpp"
+#include "sqlite/sqlite3.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// Read-only endpoints under /api/ for bulk data (history, chat list, user
+// search) that would otherwise queue up behind live traffic on the user's
+// WebSocket. The caller authenticates the request with a resume token.
+//
+//   GET /api/history?chat=<id>[&before=<msg_id>][&limit=<n>]   newest first
+//   GET /api/chats[?after=<chat_id>][&limit=<n>]
+//   GET /api/users?q=<name>[&after=<user_id>][&limit=<n>]
+//
+// Pages are keyset based: the reply carries next_before / next_after, null on
+// the last page, so a page stays stable while new rows are inserted.
+struct api_request
+{
+    std::string endpoint;
+    std::unordered_map<std::string, std::string> params;
+    std::uint32_t user_id = 0;
+    std::string if_none_match;
+    bool accept_gzip = false;
+};
+
+struct api_response
+{
+    http::status status = http::status::ok;
+    std::string body;
+    std::string etag;
+    bool gzip = false;
+};
+
+// Runs on a worker_pool thread with that worker's connection.
+api_response handle_api(sqlite3* db, api_request const& req);
+
+#endif
@@ -1,50 +1,272 @@
 #include "shared_state.hpp"
+#include "chat_metrics.hpp"
+#include "logger.hpp"
 #include "websocket_session.hpp"
 #include "symbol.hpp"
 #include "sqlite/sqlite3.h"
+#include "migrations.hpp"
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
+static std::chrono::milliseconds::rep
+now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
 shared_state::shared_state(std::string doc_root, std::string db_root)
     : doc_root_(std::move(doc_root))
     , db_root_(db_root)
+    , login_ip_limiter_(getenv_or("CHAT_LOGIN_RATE", 5), getenv_or("CHAT_LOGIN_BURST", 20))
+    , event_epoch_(static_cast<std::uint64_t>(now_ms()))
 {
+    init_resume_tokens();
+    init_voice_tokens();
+    int const auth_threads = getenv_or("CHAT_AUTH_THREADS",
+        std::max<int>(1, std::thread::hardware_concurrency() / 2));
+    int const auth_queue = getenv_or("CHAT_AUTH_QUEUE", 256);
+    auth_pool_ = std::make_unique<worker_pool>(db_root_,
+        static_cast<std::size_t>(std::max(1, auth_threads)),
+        static_cast<std::size_t>(std::max(1, auth_queue)));
+    int const read_threads = getenv_or("CHAT_READ_THREADS", 2);
+    int const read_queue = getenv_or("CHAT_READ_QUEUE", 512);
+    read_pool_ = std::make_unique<worker_pool>(db_root_,
+        static_cast<std::size_t>(std::max(1, read_threads)),
+        static_cast<std::size_t>(std::max(1, read_queue)));
+    files_ = std::make_unique<file_cache>(
+        static_cast<std::size_t>(std::max(0, getenv_or("CHAT_FILE_CACHE_MB", 32))) << 20);
+
     sqlite3* db;
     sqlite3_open(db_root_.c_str(), &db);
     if (db) {
-                const char* createFriendsTable = "CREATE TABLE IF NOT EXISTS Friends ("
-            "user_id INTEGER NOT NULL, "
-            "friend_id INTEGER NOT NULL, "
-            "PRIMARY KEY (user_id, friend_id), "
-            "FOREIGN KEY (user_id) REFERENCES Users(id) ON DELETE CASCADE, "
-            "FOREIGN KEY (friend_id) REFERENCES Users(id) ON DELETE CASCADE)";
-        sqlite3_exec(db, createFriendsTable, NULL, NULL, NULL);
-
-                std::string sql = "SELECT id FROM Chat";
-        sqlite3_stmt* stmt;
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-        while (sqlite3_step(stmt) != SQLITE_DONE) {
-            std::string topic = std::to_string(sqlite3_column_int(stmt, 0));
-            symbols_[topic] = boost::make_shared<symbol>(topic, "", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+        if (!migrate(db)) {
+            std::cerr << "Database schema is not up to date" << std::endl;
         }
-        sqlite3_finalize(stmt);
         sqlite3_close(db);
     }
 }
 
-void shared_state::join(websocket_session* session)
+void shared_state::stop_workers()
+{
+    auth_pool_->stop();
+    read_pool_->stop();
+}
+
+bool shared_state::allow_login(std::string const& ip, std::string const& login)
+{
+    bool const ip_ok = login_ip_limiter_.allow(ip);
+    return login_user_limiter_.allow(login) && ip_ok;
+}
+
+static void
+write_pool_metrics(std::ostream& out, char const* name, char const* help, worker_pool::stats const& s)
+{
+    out << "# HELP chat_" << name << "_queue_delay_seconds " << help << "\n"
+        << "# TYPE chat_" << name << "_queue_delay_seconds summary\n"
+        << "chat_" << name << "_queue_delay_seconds_sum " << s.queue_delay_us_sum / 1e6 << "\n"
+        << "chat_" << name << "_queue_delay_seconds_count " << s.completed << "\n"
+        << "# TYPE chat_" << name << "_queue_delay_seconds_max gauge\n"
+        << "chat_" << name << "_queue_delay_seconds_max " << s.queue_delay_us_max / 1e6 << "\n"
+        << "# TYPE chat_" << name << "_rejected_total counter\n"
+        << "chat_" << name << "_rejected_total " << s.rejected << "\n"
+        << "# TYPE chat_" << name << "_queue_depth gauge\n"
+        << "chat_" << name << "_queue_depth " << s.depth << "\n"
+        << "# TYPE chat_" << name << "_queue_capacity gauge\n"
+        << "chat_" << name << "_queue_capacity " << s.capacity << "\n"
+        << "# TYPE chat_" << name << "_threads gauge\n"
+        << "chat_" << name << "_threads " << s.threads << "\n";
+}
+
+std::string shared_state::metrics()
+{
+    std::ostringstream out;
+    write_pool_metrics(out, "auth", "Time login and registration jobs wait for an auth worker.", auth_pool_->snapshot());
+    write_pool_metrics(out, "read", "Time /api/ reads wait for a read worker.", read_pool_->snapshot());
+    std::size_t free_slots;
+    {
+        std::lock_guard<std::mutex> lock(subscriber_queue_mutex_);
+        free_slots = spsc_queue_subscriber_.write_available();
+    }
+    out << "# TYPE chat_persistence_queue_depth gauge\n"
+        << "chat_persistence_queue_depth " << persistence_queue_capacity - free_slots << "\n";
+    metrics::render(out);
+    return out.str();
+}
+
+boost::shared_ptr<symbol> shared_state::get_symbol(std::string const& chatId)
+{
+    std::lock_guard<std::mutex> lock(symbols_mutex_);
+    auto& sym = symbols_[chatId];
+    if (!sym) {
+        sym = boost::make_shared<symbol>(chatId, "", now_ms());
+    } else {
+        std::lock_guard<std::mutex> lock_symbol(sym->mutex_);
+        sym->time = now_ms();
+    }
+    return sym;
+}
+
+boost::shared_ptr<symbol> shared_state::find_symbol(std::string const& chatId)
+{
+    std::lock_guard<std::mutex> lock(symbols_mutex_);
+    auto it = symbols_.find(chatId);
+    if (it == symbols_.end())
+        return nullptr;
+    return it->second;
+}
+
+void shared_state::run_symbol_eviction(net::io_context& ioc)
+{
+    eviction_timer_.emplace(ioc);
+    schedule_symbol_eviction();
+}
+
+void shared_state::schedule_symbol_eviction()
+{
+    eviction_timer_->expires_after(symbol_sweep_interval);
+    eviction_timer_->async_wait(
+        [self = shared_from_this()](beast::error_code ec)
+        {
+            if (ec)
+                return;
+            self->evict_idle_symbols();
+            self->schedule_symbol_eviction();
+        });
+}
+
+void shared_state::evict_idle_symbols()
+{
+    auto const cutoff = now_ms() - std::chrono::duration_cast<std::chrono::milliseconds>(symbol_idle_timeout).count();
+    std::lock_guard<std::mutex> lock(symbols_mutex_);
+    for (auto it = symbols_.begin(); it != symbols_.end();) {
+        std::unique_lock<std::mutex> lock_symbol(it->second->mutex_);
+        if (it->second->sessions_.empty() && it->second->time < cutoff) {
+            lock_symbol.unlock();
+            it = symbols_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool shared_state::enqueue(persistence_job job)
+{
+    std::lock_guard<std::mutex> lock(subscriber_queue_mutex_);
+    return spsc_queue_subscriber_.push(std::move(job));
+}
+
+void shared_state::fanout(std::vector<boost::weak_ptr<websocket_session>> const& sessions, boost::shared_ptr<std::string const> const& ss)
+{
+    chat_metrics::fanout_size.record(sessions.size());
+    if (!per_core_) {
+        for (auto const& wp : sessions) {
+            if (auto sp = wp.lock()) {
+                sp->send(ss);
+            }
+        }
+        return;
+    }
+
+    std::vector<std::pair<net::any_io_executor, std::vector<boost::shared_ptr<websocket_session>>>> mailboxes;
+    for (auto const& wp : sessions) {
+        auto sp = wp.lock();
+        if (!sp)
+            continue;
+        auto ex = sp->get_executor();
+        auto it = std::find_if(mailboxes.begin(), mailboxes.end(),
+            [&ex](auto const& m) { return m.first == ex; });
+        if (it == mailboxes.end()) {
+            mailboxes.emplace_back(ex, std::vector<boost::shared_ptr<websocket_session>>{});
+            it = std::prev(mailboxes.end());
+        }
+        it->second.push_back(std::move(sp));
+    }
+    for (auto& m : mailboxes) {
+        net::post(m.first,
+            [batch = std::move(m.second), ss]()
+            {
+                for (auto const& sp : batch) {
+                    sp->deliver(ss);
+                }
+            });
+    }
+}
+
+std::uint64_t shared_state::join(websocket_session* session)
 {
+    std::lock_guard<std::mutex> lock_events(events_mutex_);
     std::lock_guard<std::mutex> lock(mutex_);
-    std::cout << "Inserting into session" << std::endl;
+    CHAT_LOG(debug, "session joined", {{ "user", session->getId() }});
     sess___[std::to_string(session->getId())] = session;
     sessions_.insert(session);
+    return event_seq_;
 }
 
-void shared_state::websocket_subscribe_to_symbols(websocket_session* session, std::string chatId) {
+// Joins and replays under events_mutex_, so nothing published in between can
+// overtake the replay.
+boost::optional<std::uint64_t> shared_state::resume(websocket_session* session, resume_point const& from)
+{
+    std::lock_guard<std::mutex> lock_events(events_mutex_);
+    if (from.epoch != event_epoch_ || from.seq > event_seq_)
+        return boost::none;
+    if (!events_.empty() && events_.front().seq > from.seq + 1)
+        return boost::none;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sess___[std::to_string(session->getId())] = session;
+        sessions_.insert(session);
+    }
+
+    auto const uid = session->getId();
+    auto it = events_.begin();
+    if (!events_.empty())
+        it += static_cast<std::ptrdiff_t>(from.seq + 1 - events_.front().seq);
+    for (; it != events_.end(); ++it) {
+        if (it->users.empty() || std::find(it->users.begin(), it->users.end(), uid) != it->users.end())
+            session->send(it->payload);
+    }
+    return event_seq_;
+}
+
+void shared_state::publish(boost::json::object& obj, std::vector<std::uint32_t> users)
+{
+    std::sort(users.begin(), users.end());
+    users.erase(std::unique(users.begin(), users.end()), users.end());
+
+    std::lock_guard<std::mutex> lock_events(events_mutex_);
+    obj["event_seq"] = ++event_seq_;
+    auto ss = boost::make_shared<std::string const>(boost::json::serialize(obj));
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (users.empty()) {
+            for (auto sess : sessions_) {
+                sess->send(ss);
+            }
+        } else {
+            for (auto id : users) {
+                auto it = sess___.find(std::to_string(id));
+                if (it != sess___.end() && it->second) {
+                    it->second->send(ss);
+                }
+            }
+        }
+    }
+    events_.push_back(user_event{ event_seq_, std::move(users), std::move(ss) });
+    if (events_.size() > event_log_capacity)
+        events_.pop_front();
+}
+
+void shared_state::websocket_subscribe_to_symbols(websocket_session* session, std::string chatId, boost::optional<resume_point> from) {
         std::string checkSql = "SELECT 1 FROM Chat WHERE id = ? AND EXISTS "
                           "(SELECT 1 FROM UserInChat WHERE chatid = ? AND userid = ?)";
     sqlite3_stmt* checkStmt = nullptr;
     int rc = sqlite3_prepare_v2(session->db, checkSql.c_str(), -1, &checkStmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки SQL (проверка подписки): " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "Ошибка подготовки SQL (проверка подписки)", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 1;
         error["error"] = "Ошибка базы данных";
@@ -57,7 +279,7 @@ void shared_state::websocket_subscribe_to_symbols(websocket_session* session, st
     sqlite3_bind_int(checkStmt, 2, chatIdInt);
     sqlite3_bind_int(checkStmt, 3, session->getId());
     if (sqlite3_step(checkStmt) != SQLITE_ROW) {
-        std::cerr << "Недействительный chatId " << chatId << " или пользователь " << session->getId() << " не в чате\n";
+        CHAT_LOG(warn, "Недействительный chatId или пользователь не в чате", {{ "chat", chatId }, { "user", session->getId() }});
         boost::json::object error;
         error["topic"] = 1;
         error["error"] = "Недействительный чат или пользователь не в чате";
@@ -71,15 +293,27 @@ void shared_state::websocket_subscribe_to_symbols(websocket_session* session, st
         std::lock_guard<std::mutex> lock(mutex_);
         session->topics.insert(chatId);
     }
-    std::lock_guard<std::mutex> lock(symbols_[chatId]->mutex_);
-    symbols_[chatId]->join(session);
-    std::cout << "Подписан пользователь " << session->getId() << " на чат " << chatId << std::endl;
-
+    auto sym = get_symbol(chatId);
+    std::lock_guard<std::mutex> lock(sym->mutex_);
+    sym->join(session);
+    CHAT_LOG(debug, "Подписан пользователь на чат", {{ "user", session->getId() }, { "chat", chatId }});
+
+    // The reply goes out before the replayed events and both are sent under
+    // the room lock, so the client sees "replayed" first and no live message
+    // can slip in between. replayed=false means the gap is gone: reload the
+    // history and continue from seq.
+    bool const can_replay = from && static_cast<std::uint64_t>(sym->epoch) == from->epoch &&
+        from->seq <= sym->seq && (sym->log_.empty() || sym->log_.front().first <= from->seq + 1);
         boost::json::object response;
     response["topic"] = 1;
     response["status"] = "subscribed";
     response["chat_id"] = chatIdInt;
+    response["epoch"] = sym->epoch;
+    response["seq"] = sym->seq;
+    response["replayed"] = can_replay;
     session->send(boost::make_shared<std::string>(boost::json::serialize(response)));
+    if (can_replay)
+        sym->replay(session, from->seq);
 }
 
 void shared_state::websocket_unsubscribe_to_symbols(websocket_session* session)
@@ -91,8 +325,12 @@ void shared_state::websocket_unsubscribe_to_symbols(websocket_session* session)
         id = *session->topics.begin();
         session->topics.erase(session->topics.begin());
     }
-    std::lock_guard<std::mutex> lock(symbols_[id]->mutex_);
-    symbols_[id]->leave(session);
+    auto sym = find_symbol(id);
+    if (!sym)
+        return;
+    std::lock_guard<std::mutex> lock(sym->mutex_);
+    sym->leave(session);
+    sym->time = now_ms();
 }
 
 void shared_state::searchUsersByName(websocket_session* session, std::string searchTerm) {
@@ -131,174 +369,35 @@ void shared_state::deleteUserFromChat(websocket_session* session, int chatId)
     if (sqlite3_step(stmt) == SQLITE_ROW) {
         obj["user_name"] = std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
     } else {
-        std::cout << "error in searching username\n";
+        CHAT_LOG(warn, "error in searching username");
         sqlite3_finalize(stmt);
         return;
     }
     sqlite3_finalize(stmt);
-    boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
-    for (auto sess : symbols_[std::to_string(chatId)]->sessions_) {
-        sess->send(ss);
+    obj["to"] = chatId;
+    if (auto sym = find_symbol(std::to_string(chatId))) {
+        std::lock_guard<std::mutex> lock(sym->mutex_);
+        auto ss = sym->record(obj);
+        for (auto sess : sym->sessions_) {
+            sess->send(ss);
+        }
     }
-    spsc_queue_subscriber_.push(std::make_tuple(parser::MsgType::DeleteUserFromChat, chatId, session->getId(), "", 0, std::nullopt));
+    enqueue(std::make_tuple(parser::MsgType::DeleteUserFromChat, chatId, session->getId(), "", 0, std::nullopt));
 }
 
+// The subscriber runs the deletion and announces the outcome once it has
+// committed (or failed), so nothing is revoked or published here.
 void shared_state::deleteUserAccount(websocket_session* session)
 {
-    boost::json::object obj;
-    obj["topic"] = 8;
-    obj["user_id"] = session->getId();
-
-    sqlite3_stmt* stmt = nullptr;
-    int rc;
-
-        rc = sqlite3_exec(session->db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "Failed to begin transaction: " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Database transaction error";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        return;
-    }
-
-        std::string sql = "DELETE FROM Friends WHERE user_id = ? OR friend_id = ?";
-    rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (delete friends): " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete friends";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_bind_int(stmt, 1, session->getId());
-    sqlite3_bind_int(stmt, 2, session->getId());
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error deleting friends: " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete friends";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_finalize(stmt);
-
-        sql = "DELETE FROM FriendRequests WHERE requester_id = ? OR requested_id = ?";
-    rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (delete friend requests): " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete friend requests";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_bind_int(stmt, 1, session->getId());
-    sqlite3_bind_int(stmt, 2, session->getId());
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error deleting friend requests: " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete friend requests";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_finalize(stmt);
-
-        sql = "DELETE FROM UserInChat WHERE userid = ?";
-    rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (delete user in chat): " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete user from chats";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_bind_int(stmt, 1, session->getId());
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error deleting user from chats: " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete user from chats";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_finalize(stmt);
-
-        sql = "DELETE FROM Message WHERE userid = ?";
-    rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (delete messages): " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete messages";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_bind_int(stmt, 1, session->getId());
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error deleting messages: " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete messages";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_finalize(stmt);
-
-        sql = "DELETE FROM Users WHERE id = ?";
-    rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (delete user): " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete user account";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_bind_int(stmt, 1, session->getId());
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error deleting user: " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Failed to delete user account";
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_finalize(stmt);
-        return;
-    }
-    sqlite3_finalize(stmt);
-
-        rc = sqlite3_exec(session->db, "COMMIT;", nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "Failed to commit transaction: " << sqlite3_errmsg(session->db) << std::endl;
+    if (!enqueue(std::make_tuple(parser::MsgType::DeleteUserAccount, 0, session->getId(), "", 0, std::nullopt))) {
+        CHAT_LOG(error, "Failed to queue account deletion", {{ "user", session->getId() }});
+        boost::json::object obj;
+        obj["topic"] = 8;
+        obj["user_id"] = session->getId();
         obj["status"] = "error";
-        obj["error"] = "Database transaction error";
+        obj["error"] = "Server is busy, try again later";
         session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        sqlite3_exec(session->db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        return;
     }
-
-    obj["status"] = "success";
-    boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
-
-        std::lock_guard<std::mutex> lock(mutex_);
-    for (auto sess : sessions_) {
-        sess->send(ss);
-    }
-
-        leave(session);
-
-    spsc_queue_subscriber_.push(std::make_tuple(parser::MsgType::DeleteUserAccount, 0, session->getId(), "", 0, std::nullopt));
 }
 
 void shared_state::getUserList(websocket_session* session)
@@ -327,10 +426,7 @@ void shared_state::newUser(std::string name, int id)
     obj["topic"] = 0;
     obj["user_id"] = id;
     obj["user_name"] = name;
-    boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
-    for (auto a : sessions_) {
-        a->send(ss);
-    }
+    publish(obj);
 }
 
 void shared_state::deleteFriend(websocket_session* session, int friendId)
@@ -341,7 +437,7 @@ void shared_state::deleteFriend(websocket_session* session, int friendId)
         std::string sql = "DELETE FROM Friends WHERE (user_id=? AND friend_id=?) OR (user_id=? AND friend_id=?)";
     int rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (Friends): " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "SQL prepare error (Friends)", {{ "error", sqlite3_errmsg(session->db) }});
         obj["status"] = "error";
         obj["error"] = "Ошибка подготовки запроса: " + std::string(sqlite3_errmsg(session->db));
         session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
@@ -359,7 +455,7 @@ void shared_state::deleteFriend(websocket_session* session, int friendId)
         sql = "DELETE FROM FriendRequests WHERE (requester_id=? AND requested_id=?) OR (requester_id=? AND requested_id=?)";
     rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (FriendRequests): " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "SQL prepare error (FriendRequests)", {{ "error", sqlite3_errmsg(session->db) }});
         obj["status"] = "error";
         obj["error"] = "Ошибка подготовки запроса: " + std::string(sqlite3_errmsg(session->db));
         session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
@@ -374,17 +470,13 @@ void shared_state::deleteFriend(websocket_session* session, int friendId)
     changes += sqlite3_changes(session->db);     sqlite3_finalize(stmt);
 
     if (changes > 0) {
-        std::cout << "Friend deleted successfully: user_id=" << session->getId() << ", friend_id=" << friendId << "\n";
+        CHAT_LOG(info, "Friend deleted", {{ "user", session->getId() }, { "friend", friendId }});
         obj["status"] = "success";
-                boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
-        session->send(ss);
-        auto it = sess___.find(std::to_string(friendId));
-        if (it != sess___.end() && it->second) {
-            it->second->send(ss);
-        }
+        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
+        publish(obj, { static_cast<std::uint32_t>(friendId) });
+        return;
     } else {
-        std::cerr << "Failed to delete friend: user_id=" << session->getId() << ", friend_id=" << friendId
-                  << ", error=" << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(warn, "Failed to delete friend", {{ "user", session->getId() }, { "friend", friendId }, { "error", sqlite3_errmsg(session->db) }});
         obj["status"] = "error";
         obj["error"] = "Не удалось удалить друга: записи не найдены";
     }
@@ -397,6 +489,7 @@ void shared_state::logout(websocket_session* session)
     obj["topic"] = 22;     obj["status"] = "success";
     boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
     session->send(ss);
+    revoke_resume_tokens(session->getId());
     leave(session); }
 
 void shared_state::inviteToChat(websocket_session* session, int chatId, std::vector<int> userId, int parentUser) {
@@ -404,7 +497,7 @@ void shared_state::inviteToChat(websocket_session* session, int chatId, std::vec
     sqlite3_stmt* stmt = nullptr;
     int rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL error: " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "SQL error", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 10;
         error["error"] = "Database error";
@@ -413,7 +506,7 @@ void shared_state::inviteToChat(websocket_session* session, int chatId, std::vec
     }
     sqlite3_bind_int(stmt, 1, chatId);
     if (sqlite3_step(stmt) != SQLITE_ROW) {
-        std::cout << "Chat with id " << chatId << " not found\n";
+        CHAT_LOG(warn, "Chat not found", {{ "chat", chatId }});
         sqlite3_finalize(stmt);
         boost::json::object error;
         error["topic"] = 10;
@@ -433,7 +526,7 @@ void shared_state::inviteToChat(websocket_session* session, int chatId, std::vec
         bool userExists = (sqlite3_step(stmt) == SQLITE_ROW);
         sqlite3_finalize(stmt);
         if (!userExists) {
-            std::cout << "User with id " << id << " not found\n";
+            CHAT_LOG(warn, "User not found", {{ "user", id }});
             continue;
         }
 
@@ -461,7 +554,7 @@ void shared_state::inviteToChat(websocket_session* session, int chatId, std::vec
         sql = "INSERT OR IGNORE INTO UserInChat (chatid, userid, parentuser, isvoicechat) VALUES (?, ?, ?, ?)";
     rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL error: " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "SQL error", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 10;
         error["error"] = "Database error";
@@ -474,7 +567,7 @@ void shared_state::inviteToChat(websocket_session* session, int chatId, std::vec
         sqlite3_bind_int(stmt, 3, parentUser);
         sqlite3_bind_int(stmt, 4, isVoiceChat ? 1 : 0);
         if (sqlite3_step(stmt) != SQLITE_DONE) {
-            std::cerr << "Failed to insert user " << id << " into chat\n";
+            CHAT_LOG(error, "Failed to insert user into chat", {{ "user", id }});
         }
         sqlite3_reset(stmt);
     }
@@ -492,20 +585,11 @@ void shared_state::inviteToChat(websocket_session* session, int chatId, std::vec
     }
     obj["invited"] = invited;
 
-        boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (auto id : validUsers) {
-        auto it = sess___.find(std::to_string(id));
-        if (it != sess___.end() && it->second) {
-            it->second->send(ss);
-        }
-    }
-    auto it = sess___.find(std::to_string(session->getId()));
-    if (it != sess___.end() && it->second) {
-        it->second->send(ss);
-    }
+    std::vector<std::uint32_t> recipients(validUsers.begin(), validUsers.end());
+    recipients.push_back(session->getId());
+    publish(obj, std::move(recipients));
 
-    spsc_queue_subscriber_.push(std::make_tuple(parser::MsgType::InviteToChat, chatId, parentUser, "", 0,
+    enqueue(std::make_tuple(parser::MsgType::InviteToChat, chatId, parentUser, "", 0,
         std::make_optional<std::vector<int>>(validUsers)));
 }
 
@@ -542,7 +626,7 @@ void shared_state::getChatList(websocket_session* session)
     obj["topic"] = 2;
     int rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (getChatList): " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "SQL prepare error (getChatList)", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 2;
         error["error"] = "Failed to fetch chat list";
@@ -561,7 +645,7 @@ void shared_state::getChatList(websocket_session* session)
     sqlite3_finalize(stmt);
     boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
     session->send(ss);
-    std::cout << "Sent chat list to user ID: " << session->getId() << ", chats count: " << arr.size() << std::endl;
+    CHAT_LOG(debug, "Sent chat list", {{ "user", session->getId() }, { "chats", arr.size() }});
 }
 
 void shared_state::createChat(websocket_session* session, std::string chatName, std::vector<std::string> invited, bool isVoiceChat)
@@ -570,7 +654,7 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
     sqlite3_stmt* stmt = nullptr;
     int rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (create chat): " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "SQL prepare error (create chat)", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 4;
         error["error"] = "Failed to prepare create chat query";
@@ -581,7 +665,7 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
     sqlite3_bind_int(stmt, 2, session->getId());
     sqlite3_bind_int(stmt, 3, isVoiceChat ? 1 : 0);
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error creating chat: " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "Error creating chat", {{ "error", sqlite3_errmsg(session->db) }});
         sqlite3_finalize(stmt);
         boost::json::object error;
         error["topic"] = 4;
@@ -591,12 +675,12 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
     }
     int chatId = sqlite3_last_insert_rowid(session->db);
     sqlite3_finalize(stmt);
-    std::cout << "Created chat ID: " << chatId << ", name: " << chatName << ", isVoiceChat: " << isVoiceChat << std::endl;
+    CHAT_LOG(info, "Created chat", {{ "chat", chatId }, { "name", chatName }, { "voice", isVoiceChat }});
 
         sql = "INSERT INTO UserInChat(chatid, userid, parentuser, isvoicechat) VALUES(?,?,?,?)";
     rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (add creator): " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "SQL prepare error (add creator)", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 4;
         error["error"] = "Failed to add creator to chat";
@@ -608,7 +692,7 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
     sqlite3_bind_int(stmt, 3, session->getId());
     sqlite3_bind_int(stmt, 4, isVoiceChat ? 1 : 0);
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Error adding creator to chat: " << sqlite3_errmsg(session->db) << std::endl;
+        CHAT_LOG(error, "Error adding creator to chat", {{ "error", sqlite3_errmsg(session->db) }});
         sqlite3_finalize(stmt);
         boost::json::object error;
         error["topic"] = 4;
@@ -617,7 +701,7 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
         return;
     }
     sqlite3_finalize(stmt);
-    std::cout << "Added creator (user_id: " << session->getId() << ") to chat ID: " << chatId << std::endl;
+    CHAT_LOG(debug, "Added creator to chat", {{ "user", session->getId() }, { "chat", chatId }});
 
         if (!invited.empty()) {
         std::vector<int> validUsers;
@@ -630,11 +714,11 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
                 if (sqlite3_step(stmt) == SQLITE_ROW) {
                     validUsers.push_back(userId);
                 } else {
-                    std::cout << "User ID " << userId << " not found" << std::endl;
+                    CHAT_LOG(warn, "User not found", {{ "user", userId }});
                 }
                 sqlite3_finalize(stmt);
             } catch (const std::exception& e) {
-                std::cerr << "Invalid user ID: " << user << std::endl;
+                CHAT_LOG(warn, "Invalid user ID", {{ "user", user }});
             }
         }
 
@@ -642,7 +726,7 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
             sql = "INSERT OR IGNORE INTO UserInChat(chatid, userid, parentuser, isvoicechat) VALUES(?,?,?,?)";
             rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
             if (rc != SQLITE_OK) {
-                std::cerr << "SQL prepare error (add invited): " << sqlite3_errmsg(session->db) << std::endl;
+                CHAT_LOG(error, "SQL prepare error (add invited)", {{ "error", sqlite3_errmsg(session->db) }});
                 return;
             }
             for (int id : validUsers) {
@@ -651,12 +735,12 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
                 sqlite3_bind_int(stmt, 3, session->getId());
                 sqlite3_bind_int(stmt, 4, isVoiceChat ? 1 : 0);
                 if (sqlite3_step(stmt) != SQLITE_DONE) {
-                    std::cerr << "Failed to add user " << id << " to chat: " << sqlite3_errmsg(session->db) << std::endl;
+                    CHAT_LOG(error, "Failed to add user to chat", {{ "user", id }, { "error", sqlite3_errmsg(session->db) }});
                 }
                 sqlite3_reset(stmt);
             }
             sqlite3_finalize(stmt);
-            std::cout << "Added " << validUsers.size() << " invited users to chat ID: " << chatId << std::endl;
+            CHAT_LOG(debug, "Added invited users to chat", {{ "chat", chatId }, { "users", validUsers.size() }});
         }
     }
 
@@ -671,13 +755,8 @@ void shared_state::createChat(websocket_session* session, std::string chatName,
     auto it = sess___.find(std::to_string(session->getId()));
     if (it != sess___.end() && it->second) {
         it->second->send(ss);
-        std::cout << "Sent CreateChat notification to user ID: " << session->getId() << std::endl;
+        CHAT_LOG(debug, "Sent CreateChat notification", {{ "user", session->getId() }});
     }
-
-    symbols_[std::to_string(chatId)] = boost::make_shared<symbol>(
-        std::to_string(chatId), "",
-        std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch()).count());
 }
 
 void shared_state::getMessageList(websocket_session* session) {
@@ -719,9 +798,10 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
         std::string checkSql = "SELECT 1 FROM Chat WHERE id = ? AND EXISTS "
                           "(SELECT 1 FROM UserInChat WHERE chatid = ? AND userid = ?)";
     sqlite3_stmt* checkStmt = nullptr;
+    metrics::scoped_timer check_timer(chat_metrics::sqlite_latency(chat_metrics::statement::check_member));
     int rc = sqlite3_prepare_v2(session->db, checkSql.c_str(), -1, &checkStmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки SQL (проверка чата): " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "Ошибка подготовки SQL (проверка чата)", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 3;
         error["error"] = "Ошибка базы данных";
@@ -733,7 +813,7 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
     sqlite3_bind_int(checkStmt, 2, std::stoi(chatId));
     sqlite3_bind_int(checkStmt, 3, userId);
     if (sqlite3_step(checkStmt) != SQLITE_ROW) {
-        std::cerr << "Недействительный chatId " << chatId << " или пользователь " << userId << " не в чате\n";
+        CHAT_LOG(warn, "Недействительный chatId или пользователь не в чате", {{ "chat", chatId }, { "user", userId }});
         boost::json::object error;
         error["topic"] = 3;
         error["error"] = "Недействительный чат или пользователь не в чате";
@@ -742,6 +822,7 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
         return;
     }
     sqlite3_finalize(checkStmt);
+    check_timer.stop();
 
     const auto p1 = std::chrono::system_clock::now();
     int64_t date = std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -751,9 +832,10 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
         int msg_id = 0;
     std::string sql = "INSERT INTO Message(text, date, chatid, userid) VALUES(?,?,?,?)";
     sqlite3_stmt* stmt = nullptr;
+    metrics::scoped_timer insert_timer(chat_metrics::sqlite_latency(chat_metrics::statement::insert_message));
     rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
     if (rc != SQLITE_OK) {
-        std::cerr << "Ошибка подготовки SQL: " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "Ошибка подготовки SQL", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 3;
         error["error"] = "Не удалось подготовить вставку сообщения";
@@ -766,7 +848,7 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
     sqlite3_bind_int(stmt, 3, std::stoi(chatId));
     sqlite3_bind_int(stmt, 4, userId);
     if (sqlite3_step(stmt) != SQLITE_DONE) {
-        std::cerr << "Ошибка вставки сообщения в БД: " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "Ошибка вставки сообщения в БД", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 3;
         error["error"] = sqlite3_errmsg(session->db);
@@ -776,12 +858,14 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
     }
     msg_id = sqlite3_last_insert_rowid(session->db);
     sqlite3_finalize(stmt);
+    insert_timer.stop();
 
         boost::json::object obj;
     obj["topic"] = 3;
     obj["text"] = *ss;
     obj["msg_id"] = msg_id;
     std::string sqlUser = "SELECT name FROM Users WHERE id=?";
+    metrics::scoped_timer name_timer(chat_metrics::sqlite_latency(chat_metrics::statement::select_user_name));
     rc = sqlite3_prepare_v2(session->db, sqlUser.c_str(), -1, &stmt, nullptr);
     sqlite3_bind_int(stmt, 1, userId);
     if (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -791,22 +875,26 @@ void shared_state::sendMsg(websocket_session* session, std::string message) {
     }
     obj["date"] = date;
     sqlite3_finalize(stmt);
+    name_timer.stop();
 
-        std::vector<boost::weak_ptr<websocket_session>> v;
+    obj["to"] = std::stoi(chatId);
+
+    // Numbered and fanned out under the room lock so every subscriber gets
+    // the messages in seq order.
     {
-        std::lock_guard<std::mutex> lock_symbol(symbols_[chatId]->mutex_);
-        v.reserve(symbols_[chatId]->sessions_.size());
-        for (auto p : symbols_[chatId]->sessions_) {
+        auto sym = get_symbol(chatId);
+        std::lock_guard<std::mutex> lock_symbol(sym->mutex_);
+        auto ss = sym->record(obj);
+        std::vector<boost::weak_ptr<websocket_session>> v;
+        v.reserve(sym->sessions_.size());
+        for (auto p : sym->sessions_) {
             v.emplace_back(p->weak_from_this());
         }
+        fanout(v, ss);
     }
-    for (auto const& wp : v) {
-        if (auto sp = wp.lock()) {
-            sp->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        }
-    }
+    chat_metrics::messages.inc();
 
-    spsc_queue_subscriber_.push(std::make_tuple(parser::MsgType::MESSAGE, std::stoi(chatId), userId, *ss, date, std::nullopt));
+    enqueue(std::make_tuple(parser::MsgType::MESSAGE, std::stoi(chatId), userId, *ss, date, std::nullopt));
 }
 
 void shared_state::leave(websocket_session* session)
@@ -817,6 +905,21 @@ void shared_state::leave(websocket_session* session)
     sessions_.erase(session);
 }
 
+// Clients may send large counters as numbers (possibly doubles) or strings.
+static std::uint64_t
+json_u64(boost::json::value const& v)
+{
+    if (v.is_uint64())
+        return v.as_uint64();
+    if (v.is_int64())
+        return v.as_int64() < 0 ? 0 : static_cast<std::uint64_t>(v.as_int64());
+    if (v.is_double())
+        return v.as_double() < 0 ? 0 : static_cast<std::uint64_t>(v.as_double());
+    if (v.is_string())
+        return std::strtoull(v.as_string().c_str(), nullptr, 10);
+    return 0;
+}
+
 void shared_state::parse(std::string msg, websocket_session* session)
 {
     try {
@@ -841,7 +944,11 @@ void shared_state::parse(std::string msg, websocket_session* session)
         case parser::MsgType::SUBSCRIBE:
         {
             std::string chatId = std::to_string(boost::json::value_to<int>(obj.at("to")));
-            websocket_subscribe_to_symbols(session, chatId);
+            boost::optional<resume_point> from;
+            if (obj.contains("since") && obj.contains("epoch")) {
+                from = resume_point{ json_u64(obj.at("epoch")), json_u64(obj.at("since")) };
+            }
+            websocket_subscribe_to_symbols(session, chatId, from);
             break;
         }
         case parser::MsgType::UNSUBSCRIBE:
@@ -897,7 +1004,9 @@ void shared_state::parse(std::string msg, websocket_session* session)
         }
         case parser::MsgType::UpdateAccount:
         {
-            int userId = boost::json::value_to<int>(obj.at("user_id"));
+            // Only the account behind this session may be changed, whatever
+            // user_id the client sends.
+            int userId = static_cast<int>(session->getId());
             std::string newName = obj.contains("name") ? boost::json::value_to<std::string>(obj.at("name")) : "";
             std::string newPassword = obj.contains("password") ? boost::json::value_to<std::string>(obj.at("password")) : "";
             updateAccount(session, userId, newName, newPassword);
@@ -941,22 +1050,6 @@ void shared_state::parse(std::string msg, websocket_session* session)
             int userId = boost::json::value_to<int>(obj.at("user_id"));
             int friendId = boost::json::value_to<int>(obj.at("friend_id"));
             addFriend(session, userId, friendId);
-
-                        boost::json::object notify;
-            notify["topic"] = 17;             notify["friend_id"] = userId;
-            std::string sql = "SELECT name FROM Users WHERE id=?";
-            sqlite3_stmt* stmt;
-            int rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, NULL);
-            sqlite3_bind_int(stmt, 1, userId);
-            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                notify["friend_name"] = std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
-            }
-            sqlite3_finalize(stmt);
-
-            auto it = sess___.find(std::to_string(friendId));
-            if (it != sess___.end() && it->second) {
-                it->second->send(boost::make_shared<std::string>(boost::json::serialize(notify)));
-            }
             break;
         }
         case parser::MsgType::GetFriendsList:
@@ -982,12 +1075,15 @@ void shared_state::parse(std::string msg, websocket_session* session)
         case parser::MsgType::DeleteVoiceChat:
             deleteVoiceChat(session, boost::json::value_to<int>(obj.at("chat_id")));
             break;
+        case parser::MsgType::VoiceToken:
+            issueVoiceToken(session, boost::json::value_to<int>(obj.at("chat_id")));
+            break;
         default:
-            std::cout << "(Неизвестный тип сообщения: " << static_cast<int>(type) << ")\n";
+            CHAT_LOG(warn, "Неизвестный тип сообщения", {{ "type", static_cast<int>(type) }});
             break;
         }
     } catch (const boost::system::system_error& e) {
-        std::cerr << "Ошибка парсинга JSON: " << e.what() << std::endl;
+        CHAT_LOG(warn, "Ошибка парсинга JSON", {{ "error", e.what() }});
         boost::json::object error;
         error["topic"] = 0;
         error["error"] = "Некорректное JSON-сообщение";
@@ -1089,12 +1185,9 @@ void shared_state::addFriend(websocket_session* session, int userId, int friendI
         }
         sqlite3_finalize(checkStmt);
 
-        auto it = sess___.find(std::to_string(friendId));
-        if (it != sess___.end() && it->second) {
-            it->second->send(boost::make_shared<std::string>(boost::json::serialize(notify)));
-        }
+        publish(notify, { static_cast<std::uint32_t>(friendId) });
     } else {
-        std::cerr << "Ошибка вставки запроса на дружбу: " << sqlite3_errmsg(session->db) << "\n";
+        CHAT_LOG(error, "Ошибка вставки запроса на дружбу", {{ "error", sqlite3_errmsg(session->db) }});
         boost::json::object error;
         error["topic"] = 13;
         error["error"] = "Не удалось отправить запрос на дружбу: " + std::string(sqlite3_errmsg(session->db));
@@ -1105,57 +1198,66 @@ void shared_state::addFriend(websocket_session* session, int userId, int friendI
 
 void shared_state::updateAccount(websocket_session* session, int userId, const std::string& newName, const std::string& newPassword)
 {
-    boost::json::object obj;
-    obj["topic"] = 20;
-
-    std::string sql;
-    sqlite3_stmt* stmt = nullptr;
-    int rc;
-
-    if (!newName.empty() && !newPassword.empty()) {
-        sql = "UPDATE Users SET name = ?, password = ? WHERE id = ?";
-        rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_text(stmt, 1, newName.c_str(), -1, nullptr);
-        sqlite3_bind_text(stmt, 2, newPassword.c_str(), -1, nullptr);
-        sqlite3_bind_int(stmt, 3, userId);
-    } else if (!newName.empty()) {
-        sql = "UPDATE Users SET name = ? WHERE id = ?";
-        rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_text(stmt, 1, newName.c_str(), -1, nullptr);
-        sqlite3_bind_int(stmt, 2, userId);
-    } else if (!newPassword.empty()) {
-        sql = "UPDATE Users SET password = ? WHERE id = ?";
-        rc = sqlite3_prepare_v2(session->db, sql.c_str(), -1, &stmt, nullptr);
-        sqlite3_bind_text(stmt, 1, newPassword.c_str(), -1, nullptr);
-        sqlite3_bind_int(stmt, 2, userId);
-    } else {
+    if (newName.empty() && newPassword.empty()) {
+        boost::json::object obj;
+        obj["topic"] = 20;
         obj["status"] = "error";
         obj["error"] = "No fields to update";
         session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
         return;
     }
 
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL prepare error (update account): " << sqlite3_errmsg(session->db) << std::endl;
-        obj["status"] = "error";
-        obj["error"] = "Database error";
-        sqlite3_finalize(stmt);
-        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
-        return;
-    }
+    // Hashing the new password takes tens of milliseconds, so the whole
+    // update runs on the auth pool and the reply is posted back.
+    boost::shared_ptr<websocket_session> self = session->shared_from_this();
+    bool const queued = auth_pool_->post(
+        [self, userId, newName, newPassword](sqlite3* db)
+        {
+            boost::json::object obj;
+            obj["topic"] = 20;
+
+            std::string const hashed = newPassword.empty() ? std::string() : hash_password(newPassword);
+            char const* sql =
+                !newName.empty() && !hashed.empty() ? "UPDATE Users SET name = ?1, pass = ?2 WHERE id = ?3" :
+                !newName.empty() ? "UPDATE Users SET name = ?1 WHERE id = ?3" :
+                "UPDATE Users SET pass = ?2 WHERE id = ?3";
+
+            sqlite3_stmt* stmt = nullptr;
+            if (!db || sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+                CHAT_LOG(error, "SQL prepare error (update account)", {{ "error", db ? sqlite3_errmsg(db) : "no db" }});
+                obj["status"] = "error";
+                obj["error"] = "Database error";
+                sqlite3_finalize(stmt);
+                self->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
+                return;
+            }
+            if (!newName.empty())
+                sqlite3_bind_text(stmt, 1, newName.c_str(), -1, SQLITE_TRANSIENT);
+            if (!hashed.empty())
+                sqlite3_bind_text(stmt, 2, hashed.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 3, userId);
+
+            if (sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(db) > 0) {
+                obj["status"] = "success";
+                if (!newName.empty()) {
+                    obj["name"] = newName;
+                }
+            } else {
+                obj["status"] = "error";
+                obj["error"] = "Failed to update account";
+            }
+            sqlite3_finalize(stmt);
 
-    if (sqlite3_step(stmt) == SQLITE_DONE && sqlite3_changes(session->db) > 0) {
-        obj["status"] = "success";
-        if (!newName.empty()) {
-            obj["name"] = newName;
-        }
-    } else {
+            self->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
+        });
+
+    if (!queued) {
+        boost::json::object obj;
+        obj["topic"] = 20;
         obj["status"] = "error";
-        obj["error"] = "Failed to update account";
+        obj["error"] = "Server is busy, try again later";
+        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
     }
-    sqlite3_finalize(stmt);
-
-    session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
 }
 
 void shared_state::acceptFriendRequest(websocket_session* session, int userId, int friendId) {
@@ -1177,10 +1279,7 @@ void shared_state::acceptFriendRequest(websocket_session* session, int userId, i
         response["topic"] = 15;         response["status"] = "accepted";
         response["friend_id"] = friendId;
         session->send(boost::make_shared<std::string>(boost::json::serialize(response)));
-                auto it = sess___.find(std::to_string(friendId));
-        if (it != sess___.end() && it->second) {
-            it->second->send(boost::make_shared<std::string>(boost::json::serialize(response)));
-        }
+        publish(response, { static_cast<std::uint32_t>(friendId) });
     }
     sqlite3_finalize(stmt);
 }
@@ -1219,6 +1318,7 @@ void shared_state::deleteVoiceChat(websocket_session* session, int chatId)
     if (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_DONE) {
         obj["status"] = "success";
         obj["chat_id"] = chatId;
+        std::lock_guard<std::mutex> lock(symbols_mutex_);
         symbols_.erase(std::to_string(chatId));
     } else {
         obj["status"] = "error";
@@ -1226,13 +1326,47 @@ void shared_state::deleteVoiceChat(websocket_session* session, int chatId)
     }
     sqlite3_finalize(stmt);
 
-    boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
-    std::lock_guard<std::mutex> lock(mutex_);
-    for (auto sess : sessions_) {
-        sess->send(ss);
+    if (obj.at("status").as_string() == "success") {
+        publish(obj);
+    } else {
+        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
     }
 }
 
+// Admission to the voice relay: only members of a voice chat get a token for
+// its channel.
+void shared_state::issueVoiceToken(websocket_session* session, int chatId)
+{
+    boost::json::object obj;
+    obj["topic"] = 23;
+    obj["chat_id"] = chatId;
+    sqlite3_stmt* stmt = nullptr;
+    bool member = false;
+    if (sqlite3_prepare_v2(session->db, "SELECT 1 FROM UserInChat WHERE chatid=? AND userid=? AND isvoicechat=1",
+            -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, chatId);
+        sqlite3_bind_int(stmt, 2, static_cast<int>(session->getId()));
+        member = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    if (!member) {
+        obj["status"] = "error";
+        obj["error"] = "Нет доступа к голосовому чату";
+        session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
+        return;
+    }
+
+    std::string const channel = "voice_chat_" + std::to_string(chatId);
+    obj["status"] = "success";
+    obj["channel"] = channel;
+    std::int64_t expires = 0;
+    if (auto token = issue_voice_token(session->getId(), channel, expires)) {
+        obj["token"] = *token;
+        obj["expires"] = expires;
+    }
+    session->send(boost::make_shared<std::string>(boost::json::serialize(obj)));
+}
+
 void shared_state::getFriendsList(websocket_session* session, int userId) {
     std::string sql = "SELECT u.id, u.name FROM Friends f JOIN Users u ON f.friend_id = u.id WHERE f.user_id = ? "
                      "UNION SELECT requester_id, (SELECT name FROM Users WHERE id = requester_id) FROM FriendRequests "
@@ -2,6 +2,8 @@
 #define BOOST_BEAST_EXAMPLE_WEBSOCKET_CHAT_MULTI_SHARED_STATE_HPP
 
 #include <chrono>
+#include <cstdint>
+#include <deque>
 #include <utility>
 #include <mutex>
 #include <unordered_map>
@@ -11,20 +13,62 @@
 #include <optional>    
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/lockfree/spsc_queue.hpp>
+#include <boost/optional.hpp>
 #include "util.hpp"
 #include "parser.hpp"
+#include "auth.hpp"
+#include "worker_pool.hpp"
+#include "file_cache.hpp"
 #include "sqlite/sqlite3.h"
 
 class websocket_session;
 class symbol;
 
+// Where a reconnecting client left off in the directory/friend event stream.
+struct resume_point
+{
+    std::uint64_t epoch;
+    std::uint64_t seq;
+};
+
+typedef std::tuple<parser::MsgType, uint32_t, uint32_t, std::string, int64_t, std::optional<std::vector<int>>> persistence_job;
+
 class shared_state : public boost::enable_shared_from_this<shared_state>
 {
     std::string const doc_root_;
     std::string const db_root_;
     parser parser_;
+    boost::optional<net::steady_timer> eviction_timer_;
+    bool per_core_ = false;
+    static constexpr std::size_t persistence_queue_capacity = 1024;
+    std::mutex subscriber_queue_mutex_;
+    std::unique_ptr<worker_pool> auth_pool_;
+    std::unique_ptr<worker_pool> read_pool_;
+    std::unique_ptr<file_cache> files_;
+    rate_limiter login_ip_limiter_;
+    rate_limiter login_user_limiter_{ 0.2, 5.0 };
+
+    // Events that go to users rather than rooms (new users, friend requests,
+    // invites, deleted chats and accounts), kept so a resumed session gets
+    // what it missed instead of reloading everything. users empty = everyone.
+    struct user_event
+    {
+        std::uint64_t seq;
+        std::vector<std::uint32_t> users;
+        boost::shared_ptr<std::string const> payload;
+    };
+    std::mutex events_mutex_;
+    std::deque<user_event> events_;
+    std::uint64_t event_seq_ = 0;
+    std::uint64_t event_epoch_ = 0;
+
+    void schedule_symbol_eviction();
 
 public:
+    static constexpr std::chrono::minutes symbol_idle_timeout{ 10 };
+    static constexpr std::chrono::minutes symbol_sweep_interval{ 1 };
+    static constexpr std::size_t event_log_capacity = 4096;
+
     explicit shared_state(std::string doc_root, std::string db_root);
 
     std::string const& doc_root() const noexcept
@@ -37,10 +81,48 @@ public:
         return db_root_;
     }
 
-    void join(websocket_session* session);
+    worker_pool& auth_pool() noexcept
+    {
+        return *auth_pool_;
+    }
+
+    worker_pool& read_pool() noexcept
+    {
+        return *read_pool_;
+    }
+
+    file_cache& files() noexcept
+    {
+        return *files_;
+    }
+
+    // Joins the auth and read workers. For shutdown, after the IO threads
+    // have returned and before logging::stop().
+    void stop_workers();
+
+    bool allow_login(std::string const& ip, std::string const& login);
+    std::string metrics();
+
+    std::uint64_t event_epoch() const noexcept
+    {
+        return event_epoch_;
+    }
+
+    void publish(boost::json::object& obj, std::vector<std::uint32_t> users = {});
+    boost::optional<std::uint64_t> resume(websocket_session* session, resume_point const& from);
+
+    boost::shared_ptr<symbol> get_symbol(std::string const& chatId);
+    boost::shared_ptr<symbol> find_symbol(std::string const& chatId);
+    void run_symbol_eviction(net::io_context& ioc);
+    void set_per_core(bool per_core) noexcept { per_core_ = per_core; }
+    void fanout(std::vector<boost::weak_ptr<websocket_session>> const& sessions, boost::shared_ptr<std::string const> const& ss);
+    bool enqueue(persistence_job job);
+    void evict_idle_symbols();
+
+    std::uint64_t join(websocket_session* session);
     void leave(websocket_session* session);
     void parse(std::string msg, websocket_session* session);
-    void websocket_subscribe_to_symbols(websocket_session* session, std::string chatId);
+    void websocket_subscribe_to_symbols(websocket_session* session, std::string chatId, boost::optional<resume_point> from = boost::none);
     void websocket_unsubscribe_to_symbols(websocket_session* session);
     void searchUsersByName(websocket_session* session, std::string searchTerm);
     void deleteUserFromChat(websocket_session* session, int chatId);
@@ -60,11 +142,13 @@ public:
     void deleteFriend(websocket_session* session, int friendId); 
     void logout(websocket_session* session);                    
     void deleteVoiceChat(websocket_session* session, int chatId); 
+    void issueVoiceToken(websocket_session* session, int chatId);
 
     std::mutex mutex_;
+    std::mutex symbols_mutex_;
     std::map<std::string, boost::shared_ptr<symbol>> symbols_;
     boost::lockfree::spsc_queue<std::pair<std::string, std::string>, boost::lockfree::capacity<1024>> spsc_queue_;
-    boost::lockfree::spsc_queue<std::tuple<parser::MsgType, uint32_t, uint32_t, std::string, int64_t, std::optional<std::vector<int>>>, boost::lockfree::capacity<1024>> spsc_queue_subscriber_;
+    boost::lockfree::spsc_queue<persistence_job, boost::lockfree::capacity<persistence_queue_capacity>> spsc_queue_subscriber_;
     std::unordered_map<std::string, websocket_session*> sess___;
     std::unordered_set<websocket_session*> sessions_;
 };
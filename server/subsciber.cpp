@@ -1,4 +1,7 @@
 #include "subscriber.hpp"
+#include "auth.hpp"
+#include "chat_metrics.hpp"
+#include "logger.hpp"
 #include "symbol.hpp"
 #include <chrono>
 
@@ -13,6 +16,63 @@ subscriber(net::io_context& ioc_subscriber, boost::shared_ptr<shared_state> cons
         return;
     }
     sqlite3_busy_timeout(db, 5000);
+    sqlite3_exec(db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL);
+}
+
+// Chats the user is the only member of.
+#define LONE_MEMBER_CHATS \
+    "SELECT uc.chatid FROM UserInChat uc WHERE uc.userid = ?1 " \
+    "AND NOT EXISTS (SELECT 1 FROM UserInChat o WHERE o.chatid = uc.chatid AND o.userid <> ?1)"
+
+// Memberships, friends and friend requests go away through ON DELETE CASCADE;
+// the statements before the final DELETE only clear the references that do not cascade.
+// Chats left without members are deleted with their messages. The sweep is
+// limited to this user's chats: createChat inserts the chat and its creator's
+// membership separately, so a freshly created chat can briefly have no members.
+static const char* const deleteAccountSql =
+    "UPDATE Chat SET adminid = (SELECT uc.userid FROM UserInChat uc WHERE uc.chatid = Chat.id AND uc.userid <> ?1 LIMIT 1) "
+    "WHERE adminid = ?1 AND EXISTS (SELECT 1 FROM UserInChat uc WHERE uc.chatid = Chat.id AND uc.userid <> ?1);"
+    "UPDATE UserInChat SET parentuser = (SELECT adminid FROM Chat WHERE Chat.id = UserInChat.chatid) WHERE parentuser = ?1;"
+    "DELETE FROM Message WHERE userid = ?1;"
+    "DELETE FROM Message WHERE chatid IN (SELECT id FROM Chat WHERE adminid = ?1) OR chatid IN (" LONE_MEMBER_CHATS ");"
+    "DELETE FROM Chat WHERE adminid = ?1 OR id IN (" LONE_MEMBER_CHATS ");"
+    "DELETE FROM Users WHERE id = ?1;";
+
+#undef LONE_MEMBER_CHATS
+
+bool
+subscriber::
+deleteUserAccount(uint32_t userId)
+{
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+        CHAT_LOG(error, "error in deleting user", {{ "user", userId }, { "error", sqlite3_errmsg(db) }});
+        return false;
+    }
+    const char* tail = deleteAccountSql;
+    while (*tail) {
+        sqlite3_stmt* stmt = NULL;
+        if (sqlite3_prepare_v2(db, tail, -1, &stmt, &tail) != SQLITE_OK) {
+            CHAT_LOG(error, "error in deleting user", {{ "user", userId }, { "error", sqlite3_errmsg(db) }});
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return false;
+        }
+        if (!stmt)
+            continue;
+        sqlite3_bind_int(stmt, 1, userId);
+        int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) {
+            CHAT_LOG(error, "error in deleting user", {{ "user", userId }, { "error", sqlite3_errmsg(db) }});
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return false;
+        }
+    }
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        CHAT_LOG(error, "error in deleting user", {{ "user", userId }, { "error", sqlite3_errmsg(db) }});
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return false;
+    }
+    return true;
 }
 
 void
@@ -22,7 +82,7 @@ subscribe()
     boost::asio::post(net::make_strand(ioc_subscriber_),
         [=]()
         {
-            std::tuple<parser::MsgType, uint32_t, uint32_t, std::string, int64_t, std::optional<std::vector<int>>> msg_tuple;
+            persistence_job msg_tuple;
             while (true) {
                 if (state_->spsc_queue_subscriber_.pop(msg_tuple))
                 {
@@ -34,11 +94,15 @@ subscribe()
                     {
                     case parser::MsgType::MESSAGE:
                     {
-                        std::cout << "Sending msg to db :" << msg << std::endl;
+                        CHAT_LOG(trace, "Sending msg to db", {{ "chat", chatId }, { "user", userId }, { "bytes", msg.size() }});
                         std::string sql = "INSERT INTO Message(text,date,chatid,userid) VALUES(?,?,?,?)";
                         sqlite3_stmt* stmt = NULL;
                         const auto p1 = std::chrono::system_clock::now();
                         int64_t date = std::get<4>(msg_tuple);
+                        auto const lag_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            p1.time_since_epoch()).count() - date;
+                        chat_metrics::persistence_lag.record(static_cast<std::uint64_t>(std::max<int64_t>(0, lag_ms)) * 1000);
+                        metrics::scoped_timer timer(chat_metrics::sqlite_latency(chat_metrics::statement::persist_message));
                         int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
                         sqlite3_bind_text(stmt, 1, msg.c_str(), std::strlen(msg.c_str()), NULL);
                         sqlite3_bind_int64(stmt, 2, date);
@@ -46,7 +110,7 @@ subscribe()
                         sqlite3_bind_int(stmt, 4, userId);
                         auto ans = sqlite3_step(stmt);
                         if (ans != SQLITE_DONE) {
-                            std::cout << "error in inserting message: " << ans << "\n";
+                            CHAT_LOG(error, "error in inserting message", {{ "rc", ans }, { "error", sqlite3_errmsg(db) }});
                         }
                         sqlite3_finalize(stmt);
                         break;
@@ -59,7 +123,7 @@ subscribe()
                         sqlite3_bind_int(stmt, 1, chatId);
                         sqlite3_bind_int(stmt, 2, userId);
                         if (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::cout << "error in delete user from chat\n";
+                            CHAT_LOG(error, "error in delete user from chat", {{ "chat", chatId }, { "user", userId }});
                         }
                         sql = "DELETE FROM Message WHERE Message.chatid=? AND Message.chatid NOT IN (SELECT uc.chatid FROM UserInChat uc)";
                         sqlite3_clear_bindings(stmt);
@@ -72,7 +136,7 @@ subscribe()
                             rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
                             sqlite3_bind_int(stmt, 1, chatId);
                             if (sqlite3_step(stmt) != SQLITE_DONE) {
-                                std::cout << "error in deleting chat without users\n";
+                                CHAT_LOG(error, "error in deleting chat without users", {{ "chat", chatId }});
                             }
                             else {
                                 sql = "SELECT userid,chatid FROM Chat,UserInChat where Chat.id=UserInChat.chatid AND Chat.adminid=? GROUP By (chatid)";
@@ -87,7 +151,7 @@ subscribe()
                                     sqlite3_bind_int(stmt2, 1, sqlite3_column_int(stmt, 0));
                                     sqlite3_bind_int(stmt2, 2, sqlite3_column_int(stmt, 1));
                                     if (sqlite3_step(stmt2) != SQLITE_DONE) {
-                                        std::cout << "error in updating chat adminid\n";
+                                        CHAT_LOG(error, "error in updating chat adminid", {{ "error", sqlite3_errmsg(db) }});
                                     }
                                     sqlite3_finalize(stmt2);
                                 }
@@ -98,60 +162,20 @@ subscribe()
                     }
                     case parser::MsgType::DeleteUserAccount:
                     {
-                        std::string sql = "DELETE FROM UserInChat WHERE userid=?";
-                        sqlite3_stmt* stmt = NULL;
-                        int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-                        sqlite3_bind_int(stmt, 1, userId);
-                        if (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::cout << "error in delete user from chat\n";
-                            break;
-                        }
-                        sql = "DELETE FROM Message WHERE userid=?";
-                        sqlite3_reset(stmt);
-                        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-                        sqlite3_bind_int(stmt, 1, userId);
-                        if (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::cout << "error in delete message\n";
-                            break;
-                        }
-                        sql = "DELETE FROM Chat WHERE Chat.id NOT IN (SELECT uc.chatid FROM UserInChat uc)";
-                        sqlite3_reset(stmt);
-                        sqlite3_clear_bindings(stmt);
-                        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-                        if (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::cout << "error in deleting chat without users\n";
-                        }
-                        sql = "SELECT userid,chatid FROM Chat,UserInChat where Chat.id=UserInChat.chatid AND Chat.adminid=? GROUP By (chatid)";
-                        sqlite3_clear_bindings(stmt);
-                        sqlite3_reset(stmt);
-                        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-                        sqlite3_bind_int(stmt, 1, userId);
-                        while (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::string sql2 = "UPDATE Chat SET adminid=? WHERE id=?";
-                            sqlite3_stmt* stmt2 = NULL;
-                            rc = sqlite3_prepare_v2(db, sql2.c_str(), -1, &stmt2, NULL);
-                            sqlite3_bind_int(stmt2, 1, sqlite3_column_int(stmt, 0));
-                            sqlite3_bind_int(stmt2, 2, sqlite3_column_int(stmt, 1));
-                            if (sqlite3_step(stmt2) != SQLITE_DONE) {
-                                std::cout << "error in updating chat adminid\n";
-                            }
-                            sqlite3_finalize(stmt2);
+                        // Everyone learns about a deletion; only its owner hears of a failure.
+                        boost::json::object obj;
+                        obj["topic"] = 8;
+                        obj["user_id"] = userId;
+                        if (deleteUserAccount(userId)) {
+                            revoke_resume_tokens(userId);
+                            obj["status"] = "success";
+                            state_->publish(obj);
                         }
-                        sql = "UPDATE UserInChat SET parentUser=(SELECT adminid FROM Chat WHERE Chat.id=UserInChat.chatid)";
-                        sqlite3_reset(stmt);
-                        sqlite3_clear_bindings(stmt);
-                        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-                        if (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::cout << "error in updating userinchat parentuser\n";
+                        else {
+                            obj["status"] = "error";
+                            obj["error"] = "Failed to delete account";
+                            state_->publish(obj, { static_cast<std::uint32_t>(userId) });
                         }
-                        sql = "DELETE FROM Users WHERE id=?";
-                        sqlite3_reset(stmt);
-                        rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
-                        sqlite3_bind_int(stmt, 1, userId);
-                        if (sqlite3_step(stmt) != SQLITE_DONE) {
-                            std::cout << "error in deleting user\n";
-                        }
-                        sqlite3_finalize(stmt);
                         break;
                     }
                     case parser::MsgType::InviteToChat:
@@ -164,7 +188,7 @@ subscribe()
                             int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL);
                             sqlite3_bind_int(stmt, 1, user);
                             if (sqlite3_step(stmt) != SQLITE_ROW) {
-                                std::cout << "User with id " << user << " not found, skipping\n";
+                                CHAT_LOG(warn, "User not found, skipping", {{ "user", user }});
                                 sqlite3_finalize(stmt);
                                 continue;
                             }
@@ -176,7 +200,7 @@ subscribe()
                             sqlite3_bind_int(stmt, 2, user);
                             sqlite3_bind_int(stmt, 3, userId);
                             if (sqlite3_step(stmt) != SQLITE_DONE) {
-                                std::cout << "error in inviting user " << user << " to chat " << chatId << "\n";
+                                CHAT_LOG(error, "error in inviting user", {{ "user", user }, { "chat", chatId }});
                             }
                             sqlite3_reset(stmt);
                             sqlite3_clear_bindings(stmt);
@@ -185,7 +209,7 @@ subscribe()
                         break;
                     }
                     default:
-                        std::cout << "Unsupported message type\n";
+                        CHAT_LOG(warn, "Unsupported message type", {{ "type", static_cast<int>(type) }});
                         break;
                     }
                 }
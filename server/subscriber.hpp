@@ -10,6 +10,7 @@ class subscriber : public boost::enable_shared_from_this<subscriber>
     net::io_context& ioc_subscriber_;
     boost::shared_ptr<shared_state> state_;
     sqlite3* db;
+    bool deleteUserAccount(uint32_t userId);
 public:
     explicit
         subscriber(net::io_context& ioc_subscriber, boost::shared_ptr<shared_state> const& state);
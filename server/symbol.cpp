@@ -5,11 +5,37 @@ symbol::
 symbol(std::string code, std::string quote, std::chrono::milliseconds::rep time)
     : code(std::move(code))
     , quote(quote)
-    , time(time),
+    , time(time)
+    , epoch(time),
     refcount(0)
 {
 }
 
+boost::shared_ptr<std::string const>
+symbol::
+record(boost::json::object& obj)
+{
+    obj["seq"] = ++seq;
+    auto ss = boost::make_shared<std::string const>(boost::json::serialize(obj));
+    log_.emplace_back(seq, ss);
+    if (log_.size() > log_capacity)
+        log_.pop_front();
+    return ss;
+}
+
+bool
+symbol::
+replay(websocket_session* session, std::uint64_t since) const
+{
+    if (since > seq || (!log_.empty() && log_.front().first > since + 1))
+        return false;
+    if (log_.empty())
+        return since == seq;
+    for (auto it = log_.begin() + static_cast<std::ptrdiff_t>(since + 1 - log_.front().first); it != log_.end(); ++it)
+        session->send(it->second);
+    return true;
+}
+
 void
 symbol::
 join(websocket_session* session)
@@ -4,6 +4,8 @@
 #include "util.hpp"
 #include "websocket_session.hpp"
 #include <boost/atomic.hpp>
+#include <cstdint>
+#include <deque>
 
 class symbol : public boost::enable_shared_from_this<symbol>
 {
@@ -11,6 +13,12 @@ public:
     std::string code;
     std::string quote;
     std::chrono::milliseconds::rep time;
+    // Identifies this instance of the room; a room evicted and created again
+    // starts a new sequence.
+    std::chrono::milliseconds::rep const epoch;
+    std::uint64_t seq = 0;
+    std::deque<std::pair<std::uint64_t, boost::shared_ptr<std::string const>>> log_;
+    static constexpr std::size_t log_capacity = 256;
     mutable boost::atomic<int> refcount;
     std::unordered_set<websocket_session*> sessions_;
     std::mutex mutex_;
@@ -18,6 +26,9 @@ public:
         symbol(std::string code, std::string quote, std::chrono::milliseconds::rep time);
     void join(websocket_session* session);
     int leave(websocket_session* session);
+    // Both require mutex_ to be held.
+    boost::shared_ptr<std::string const> record(boost::json::object& obj);
+    bool replay(websocket_session* session, std::uint64_t since) const;
 };
 
 #endif // SRAVZ_SYMBOL_HPP
\ No newline at end of file
@@ -12,6 +12,15 @@ bool getenv(const char* name, std::string& env)
     return !!ret;
 }
 
+int getenv_or(const char* name, int fallback)
+{
+    const char* ret = std::getenv(name);
+    if (!ret || !*ret) {
+        return fallback;
+    }
+    return std::atoi(ret);
+}
+
 std::string decToHexa(size_t n)
 {
     char hexaDeciNum[100];
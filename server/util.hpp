@@ -18,7 +18,6 @@
 #include <boost/json.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/lockfree/spsc_queue.hpp>
-#include <boost/log/trivial.hpp>
 #include <boost/smart_ptr.hpp>
 #include <boost/thread.hpp>
 #include <chrono>
@@ -62,6 +61,7 @@ public:
 typedef std::map<boost::thread::id, ThreadInfo> ThreadsInfo;
 
 bool getenv(const char* name, std::string& env);
+int getenv_or(const char* name, int fallback);
 std::string decToHexa(size_t n);
 std::string SHA256HashString(std::string aString);
 
@@ -1,13 +1,16 @@
 #include "websocket_session.hpp"
-#include <iostream>
+#include "chat_metrics.hpp"
+#include "logger.hpp"
 
 
 websocket_session::
 websocket_session(
     tcp::socket&& socket,
-    boost::shared_ptr<shared_state> const& state,int id)
+    boost::shared_ptr<shared_state> const& state,int id,
+    boost::optional<resume_point> resume)
     : ws_(std::move(socket))
     , state_(state),id(id)
+    , resume_(resume)
 {
     int res = sqlite3_open(state_->db_root().c_str(), &db);
     if (res != SQLITE_OK) {
@@ -16,13 +19,18 @@ websocket_session(
 
     }
     sqlite3_busy_timeout(db, 5000);
+    chat_metrics::websocket_sessions.add(1);
 }
 
-void websocket_session::getMyId()
+void websocket_session::getMyId(std::uint64_t event_seq, bool resumed)
 {
     boost::json::object obj;
     obj["topic"] = 7;
     obj["user_id"] = id;
+    obj["token"] = issue_resume_token(id);
+    obj["event_epoch"] = state_->event_epoch();
+    obj["event_seq"] = event_seq;
+    obj["resumed"] = resumed;
     boost::shared_ptr<std::string> ss = boost::make_shared<std::string>(boost::json::serialize(obj));
     send(ss);
 }
@@ -32,6 +40,7 @@ websocket_session::
 {
     state_->leave(this);
     sqlite3_close(db);
+    chat_metrics::websocket_sessions.add(-1);
 }
 
 void
@@ -42,7 +51,7 @@ fail(beast::error_code ec, char const* what)
         ec == websocket::error::closed)
         return;
 
-    std::cerr << what << ": " << ec.message() << "\n";
+    CHAT_LOG(warn, what, {{ "user", id }, { "error", ec.message() }});
 }
 
 void websocket_session::on_accept(beast::error_code ec)
@@ -50,15 +59,17 @@ void websocket_session::on_accept(beast::error_code ec)
     if (ec)
         return fail(ec, "accept");
     
-    std::cout << "Adding session to shared state\n";
-    state_->join(this);
-    std::cout << "Sending user list\n";
-    state_->getUserList(this);
-    std::cout << "Sending chat list\n";
-    state_->getChatList(this);
-    std::cout << "Sending user ID\n";
-    getMyId();
-    std::cout << "Starting async read\n";
+    boost::optional<std::uint64_t> seq;
+    if (resume_)
+        seq = state_->resume(this, *resume_);
+    bool const resumed = seq.has_value();
+    if (!resumed) {
+        seq = state_->join(this);
+        state_->getUserList(this);
+        state_->getChatList(this);
+    }
+    getMyId(*seq, resumed);
+    CHAT_LOG(debug, "websocket session accepted", {{ "user", id }, { "resumed", resumed }});
     ws_.async_read(
         buffer_,
         beast::bind_front_handler(
@@ -73,6 +84,7 @@ on_read(beast::error_code ec, std::size_t)
     if (ec)
         return fail(ec, "read");
 
+    chat_metrics::frames_received.inc();
     state_->parse(beast::buffers_to_string(buffer_.data()), this);
     
     buffer_.consume(buffer_.size());
@@ -101,6 +113,7 @@ websocket_session::
 on_send(boost::shared_ptr<std::string const> const& ss)
 {
     queue_.push_back(ss);
+    chat_metrics::send_queue_depth.record(queue_.size());
 
     if (queue_.size() > 1)
         return;
@@ -20,6 +20,7 @@ class websocket_session : public boost::enable_shared_from_this<websocket_sessio
     boost::shared_ptr<shared_state> state_;
     std::vector<boost::shared_ptr<std::string const>> queue_;
     uint32_t id;
+    boost::optional<resume_point> resume_;
     parser parser_;
     void fail(beast::error_code ec, char const* what);
     void on_accept(beast::error_code ec);
@@ -31,8 +32,9 @@ public:
     sqlite3* db;
     websocket_session(
         tcp::socket&& socket,
-        boost::shared_ptr<shared_state> const& state,int id);
-    void getMyId();
+        boost::shared_ptr<shared_state> const& state,int id,
+        boost::optional<resume_point> resume = boost::none);
+    void getMyId(std::uint64_t event_seq, bool resumed);
     ~websocket_session();
     uint32_t getId() const { return this->id; }
     template<class Body, class Allocator>
@@ -43,6 +45,13 @@ public:
     void
         send(boost::shared_ptr<std::string const> const& ss);
 
+    net::any_io_executor
+        get_executor() { return ws_.get_executor(); }
+
+    // Must be called on get_executor(); used by batched fan-out.
+    void
+        deliver(boost::shared_ptr<std::string const> const& ss) { on_send(ss); }
+
 private:
     void
         on_send(boost::shared_ptr<std::string const> const& ss);
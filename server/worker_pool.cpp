@@ -0,0 +1,114 @@
+#include "worker_pool.hpp"
+#include "logger.hpp"
+#include <iostream>
+
+worker_pool::
+worker_pool(std::string const& db_root, std::size_t threads, std::size_t capacity)
+    : capacity_(capacity == 0 ? 1 : capacity)
+{
+    if (threads == 0)
+        threads = 1;
+    threads_.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i)
+        threads_.emplace_back([this, db_root] { run(db_root); });
+}
+
+worker_pool::
+~worker_pool()
+{
+    stop();
+}
+
+void
+worker_pool::
+stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_)
+        if (t.joinable())
+            t.join();
+}
+
+bool
+worker_pool::
+post(job j)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopped_ || queue_.size() >= capacity_) {
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        queue_.push_back(entry{ std::move(j), std::chrono::steady_clock::now() });
+    }
+    cv_.notify_one();
+    return true;
+}
+
+worker_pool::stats
+worker_pool::
+snapshot()
+{
+    std::size_t depth;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        depth = queue_.size();
+    }
+    return stats{
+        completed_.load(std::memory_order_relaxed),
+        rejected_.load(std::memory_order_relaxed),
+        queue_delay_us_sum_.load(std::memory_order_relaxed),
+        queue_delay_us_max_.load(std::memory_order_relaxed),
+        depth,
+        capacity_,
+        threads_.size() };
+}
+
+void
+worker_pool::
+run(std::string const& db_root)
+{
+    sqlite3* db = nullptr;
+    if (sqlite3_open(db_root.c_str(), &db) != SQLITE_OK) {
+        std::cerr << "worker_pool: unable to open db: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        db = nullptr;
+    }
+    else {
+        sqlite3_busy_timeout(db, 5000);
+    }
+
+    for (;;) {
+        entry e;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopped_ || !queue_.empty(); });
+            if (queue_.empty())
+                break;
+            e = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        std::uint64_t const delay = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - e.enqueued).count();
+        queue_delay_us_sum_.fetch_add(delay, std::memory_order_relaxed);
+        std::uint64_t max = queue_delay_us_max_.load(std::memory_order_relaxed);
+        while (delay > max &&
+            !queue_delay_us_max_.compare_exchange_weak(max, delay, std::memory_order_relaxed)) {
+        }
+
+        try {
+            e.fn(db);
+        }
+        catch (std::exception const& ex) {
+            CHAT_LOG(error, "worker_pool: job failed", {{ "error", ex.what() }});
+        }
+        completed_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    sqlite3_close(db);
+}
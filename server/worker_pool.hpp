@@ -0,0 +1,69 @@
+#ifndef SRAVZ_WORKER_POOL_HPP
+#define SRAVZ_WORKER_POOL_HPP
+
+#include "sqlite/sqlite3.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads for blocking work (password hashing, SQLite reads)
+// that must not run on the IO threads. Each worker owns its own SQLite
+// connection. The queue is bounded: post() fails instead of letting a
+// reconnect storm pile up unbounded work.
+class worker_pool
+{
+public:
+    typedef std::function<void(sqlite3*)> job;
+
+    struct stats
+    {
+        std::uint64_t completed;
+        std::uint64_t rejected;
+        std::uint64_t queue_delay_us_sum;
+        std::uint64_t queue_delay_us_max;
+        std::size_t depth;
+        std::size_t capacity;
+        std::size_t threads;
+    };
+
+    worker_pool(std::string const& db_root, std::size_t threads, std::size_t capacity);
+    worker_pool(worker_pool const&) = delete;
+    worker_pool& operator=(worker_pool const&) = delete;
+    ~worker_pool();
+
+    // Runs what is queued, then joins the threads; post() fails from here on.
+    void stop();
+    bool post(job j);
+    stats snapshot();
+
+private:
+    struct entry
+    {
+        job fn;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    void run(std::string const& db_root);
+
+    std::size_t const capacity_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<entry> queue_;
+    bool stopped_ = false;
+    std::vector<std::thread> threads_;
+
+    std::atomic<std::uint64_t> completed_{ 0 };
+    std::atomic<std::uint64_t> rejected_{ 0 };
+    std::atomic<std::uint64_t> queue_delay_us_sum_{ 0 };
+    std::atomic<std::uint64_t> queue_delay_us_max_{ 0 };
+};
+
+#endif
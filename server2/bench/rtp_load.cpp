@@ -0,0 +1,247 @@
+// Load generator for the RTP relay: registers channels * members UDP clients,
+// lets the first speakers of every channel send voice packets at a fixed rate
+// and reports relayed packets/s, loss and the relay latency seen by the
+// receivers (each packet carries its send time). With "mix" the channels are
+// registered in mixing mode and it reports the mixed frames each member got.
+
+#include "packet_pool.hpp"
+#include "voice_packet.hpp"
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace net = boost::asio;
+using udp = boost::asio::ip::udp;
+using clock_type = std::chrono::steady_clock;
+
+static std::uint64_t
+now_ns()
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        clock_type::now().time_since_epoch()).count());
+}
+
+struct member : std::enable_shared_from_this<member>
+{
+    udp::socket socket;
+    net::steady_timer timer;
+    udp::endpoint const& server;
+    std::string const channel;
+    std::string packet;
+    VoiceHeader header;
+    udp::endpoint from;
+    // Anything the server relays fits its own receive buffer, including a
+    // mixed frame (header plus 1024 samples) and echoed large payloads.
+    std::array<char, BUFFER_SIZE> data;
+    clock_type::time_point next;
+    bool registered = false;
+    bool mix = false;
+    std::size_t sent = 0;
+    std::size_t received = 0;
+    std::size_t mixed = 0;
+    std::vector<double> latency_us;
+
+    member(net::io_context& ioc, udp::endpoint const& server, std::string channel, std::size_t payload, std::uint32_t ssrc)
+        : socket(ioc, udp::endpoint(server.address().is_v4() ? udp::v4() : udp::v6(), 0))
+        , timer(ioc)
+        , server(server)
+        , channel(std::move(channel))
+        , packet(VOICE_HEADER_SIZE + std::max<std::size_t>(payload, 8), 'x')
+    {
+        header.ssrc = ssrc;
+    }
+
+    void receive()
+    {
+        socket.async_receive_from(net::buffer(data), from,
+            [self = shared_from_this()](boost::system::error_code ec, std::size_t n)
+            {
+                if (ec)
+                    return;
+                self->on_packet(n);
+                self->receive();
+            });
+    }
+
+    void on_packet(std::size_t n)
+    {
+        if (isVoicePacket(data.data(), n))
+        {
+            if (readVoiceHeader(data.data()).flags & VOICE_FLAG_MIXED)
+            {
+                ++mixed;
+                return;
+            }
+            if (n < VOICE_HEADER_SIZE + 8)
+                return;
+            std::uint64_t sent_ns;
+            std::memcpy(&sent_ns, data.data() + VOICE_HEADER_SIZE, 8);
+            ++received;
+            latency_us.push_back(static_cast<double>(now_ns() - sent_ns) / 1000.0);
+            return;
+        }
+        // "REGISTERED <id>" or "RE-REGISTERED <id>"
+        std::string const reply(data.data(), n);
+        auto const space = reply.find(' ');
+        if (space != std::string::npos &&
+            (reply.compare(0, space, "REGISTERED") == 0 || reply.compare(0, space, "RE-REGISTERED") == 0))
+        {
+            header.channel = static_cast<std::uint32_t>(std::strtoul(reply.c_str() + space + 1, nullptr, 10));
+            registered = true;
+        }
+    }
+
+    void register_channel()
+    {
+        auto msg = std::make_shared<std::string>("REGISTER " + channel + (mix ? " MIX" : ""));
+        socket.async_send_to(net::buffer(*msg), server,
+            [msg](boost::system::error_code, std::size_t) {});
+    }
+
+    void speak(clock_type::time_point start, std::chrono::nanoseconds interval, clock_type::time_point stop_at)
+    {
+        next = start;
+        tick(interval, stop_at);
+    }
+
+    void tick(std::chrono::nanoseconds interval, clock_type::time_point stop_at)
+    {
+        if (next >= stop_at)
+            return;
+        timer.expires_at(next);
+        timer.async_wait(
+            [self = shared_from_this(), interval, stop_at](boost::system::error_code ec)
+            {
+                if (ec)
+                    return;
+                auto const ts = now_ns();
+                auto& h = self->header;
+                ++h.sequence;
+                h.timestamp += static_cast<std::uint32_t>((self->packet.size() - VOICE_HEADER_SIZE) / 2);
+                writeVoiceHeader(&self->packet[0], h);
+                std::memcpy(&self->packet[VOICE_HEADER_SIZE], &ts, 8);
+                boost::system::error_code ignored;
+                self->socket.send_to(net::buffer(self->packet), self->server, 0, ignored);
+                ++self->sent;
+                self->next += interval;
+                self->tick(interval, stop_at);
+            });
+    }
+};
+
+static double
+percentile(std::vector<double>& v, double p)
+{
+    if (v.empty())
+        return 0;
+    auto const i = static_cast<std::size_t>(p * static_cast<double>(v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + static_cast<std::ptrdiff_t>(i), v.end());
+    return v[i];
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr <<
+            "Usage: rtp_load <host> <port> [channels] [members] [speakers] [seconds] [payload bytes] [packets/s] [mix]\n" <<
+            "Example:\n" <<
+            "    rtp_load 127.0.0.1 5004 50 20 2 10 160 50\n" <<
+            "    rtp_load 127.0.0.1 5004 1 50 10 10 2048 43 mix\n";
+        return EXIT_FAILURE;
+    }
+    int const channels = argc > 3 ? std::max(1, std::atoi(argv[3])) : 50;
+    int const members = argc > 4 ? std::max(2, std::atoi(argv[4])) : 20;
+    int const speakers = argc > 5 ? std::min(members, std::max(1, std::atoi(argv[5]))) : 2;
+    int const seconds = argc > 6 ? std::max(1, std::atoi(argv[6])) : 10;
+    std::size_t const payload = argc > 7 ? static_cast<std::size_t>(std::max(8, std::atoi(argv[7]))) : 160;
+    int const rate = argc > 8 ? std::max(1, std::atoi(argv[8])) : 50;
+    bool const mix = argc > 9 && std::string(argv[9]) == "mix";
+
+    net::io_context ioc;
+    auto const server = *udp::resolver(ioc).resolve(argv[1], argv[2]).begin();
+    std::vector<std::shared_ptr<member>> all;
+    for (int c = 0; c < channels; ++c)
+        for (int m = 0; m < members; ++m)
+        {
+            all.push_back(std::make_shared<member>(ioc, server.endpoint(),
+                "bench-" + std::to_string(c), payload, static_cast<std::uint32_t>(all.size() + 1)));
+            all.back()->mix = mix;
+            all.back()->receive();
+        }
+
+    // Registration is a datagram too: repeat until everyone got an answer.
+    auto const register_deadline = clock_type::now() + std::chrono::seconds(10);
+    for (;;)
+    {
+        std::size_t pending = 0;
+        for (auto const& m : all)
+            if (!m->registered)
+            {
+                m->register_channel();
+                ++pending;
+            }
+        if (pending == 0)
+            break;
+        if (clock_type::now() > register_deadline)
+        {
+            std::cerr << pending << " clients were not registered (server full?)\n";
+            return EXIT_FAILURE;
+        }
+        ioc.restart();
+        ioc.run_for(std::chrono::milliseconds(200));
+    }
+
+    auto const interval = std::chrono::nanoseconds(1000000000LL / rate);
+    auto const start = clock_type::now() + std::chrono::milliseconds(50);
+    auto const stop_at = start + std::chrono::seconds(seconds);
+    for (int c = 0; c < channels; ++c)
+        for (int s = 0; s < speakers; ++s)
+            // Spread the speakers over one interval instead of sending in bursts.
+            all[static_cast<std::size_t>(c * members + s)]->speak(
+                start + interval * (c * speakers + s) / (channels * speakers), interval, stop_at);
+
+    ioc.restart();
+    ioc.run_until(stop_at + std::chrono::milliseconds(500));
+
+    std::size_t sent = 0, received = 0, mixed = 0;
+    std::vector<double> latency;
+    for (auto const& m : all)
+    {
+        sent += m->sent;
+        received += m->received;
+        mixed += m->mixed;
+        latency.insert(latency.end(), m->latency_us.begin(), m->latency_us.end());
+    }
+    if (mix)
+    {
+        std::cout
+            << "clients:          " << all.size() << " in " << channels << " mixed channels, "
+            << speakers << " speaking\n"
+            << "sent:             " << sent << " (" << static_cast<double>(sent) / seconds << " packets/s)\n"
+            << "mixed received:   " << mixed << " ("
+            << static_cast<double>(mixed) / seconds / static_cast<double>(all.size()) << " frames/s per member)\n";
+        return mixed == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    auto const expected = sent * static_cast<std::size_t>(members - 1);
+    std::cout
+        << "clients:          " << all.size() << " in " << channels << " channels, "
+        << speakers << " speaking\n"
+        << "sent:             " << sent << " (" << static_cast<double>(sent) / seconds << " packets/s)\n"
+        << "relayed:          " << received << " (" << static_cast<double>(received) / seconds << " packets/s)\n"
+        << "lost:             " << (expected > received ? expected - received : 0) << " of " << expected << "\n"
+        << "latency p50/p99/p999/max: "
+        << percentile(latency, 0.50) << " / " << percentile(latency, 0.99) << " / "
+        << percentile(latency, 0.999) << " / " << percentile(latency, 1.0) << " us\n";
+    return received == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
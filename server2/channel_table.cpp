@@ -0,0 +1,141 @@
+#include "channel_table.hpp"
+#include <algorithm>
+
+ChannelTable::ChannelTable(std::size_t max_channels, std::size_t readers)
+    : max_channels_(max_channels),
+      channels_(new std::atomic<const Members *>[max_channels]),
+      readers_(new Reader[readers]),
+      reader_count_(readers)
+{
+    for (std::size_t i = 0; i < max_channels_; ++i) {
+        channels_[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+ChannelTable::~ChannelTable()
+{
+    for (std::size_t i = 0; i < max_channels_; ++i) {
+        delete channels_[i].load(std::memory_order_relaxed);
+    }
+    for (const auto &r : retired_) {
+        delete r.members;
+    }
+}
+
+std::optional<ChannelTable::Membership> ChannelTable::join(const std::string &name,
+                                                          const boost::asio::ip::udp::endpoint &member)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ids_.find(name);
+    if (it == ids_.end()) {
+        std::uint32_t id;
+        if (!free_ids_.empty()) {
+            id = free_ids_.back();
+            free_ids_.pop_back();
+            names_[id] = name;
+        } else if (names_.size() < max_channels_) {
+            id = static_cast<std::uint32_t>(names_.size());
+            names_.push_back(name);
+        } else {
+            return std::nullopt;
+        }
+        it = ids_.emplace(name, Membership{ id, next_generation_++ }).first;
+    }
+    add(it->second.id, member);
+    return it->second;
+}
+
+// Called with mutex_ held.
+void ChannelTable::add(std::uint32_t channel, const boost::asio::ip::udp::endpoint &member)
+{
+    auto &positions = positions_[channel];
+    if (positions.count(member)) {
+        return;
+    }
+    const Members *old = channels_[channel].load(std::memory_order_relaxed);
+    auto next = old ? std::make_unique<Members>(*old) : std::make_unique<Members>();
+    positions[member] = next->size();
+    next->push_back(member);
+    publish(channel, next.release());
+}
+
+void ChannelTable::remove(std::uint32_t channel, const std::vector<boost::asio::ip::udp::endpoint> &members)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Members *old = channels_[channel].load(std::memory_order_relaxed);
+    if (!old) {
+        return;
+    }
+    // Readers still need a fresh array, but that is one copy; each removal
+    // after it is O(1).
+    auto next = std::make_unique<Members>(*old);
+    auto &positions = positions_[channel];
+    for (const auto &m : members) {
+        auto it = positions.find(m);
+        if (it == positions.end()) {
+            continue;
+        }
+        std::size_t const i = it->second;
+        positions.erase(it);
+        if (i + 1 != next->size()) {
+            (*next)[i] = next->back();
+            positions[(*next)[i]] = i;
+        }
+        next->pop_back();
+    }
+    if (next->empty()) {
+        positions_.erase(channel);
+        publish(channel, nullptr);
+        ids_.erase(names_[channel]);
+        names_[channel].clear();
+        free_ids_.push_back(channel);
+    } else {
+        publish(channel, next.release());
+    }
+}
+
+void ChannelTable::collect()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    reclaim();
+}
+
+std::size_t ChannelTable::activeChannels() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t active = 0;
+    for (std::size_t i = 0; i < names_.size(); ++i) {
+        if (channels_[i].load(std::memory_order_relaxed)) {
+            ++active;
+        }
+    }
+    return active;
+}
+
+// Called with mutex_ held. The epoch bump comes after the pointer swap, so a
+// reader that has seen the new epoch can no longer load the old array.
+void ChannelTable::publish(std::uint32_t channel, const Members *members)
+{
+    const Members *old = channels_[channel].exchange(members, std::memory_order_acq_rel);
+    if (old) {
+        retired_.push_back({ old, epoch_.fetch_add(1, std::memory_order_acq_rel) });
+    }
+    reclaim();
+}
+
+void ChannelTable::reclaim()
+{
+    if (retired_.empty()) {
+        return;
+    }
+    std::uint64_t oldest = epoch_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < reader_count_; ++i) {
+        oldest = std::min(oldest, readers_[i].seen.load(std::memory_order_acquire));
+    }
+    auto const done = std::partition(retired_.begin(), retired_.end(),
+        [oldest](const Retired &r) { return r.epoch >= oldest; });
+    for (auto it = done; it != retired_.end(); ++it) {
+        delete it->members;
+    }
+    retired_.erase(done, retired_.end());
+}
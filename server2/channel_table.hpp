@@ -0,0 +1,97 @@
+#ifndef RTP_CHANNEL_TABLE_HPP
+#define RTP_CHANNEL_TABLE_HPP
+
+#include <boost/asio/ip/udp.hpp>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Channel membership, read by every shard thread on every audio packet.
+//
+// Each channel's members are an immutable array behind an atomic pointer.
+// Readers load the pointer and use the array without any lock. Writers
+// (registration, the cleanup sweep) serialize on one mutex, publish a
+// modified copy and retire the old array. A retired array is deleted once
+// every reader has passed a quiescent point after the swap (RCU with
+// quiescent-state reclamation): readers call quiescent() whenever they hold
+// no array, i.e. between batches of packets.
+class ChannelTable {
+public:
+    typedef std::vector<boost::asio::ip::udp::endpoint> Members;
+
+    struct Membership {
+        std::uint32_t id;
+        // Ids of channels that emptied are reused; every assignment of an id
+        // to a name gets a new generation, so per-id state can tell a reused
+        // id from the channel that had it before.
+        std::uint64_t generation;
+    };
+
+    ChannelTable(std::size_t max_channels, std::size_t readers);
+    ~ChannelTable();
+    ChannelTable(const ChannelTable &) = delete;
+    ChannelTable &operator=(const ChannelTable &) = delete;
+
+    // Adds member to the channel called name, assigning an id if the channel
+    // has none. Lookup and insertion are one step, so the id cannot be
+    // released in between. nullopt once max_channels channels are live.
+    std::optional<Membership> join(const std::string &name, const boost::asio::ip::udp::endpoint &member);
+
+    // Valid until the calling reader's next quiescent(); null for an empty
+    // channel.
+    const Members *members(std::uint32_t channel) const noexcept
+    {
+        return channels_[channel].load(std::memory_order_acquire);
+    }
+
+    void quiescent(std::size_t reader) noexcept
+    {
+        readers_[reader].seen.store(epoch_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // A channel left empty gives up its name and its id.
+    void remove(std::uint32_t channel, const std::vector<boost::asio::ip::udp::endpoint> &members);
+
+    // Frees retired arrays that no reader can still see. Writes do this too;
+    // call it periodically so the last retirements do not linger.
+    void collect();
+
+    std::size_t activeChannels() const;
+
+private:
+    struct alignas(64) Reader {
+        std::atomic<std::uint64_t> seen{0};
+    };
+    struct Retired {
+        const Members *members;
+        std::uint64_t epoch;
+    };
+
+    void add(std::uint32_t channel, const boost::asio::ip::udp::endpoint &member);
+    void publish(std::uint32_t channel, const Members *members);
+    void reclaim();
+
+    std::size_t const max_channels_;
+    std::unique_ptr<std::atomic<const Members *>[]> channels_;
+    std::unique_ptr<Reader[]> readers_;
+    std::size_t const reader_count_;
+    std::atomic<std::uint64_t> epoch_{1};
+
+    mutable std::mutex mutex_;  // writers only
+    std::unordered_map<std::string, Membership> ids_;
+    std::vector<std::string> names_;          // by id, up to the highest id handed out
+    std::vector<std::uint32_t> free_ids_;
+    std::uint64_t next_generation_ = 1;
+    // Index of every member in its channel's current array, so removal is a
+    // swap with the last member instead of a search.
+    std::unordered_map<std::uint32_t, std::unordered_map<boost::asio::ip::udp::endpoint, std::size_t>> positions_;
+    std::vector<Retired> retired_;
+};
+
+#endif // RTP_CHANNEL_TABLE_HPP
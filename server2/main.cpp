@@ -1,13 +1,51 @@
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <thread>
 #include "server.hpp"
+#include "logger.hpp"
 
 int main(int /*argc*/, char * /*argv*/[]) { 
+    logging::options log_options;
+    log_options.level = logging::parse_severity(std::getenv("RTP_LOG_LEVEL"), log_options.level);
+    if (const char *file = std::getenv("RTP_LOG_FILE")) {
+        log_options.file = file;
+    }
+    logging::start(log_options);
     try {
-        RTPServer server(5004); 
+        // RTP_METRICS_PORT=0 turns the /metrics endpoint off.
+        int metrics_port = METRICS_PORT;
+        if (const char *env = std::getenv("RTP_METRICS_PORT")) {
+            metrics_port = std::atoi(env);
+        }
+        // RTP_THREADS sockets share the port via SO_REUSEPORT, one thread each.
+        std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        if (const char *env = std::getenv("RTP_THREADS")) {
+            threads = static_cast<std::size_t>(std::max(1, std::atoi(env)));
+        }
+        std::size_t max_clients = DEFAULT_MAX_CLIENTS;
+        if (const char *env = std::getenv("RTP_MAX_CLIENTS")) {
+            max_clients = static_cast<std::size_t>(std::max(1, std::atoi(env)));
+        }
+        // RTP_MAX_SPEAKERS=0 relays every voice in a channel.
+        std::size_t max_speakers = DEFAULT_MAX_SPEAKERS;
+        if (const char *env = std::getenv("RTP_MAX_SPEAKERS")) {
+            max_speakers = static_cast<std::size_t>(std::max(0, std::atoi(env)));
+        }
+        // Shared with chat_server, which issues the REGISTER tokens.
+        std::string voice_secret;
+        if (const char *env = std::getenv("CHAT_VOICE_SECRET")) {
+            voice_secret = env;
+        }
+        RTPServer server(RTP_PORT, static_cast<unsigned short>(metrics_port), threads, max_clients, max_speakers,
+                         voice_secret);
         server.run();
     } catch (const std::exception &e) {
+        logging::stop();
         std::cerr << "Fatal error: " + std::string(e.what()) << std::endl;
         return 1;
     }
+    logging::stop();
     return 0;
 }
\ No newline at end of file
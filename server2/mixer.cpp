@@ -0,0 +1,249 @@
+#include "mixer.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RTP_MIX_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+metrics::counter mix_frames{ "rtp_mix_frames_total",
+    "Frames mixed in mixing-mode channels." };
+metrics::counter jitter_dropped{ "rtp_jitter_dropped_total",
+    "Frames dropped by the mixer jitter buffers: late, duplicate or overrun." };
+
+} // namespace
+
+namespace mix {
+
+void accumulate(std::int32_t *acc, const std::int16_t *src, std::size_t n)
+{
+    std::size_t i = 0;
+#if defined(RTP_MIX_SSE2)
+    for (; i + 8 <= n; i += 8) {
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        // Sign-extend 8 int16 to two vectors of 4 int32.
+        __m128i const lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i const hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        __m128i *a = reinterpret_cast<__m128i *>(acc + i);
+        _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), lo));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), hi));
+    }
+#endif
+    for (; i < n; ++i) {
+        acc[i] += src[i];
+    }
+}
+
+void store(char *out, const std::int32_t *acc, const std::int16_t *minus, std::size_t n)
+{
+    std::size_t i = 0;
+#if defined(RTP_MIX_SSE2)
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + i + 4));
+        if (minus) {
+            __m128i const m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(minus + i));
+            lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(m, m), 16));
+            hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(m, m), 16));
+        }
+        // packs saturates to int16.
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i * 2), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < n; ++i) {
+        std::int32_t const v = acc[i] - (minus ? minus[i] : 0);
+        auto const s = static_cast<std::int16_t>(std::min<std::int32_t>(32767, std::max<std::int32_t>(-32768, v)));
+        std::memcpy(out + i * 2, &s, sizeof(s));
+    }
+}
+
+std::uint32_t level(const char *pcm, std::size_t n)
+{
+    if (n == 0) {
+        return 0;
+    }
+    std::uint64_t sum = 0;
+    std::size_t i = 0;
+#if defined(RTP_MIX_SSE2)
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const ones = _mm_set1_epi16(1);
+    __m128i acc = zero;
+    for (; i + 8 <= n; i += 8) {
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pcm + i * 2));
+        // |s| via max(s, -s); the saturating negate keeps -32768 at 32767.
+        __m128i const a = _mm_max_epi16(s, _mm_subs_epi16(zero, s));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(a, ones));
+    }
+    alignas(16) std::int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    sum = static_cast<std::uint64_t>(lanes[0]) + static_cast<std::uint64_t>(lanes[1]) +
+          static_cast<std::uint64_t>(lanes[2]) + static_cast<std::uint64_t>(lanes[3]);
+#endif
+    for (; i < n; ++i) {
+        std::int16_t s;
+        std::memcpy(&s, pcm + i * 2, sizeof(s));
+        sum += static_cast<std::uint64_t>(std::min(32767, std::abs(static_cast<int>(s))));
+    }
+    return static_cast<std::uint32_t>(sum / n);
+}
+
+} // namespace mix
+
+void JitterBuffer::push(std::uint16_t sequence, const char *pcm, std::size_t samples)
+{
+    samples = std::min(samples, MIX_FRAME_SAMPLES);
+    if (!started_) {
+        next_ = sequence;
+        started_ = true;
+    }
+    auto const ahead = static_cast<std::int16_t>(sequence - next_);
+    if (ahead < 0) {
+        jitter_dropped.inc();
+        return;
+    }
+    if (static_cast<std::size_t>(ahead) >= JITTER_SLOTS) {
+        // The sender is further ahead than we can hold: skip forward and
+        // drop whatever falls out of the window.
+        auto const first = static_cast<std::uint16_t>(sequence - JITTER_SLOTS + 1);
+        for (auto &slot : slots_) {
+            if (slot.full && static_cast<std::int16_t>(slot.sequence - first) < 0) {
+                slot.full = false;
+                --buffered_;
+                jitter_dropped.inc();
+            }
+        }
+        next_ = first;
+    }
+
+    Slot &slot = slots_[sequence % JITTER_SLOTS];
+    if (slot.full) {
+        jitter_dropped.inc();
+        return;
+    }
+    slot.full = true;
+    slot.sequence = sequence;
+    slot.samples = samples;
+    std::memcpy(slot.pcm.data(), pcm, samples * sizeof(std::int16_t));
+    std::fill(slot.pcm.begin() + static_cast<std::ptrdiff_t>(samples), slot.pcm.end(), 0);
+    ++buffered_;
+}
+
+const mix::Frame *JitterBuffer::pop(std::size_t &samples)
+{
+    if (!playing_) {
+        if (buffered_ < JITTER_PREFILL) {
+            return nullptr;
+        }
+        playing_ = true;
+    }
+    Slot &slot = slots_[next_ % JITTER_SLOTS];
+    ++next_;
+    if (!slot.full) {
+        if (buffered_ == 0) {
+            // End of a talk spurt: refill before playing the next one.
+            started_ = false;
+            playing_ = false;
+        }
+        return nullptr;
+    }
+    slot.full = false;
+    --buffered_;
+    samples = slot.samples;
+    return &slot.pcm;
+}
+
+ChannelMixer::ChannelMixer(std::uint32_t channel)
+    : channel_(channel)
+{
+    header_.flags = VOICE_FLAG_MIXED;
+    header_.channel = channel;
+}
+
+void ChannelMixer::push(const boost::asio::ip::udp::endpoint &from, const char *data, std::size_t size)
+{
+    VoiceHeader const h = readVoiceHeader(data);
+    std::size_t const samples = (size - VOICE_HEADER_SIZE) / sizeof(std::int16_t);
+    std::lock_guard<std::mutex> lock(mutex_);
+    Source &source = sources_[from];
+    source.idle = 0;
+    source.jitter.push(h.sequence, data + VOICE_HEADER_SIZE, samples);
+}
+
+void ChannelMixer::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    sources_.clear();
+    used_ = 0;
+}
+
+std::size_t ChannelMixer::mix()
+{
+    used_ = 0;
+    samples_ = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = sources_.begin(); it != sources_.end();) {
+            std::size_t samples = 0;
+            const mix::Frame *pcm = it->second.jitter.pop(samples);
+            if (!pcm) {
+                if (++it->second.idle >= SOURCE_IDLE_FRAMES) {
+                    it = sources_.erase(it);
+                } else {
+                    ++it;
+                }
+                continue;
+            }
+            if (used_ == contributions_.size()) {
+                contributions_.emplace_back();
+            }
+            Contribution &c = contributions_[used_++];
+            c.from = it->first;
+            c.pcm = *pcm;
+            samples_ = std::max(samples_, samples);
+            ++it;
+        }
+    }
+    if (used_ == 0) {
+        return 0;
+    }
+
+    std::fill_n(sum_.begin(), samples_, 0);
+    for (std::size_t i = 0; i < used_; ++i) {
+        mix::accumulate(sum_.data(), contributions_[i].pcm.data(), samples_);
+    }
+    ++header_.sequence;
+    header_.timestamp += static_cast<std::uint32_t>(samples_);
+    mix_frames.inc();
+    return samples_;
+}
+
+bool ChannelMixer::contributed(const boost::asio::ip::udp::endpoint &member) const
+{
+    for (std::size_t i = 0; i < used_; ++i) {
+        if (contributions_[i].from == member) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::size_t ChannelMixer::render(char *out, const boost::asio::ip::udp::endpoint *listener) const
+{
+    writeVoiceHeader(out, header_);
+    const std::int16_t *own = nullptr;
+    if (listener) {
+        for (std::size_t i = 0; i < used_; ++i) {
+            if (contributions_[i].from == *listener) {
+                own = contributions_[i].pcm.data();
+                break;
+            }
+        }
+    }
+    mix::store(out + VOICE_HEADER_SIZE, sum_.data(), own, samples_);
+    return VOICE_HEADER_SIZE + samples_ * sizeof(std::int16_t);
+}
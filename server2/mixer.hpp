@@ -0,0 +1,107 @@
+#ifndef RTP_MIXER_HPP
+#define RTP_MIXER_HPP
+
+#include "voice_packet.hpp"
+#include <boost/asio/ip/udp.hpp>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Same format the client captures and plays: mono 16-bit PCM, 1024-sample
+// frames at 44.1 kHz.
+const std::size_t MIX_SAMPLE_RATE = 44100;
+const std::size_t MIX_FRAME_SAMPLES = 1024;
+const std::chrono::nanoseconds MIX_FRAME_INTERVAL(1000000000LL * MIX_FRAME_SAMPLES / MIX_SAMPLE_RATE);
+
+const std::size_t JITTER_SLOTS = 8;          // frames buffered per source at most
+const std::size_t JITTER_PREFILL = 2;        // frames held before playout starts
+const unsigned SOURCE_IDLE_FRAMES = 100;     // ~2.3 s of silence drops a source
+
+namespace mix {
+
+typedef std::array<std::int16_t, MIX_FRAME_SAMPLES> Frame;
+
+// acc[i] += src[i]
+void accumulate(std::int32_t *acc, const std::int16_t *src, std::size_t n);
+// out[i] = saturate(acc[i] - minus[i]); minus may be null.
+void store(char *out, const std::int32_t *acc, const std::int16_t *minus, std::size_t n);
+// Mean absolute sample value of n samples of PCM, 0..32767.
+std::uint32_t level(const char *pcm, std::size_t n);
+
+} // namespace mix
+
+// Reorders one source's frames by sequence number and hands out one per mix
+// tick. Playout starts once JITTER_PREFILL frames are in; late frames are
+// dropped, and a source that runs dry starts over with the next packet.
+class JitterBuffer {
+public:
+    void push(std::uint16_t sequence, const char *pcm, std::size_t samples);
+    // Next frame in order, or null for a gap or while filling.
+    const mix::Frame *pop(std::size_t &samples);
+
+private:
+    struct Slot {
+        bool full = false;
+        std::uint16_t sequence = 0;
+        std::size_t samples = 0;
+        mix::Frame pcm;
+    };
+
+    std::array<Slot, JITTER_SLOTS> slots_;
+    std::size_t buffered_ = 0;
+    std::uint16_t next_ = 0;
+    bool started_ = false;
+    bool playing_ = false;
+};
+
+// Mixing mode of one channel: every member gets a single stream, the sum of
+// all current speakers minus their own voice, instead of one stream per
+// speaker. push() may be called from any shard; mix() and render() only from
+// the shard that owns the mixer.
+class ChannelMixer {
+public:
+    explicit ChannelMixer(std::uint32_t channel);
+
+    std::uint32_t channel() const noexcept { return channel_; }
+
+    void push(const boost::asio::ip::udp::endpoint &from, const char *data, std::size_t size);
+    // Drops every source, for a reused channel id. Owner shard only.
+    void clear();
+
+    // Takes one frame from every source and sums them. Returns the frame
+    // length in samples, 0 if nobody is speaking.
+    std::size_t mix();
+
+    bool contributed(const boost::asio::ip::udp::endpoint &member) const;
+
+    // Writes header and PCM of the current frame for listener (null: a
+    // member that did not speak). Returns the datagram size.
+    std::size_t render(char *out, const boost::asio::ip::udp::endpoint *listener) const;
+
+private:
+    struct Source {
+        JitterBuffer jitter;
+        unsigned idle = 0;
+    };
+    struct Contribution {
+        boost::asio::ip::udp::endpoint from;
+        mix::Frame pcm;
+    };
+
+    std::uint32_t const channel_;
+    std::mutex mutex_;  // sources_
+    std::unordered_map<boost::asio::ip::udp::endpoint, Source> sources_;
+
+    // Current frame, owner shard only.
+    std::vector<Contribution> contributions_;
+    std::size_t used_ = 0;
+    std::size_t samples_ = 0;
+    std::array<std::int32_t, MIX_FRAME_SAMPLES> sum_;
+    VoiceHeader header_;
+};
+
+#endif // RTP_MIXER_HPP
@@ -0,0 +1,76 @@
+#include "packet_pool.hpp"
+#include "metrics.hpp"
+
+namespace {
+
+metrics::gauge packet_buffers{ "rtp_packet_buffers",
+    "Packet buffers allocated by the shard pools." };
+
+} // namespace
+
+PacketRef::PacketRef(Packet *p) noexcept
+    : p_(p)
+{
+    p_->refs = 1;
+}
+
+PacketRef::PacketRef(const PacketRef &other) noexcept
+    : p_(other.p_)
+{
+    if (p_) {
+        ++p_->refs;
+    }
+}
+
+PacketRef::PacketRef(PacketRef &&other) noexcept
+    : p_(other.p_)
+{
+    other.p_ = nullptr;
+}
+
+PacketRef &PacketRef::operator=(PacketRef other) noexcept
+{
+    std::swap(p_, other.p_);
+    return *this;
+}
+
+PacketRef::~PacketRef()
+{
+    if (p_ && --p_->refs == 0) {
+        p_->pool->release(p_);
+    }
+}
+
+PacketPool::PacketPool()
+{
+    grow();
+}
+
+PacketRef PacketPool::acquire()
+{
+    if (free_.empty()) {
+        grow();
+    }
+    Packet *p = free_.back();
+    free_.pop_back();
+    p->size = 0;
+    return PacketRef(p);
+}
+
+void PacketPool::grow()
+{
+    chunks_.push_back(std::make_unique<Packet[]>(CHUNK));
+    free_.reserve(chunks_.size() * CHUNK);
+    Packet *chunk = chunks_.back().get();
+    for (std::size_t i = 0; i < CHUNK; ++i) {
+        chunk[i].pool = this;
+        free_.push_back(&chunk[i]);
+    }
+    packet_buffers.add(static_cast<std::int64_t>(CHUNK));
+}
+
+void PacketPool::release(Packet *p) noexcept
+{
+    // Capacity was reserved in grow(), so this cannot throw.
+    free_.push_back(p);
+}
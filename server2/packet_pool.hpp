@@ -0,0 +1,70 @@
+#ifndef RTP_PACKET_POOL_HPP
+#define RTP_PACKET_POOL_HPP
+
+#include <boost/asio/ip/udp.hpp>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+const int BUFFER_SIZE = 4096;
+
+class PacketPool;
+
+struct Packet {
+    std::array<char, BUFFER_SIZE> data;
+    std::size_t size = 0;
+    boost::asio::ip::udp::endpoint from;
+
+private:
+    friend class PacketPool;
+    friend class PacketRef;
+    PacketPool *pool = nullptr;
+    unsigned refs = 0;
+};
+
+// Shared handle to a pooled packet; the packet goes back to its pool when the
+// last handle is gone. Not thread-safe: a packet and all its handles stay on
+// the io_context thread of the shard that received it.
+class PacketRef {
+public:
+    PacketRef() = default;
+    PacketRef(const PacketRef &other) noexcept;
+    PacketRef(PacketRef &&other) noexcept;
+    PacketRef &operator=(PacketRef other) noexcept;
+    ~PacketRef();
+
+    Packet *operator->() const noexcept { return p_; }
+    Packet &operator*() const noexcept { return *p_; }
+    explicit operator bool() const noexcept { return p_ != nullptr; }
+    unsigned use_count() const noexcept { return p_ ? p_->refs : 0; }
+
+private:
+    friend class PacketPool;
+    explicit PacketRef(Packet *p) noexcept;
+
+    Packet *p_ = nullptr;
+};
+
+// Free list of packet buffers, grown in chunks and never shrunk, so the
+// steady state allocates nothing per packet.
+class PacketPool {
+public:
+    static constexpr std::size_t CHUNK = 256;
+
+    PacketPool();
+    PacketPool(const PacketPool &) = delete;
+    PacketPool &operator=(const PacketPool &) = delete;
+
+    PacketRef acquire();
+
+private:
+    friend class PacketRef;
+    void grow();
+    void release(Packet *p) noexcept;
+
+    std::vector<std::unique_ptr<Packet[]>> chunks_;
+    std::vector<Packet *> free_;
+};
+
+#endif // RTP_PACKET_POOL_HPP
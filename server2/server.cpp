@@ -1,223 +1,720 @@
 #include "server.hpp"
-#include <iostream>
+#include "logger.hpp"
+#include "metrics.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sstream>
 
-RTPServer::RTPServer(unsigned short port)
-    : socket_(io_context_, udp::endpoint(udp::v4(), port)),
-      cleanup_timer_(io_context_), 
-      strand_(boost::asio::make_strand(io_context_))
+namespace {
+
+metrics::counter packets_received{ "rtp_packets_received_total",
+    "Datagrams received, including control messages." };
+metrics::counter packets_relayed{ "rtp_packets_relayed_total",
+    "Audio datagrams sent to channel members." };
+metrics::counter bytes_relayed{ "rtp_bytes_relayed_total",
+    "Audio bytes sent to channel members." };
+metrics::counter packets_dropped{ "rtp_packets_dropped_total",
+    "Audio datagrams from endpoints not registered in the channel or with a foreign SSRC." };
+metrics::counter register_rejected{ "rtp_register_rejected_total",
+    "REGISTER requests with a missing, expired or forged token." };
+metrics::counter messages_invalid{ "rtp_messages_invalid_total",
+    "Datagrams of unknown type and REGISTER requests with a malformed channel name." };
+metrics::counter packets_suppressed{ "rtp_packets_suppressed_total",
+    "Audio datagrams not relayed: sender not among the channel's active speakers." };
+metrics::counter send_errors{ "rtp_send_errors_total",
+    "Failed sends." };
+metrics::counter recv_syscalls{ "rtp_recv_syscalls_total",
+    "recvmmsg/recvfrom calls, including ones that found nothing." };
+metrics::counter send_syscalls{ "rtp_send_syscalls_total",
+    "sendmmsg/sendto calls." };
+metrics::gauge clients_gauge{ "rtp_clients",
+    "Registered clients." };
+metrics::gauge channels_gauge{ "rtp_channels",
+    "Channels with at least one client." };
+
+// The message is built only when its level is enabled.
+#define RTP_LOG(message) CHAT_LOG(info, "rtp", {{ "event", std::string(message) }})
+#define RTP_LOG_ERROR(message) CHAT_LOG(warn, "rtp", {{ "error", std::string(message) }})
+
+#if defined(SO_REUSEPORT)
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+#endif
+
+} // namespace
+
+RTPServer::Shard::Shard(unsigned short port, bool reuse_port, std::size_t index)
+    : index(index),
+      socket(io_context),
+      cleanup_timer(io_context),
+      mix_timer(io_context)
 {
-    socket_.non_blocking(true);
-    startReceive();
-    startCleanupTimer(); 
+    socket.open(udp::v4());
+#if defined(SO_REUSEPORT)
+    if (reuse_port) {
+        socket.set_option(reuse_port_option(true));
+    }
+#else
+    (void)reuse_port;
+#endif
+    socket.bind(udp::endpoint(udp::v4(), port));
+    socket.non_blocking(true);
+}
+
+RTPServer::RTPServer(unsigned short port, unsigned short metrics_port,
+                     std::size_t threads, std::size_t max_clients, std::size_t max_speakers,
+                     const std::string &voice_secret)
+    : max_clients_(max_clients),
+      max_speakers_(max_speakers)
+{
+    if (!voice_secret.empty()) {
+        tokens_.emplace(voice_secret);
+    } else {
+        RTP_LOG("CHAT_VOICE_SECRET is not set, channels are open to anyone who knows their name");
+    }
+#if !defined(SO_REUSEPORT)
+    if (threads > 1) {
+        RTP_LOG_ERROR("SO_REUSEPORT is not supported on this platform, using one thread");
+        threads = 1;
+    }
+#endif
+    threads = std::max<std::size_t>(threads, 1);
+    channels_ = std::make_unique<ChannelTable>(MAX_CHANNELS, threads);
+    channel_state_.reset(new std::atomic<ChannelState *>[MAX_CHANNELS]);
+    for (std::size_t i = 0; i < MAX_CHANNELS; ++i) {
+        channel_state_[i].store(nullptr, std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+        shards_.push_back(std::make_unique<Shard>(port, threads > 1, i));
+    }
+    for (auto &shard : shards_) {
+        startReceive(*shard);
+        startCleanupTimer(*shard);
+    }
+    if (metrics_port != 0) {
+        metrics_acceptor_.emplace(shards_.front()->io_context, tcp::endpoint(tcp::v4(), metrics_port));
+        startMetricsAccept();
+    }
+    RTP_LOG("Listening on port " + std::to_string(port) + " with " + std::to_string(threads) +
+        " threads, up to " + std::to_string(max_clients_) + " clients");
 }
 
 void RTPServer::run()
 {
-    io_context_.run();
-}
-
-void RTPServer::startReceive() {
-    socket_.async_receive_from(
-        boost::asio::buffer(data_), remote_endpoint_,
-        boost::asio::bind_executor(strand_,
-            [this](const boost::system::error_code &error, std::size_t bytes_recvd) {
-                if (!error && bytes_recvd > 0) {
-                    handleReceive(bytes_recvd);
-                } else if (error) {
-                    logError("Receive error: " + error.message());
-                }
-                startReceive();
-            }));
+    std::vector<std::thread> threads;
+    for (std::size_t i = 1; i < shards_.size(); ++i) {
+        threads.emplace_back([shard = shards_[i].get()] { shard->io_context.run(); });
+    }
+    shards_.front()->io_context.run();
+    for (auto &t : threads) {
+        t.join();
+    }
 }
 
-void RTPServer::handleReceive(std::size_t bytes_recvd) {
-    if (bytes_recvd >= 4 && std::string(data_.data(), 4) == "PING") {
-        log("Received PING from " + remote_endpoint_.address().to_string());
-        sendToClient(remote_endpoint_, "PONG", 4);
-        return;
+#if defined(RTP_HAVE_MMSG)
+RTPServer::Batch::Batch(PacketPool &pool)
+{
+    for (std::size_t i = 0; i < RECV_BATCH; ++i) {
+        msgs[i].msg_hdr = msghdr{};
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        arm(i, pool.acquire());
     }
+}
 
-    if (bytes_recvd >= 8 && std::string(data_.data(), 8) == "REGISTER") {
-        if (bytes_recvd > 9) {
-            std::string channel(data_.data() + 9, bytes_recvd - 9);
-            handleClientRegistration(validateChannelName(channel));
+void RTPServer::Batch::arm(std::size_t i, PacketRef packet)
+{
+    packets[i] = std::move(packet);
+    iov[i].iov_base = packets[i]->data.data();
+    iov[i].iov_len = BUFFER_SIZE;
+    msgs[i].msg_hdr.msg_name = packets[i]->from.data();
+}
+
+// Waits for readiness and then drains the socket RECV_BATCH datagrams per
+// recvmmsg call. A few rounds at most, so timers and the metrics endpoint on
+// the same io_context still get their turn under flood.
+void RTPServer::startReceive(Shard &shard) {
+    shard.socket.async_wait(udp::socket::wait_read,
+        [this, &shard](const boost::system::error_code &error) {
+            if (error == boost::asio::error::operation_aborted) {
+                return;
+            }
+            if (error) {
+                RTP_LOG_ERROR("Receive error: " + error.message());
+            } else {
+                receiveBatch(shard);
+            }
+            channels_->quiescent(shard.index);
+            startReceive(shard);
+        });
+}
+
+void RTPServer::receiveBatch(Shard &shard) {
+    auto &batch = shard.batch;
+    int const fd = shard.socket.native_handle();
+    for (int round = 0; round < 8; ++round) {
+        for (std::size_t i = 0; i < RECV_BATCH; ++i) {
+            batch.msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(batch.packets[i]->from.capacity());
+        }
+        int const n = ::recvmmsg(fd, batch.msgs.data(), RECV_BATCH, MSG_DONTWAIT, nullptr);
+        recv_syscalls.inc();
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                RTP_LOG_ERROR("recvmmsg failed: " + std::string(std::strerror(errno)));
+            }
+            return;
+        }
+        for (std::size_t i = 0; i < static_cast<std::size_t>(n); ++i) {
+            auto &packet = batch.packets[i];
+            packet->size = batch.msgs[i].msg_len;
+            packet->from.resize(batch.msgs[i].msg_hdr.msg_namelen);
+            handleReceive(shard, packet);
+            // Still referenced by a pending send: leave it to that and
+            // receive into a fresh buffer.
+            if (packet.use_count() > 1) {
+                batch.arm(i, shard.pool.acquire());
+            }
+        }
+        if (static_cast<std::size_t>(n) < RECV_BATCH) {
+            return;
+        }
+    }
+}
+#else
+void RTPServer::startReceive(Shard &shard) {
+    PacketRef packet = shard.pool.acquire();
+    Packet &p = *packet;
+    shard.socket.async_receive_from(
+        boost::asio::buffer(p.data), p.from,
+        [this, &shard, packet = std::move(packet)](const boost::system::error_code &error, std::size_t bytes_recvd) {
+            recv_syscalls.inc();
+            if (!error && bytes_recvd > 0) {
+                packet->size = bytes_recvd;
+                handleReceive(shard, packet);
+            } else if (error) {
+                RTP_LOG_ERROR("Receive error: " + error.message());
+            }
+            channels_->quiescent(shard.index);
+            startReceive(shard);
+        });
+}
+#endif
+
+void RTPServer::handleReceive(Shard &shard, const PacketRef &packet) {
+    packets_received.inc();
+    const char *data = packet->data.data();
+    const std::size_t bytes_recvd = packet->size;
+    const udp::endpoint &from = packet->from;
+    if (isVoicePacket(data, bytes_recvd)) {
+        const std::uint32_t channel = voiceChannel(data);
+        auto client_it = shard.clients.find(from);
+        if (client_it == shard.clients.end() || client_it->second.channel != channel) {
+            packets_dropped.inc();
+            CHAT_LOG_EVERY(100, debug, "audio from a non-member", {{ "channel", channel }});
+            return;
+        }
+        Client &client = client_it->second;
+        // Admission was checked once at REGISTER; from then on a packet only
+        // has to come from that endpoint with the stream's SSRC.
+        const std::uint32_t ssrc = voiceSsrc(data);
+        if (!client.ssrc_pinned) {
+            client.ssrc = ssrc;
+            client.ssrc_pinned = true;
+        } else if (client.ssrc != ssrc) {
+            packets_dropped.inc();
+            CHAT_LOG_EVERY(100, debug, "audio with a foreign ssrc", {{ "channel", channel }});
+            return;
+        }
+        touchClient(shard, client);
+
+        // Registration created it before the client could get here.
+        ChannelState &state = *channel_state_[channel].load(std::memory_order_acquire);
+        if (state.speakers) {
+            auto const now = steady_clock::now();
+            // Fast attack, slow release (~8 frames).
+            std::uint32_t const level = mix::level(data + VOICE_HEADER_SIZE,
+                (bytes_recvd - VOICE_HEADER_SIZE) / sizeof(std::int16_t));
+            client.level = level > client.level ? (client.level + level) / 2
+                                                : client.level - client.level / 8 + level / 8;
+            bool const speech = (readVoiceHeader(data).flags & VOICE_FLAG_SPEECH) || client.level >= SPEECH_LEVEL;
+            if (!state.speakers->admit(from, client.level, speech, now)) {
+                packets_suppressed.inc();
+                return;
+            }
+        }
+        if (ChannelMixer *mixer = state.mixer.load(std::memory_order_acquire)) {
+            mixer->push(from, data, bytes_recvd);
         } else {
-            logError("Invalid REGISTER message - missing channel name");
-            sendToClient(remote_endpoint_, "ERROR:INVALID_CHANNEL", 20);
+            broadcast(shard, packet, channel);
         }
         return;
     }
 
-    if (bytes_recvd >= 6 && std::string(data_.data(), 6) == "AUDIO ") {
-        size_t space_pos = std::find(data_.data() + 6, data_.data() + bytes_recvd, ' ') - data_.data();
-        if (space_pos < bytes_recvd) {
-            std::string channel(data_.data() + 6, space_pos - 6);
-            channel = validateChannelName(channel);
-            
-            if (!channel.empty()) {
-                std::lock_guard<std::mutex> lock(clients_mutex_);
-                auto now = steady_clock::now();
-                auto &cl_time = clients_[remote_endpoint_].first;
-                cl_time = now;
-                clients_[remote_endpoint_].second = channel;
+    if (bytes_recvd >= 4 && std::string(data, 4) == "PING") {
+        CHAT_LOG(trace, "ping", {{ "from", from.address().to_string() }});
+        sendToClient(shard, from, "PONG", 4);
+        return;
+    }
 
-                broadcast(data_.data(), bytes_recvd, remote_endpoint_, channel);
+    // REGISTER <channel> [<token>] [MIX]
+    if (bytes_recvd >= 8 && std::string(data, 8) == "REGISTER") {
+        if (bytes_recvd > 9) {
+            std::istringstream words(std::string(data + 9, bytes_recvd - 9));
+            std::string channel, word, token;
+            bool mix = false;
+            words >> channel;
+            while (words >> word) {
+                if (word == "MIX") {
+                    mix = true;
+                } else {
+                    token = word;
+                }
             }
+            handleClientRegistration(shard, validateChannelName(channel, from), token, from, mix);
+        } else {
+            messages_invalid.inc();
+            CHAT_LOG_EVERY(100, warn, "register without a channel name", {{ "from", from.address().to_string() }});
+            sendToClient(shard, from, "ERROR:INVALID_CHANNEL", 20);
         }
         return;
     }
 
-    logError("Unknown message type from " + remote_endpoint_.address().to_string());
+    messages_invalid.inc();
+    CHAT_LOG_EVERY(100, warn, "unknown message type", {{ "from", from.address().to_string() }});
 }
 
-std::string RTPServer::validateChannelName(const std::string& channel) {
+std::string RTPServer::validateChannelName(const std::string& channel, const udp::endpoint &from) {
     if (channel.empty() || channel.length() > MAX_CHANNEL_LENGTH) {
-        logError("Invalid channel length from " + remote_endpoint_.address().to_string());
+        messages_invalid.inc();
+        CHAT_LOG_EVERY(100, warn, "invalid channel length", {{ "from", from.address().to_string() }});
         return "";
     }
 
     if (!std::all_of(channel.begin(), channel.end(), [](char c) {
         return std::isalnum(c) || c == '-' || c == '_';
     })) {
-        logError("Invalid channel characters from " + remote_endpoint_.address().to_string());
+        messages_invalid.inc();
+        CHAT_LOG_EVERY(100, warn, "invalid channel characters", {{ "from", from.address().to_string() }});
         return "";
     }
 
     return channel;
 }
 
-void RTPServer::handleClientRegistration(const std::string& channel) {
-    if (channel.empty()) {
-        sendToClient(remote_endpoint_, "ERROR:INVALID_CHANNEL", 20);
+void RTPServer::handleClientRegistration(Shard &shard, const std::string& name, const std::string &token,
+                                         const udp::endpoint &from, bool mix) {
+    if (name.empty()) {
+        sendToClient(shard, from, "ERROR:INVALID_CHANNEL", 20);
         return;
     }
-
-    std::lock_guard<std::mutex> lock(clients_mutex_);
-    auto client_it = clients_.find(remote_endpoint_);
-    bool is_new_client = (client_it == clients_.end());
-
-    if (is_new_client) {
-        if (clients_.size() >= MAX_CLIENTS) {
-            logError("Max clients reached (" + std::to_string(MAX_CLIENTS) + ")");
-            sendToClient(remote_endpoint_, "ERROR:SERVER_FULL", 16);
+    std::uint32_t user = 0;
+    if (tokens_) {
+        auto const verified = tokens_->verify(token, name, std::time(nullptr));
+        if (!verified) {
+            register_rejected.inc();
+            CHAT_LOG_EVERY(100, warn, "register without a valid token",
+                {{ "from", from.address().to_string() }, { "channel", name }});
+            sendToClient(shard, from, "ERROR:UNAUTHORIZED", 18);
             return;
         }
+        user = *verified;
+    }
+    auto client_it = shard.clients.find(from);
+    bool is_new_client = (client_it == shard.clients.end());
+    if (is_new_client && client_count_.fetch_add(1) >= max_clients_) {
+        client_count_.fetch_sub(1);
+        CHAT_LOG_EVERY(100, warn, "max clients reached", {{ "limit", max_clients_ }});
+        sendToClient(shard, from, "ERROR:SERVER_FULL", 16);
+        return;
+    }
+    // Every client is in one channel, so live channel ids are bounded by
+    // max_clients: a sender cycling through names keeps releasing the last.
+    auto const membership = channels_->join(name, from);
+    if (!membership) {
+        if (is_new_client) {
+            client_count_.fetch_sub(1);
+        }
+        CHAT_LOG_EVERY(100, warn, "max channels reached", {{ "limit", MAX_CHANNELS }});
+        sendToClient(shard, from, "ERROR:SERVER_FULL", 16);
+        return;
+    }
+    const std::uint32_t channel = membership->id;
+    ChannelState &state = channelState(*membership);
+    if (mix) {
+        enableMixing(state, channel);
+    }
+    std::string reply_suffix = " " + std::to_string(channel);
+    if (state.mixer.load(std::memory_order_acquire)) {
+        reply_suffix += " MIX";
+    }
 
-        clients_[remote_endpoint_] = {steady_clock::now(), channel};
-        channels_[channel].push_back(remote_endpoint_);
-        log("New client registered: " + remote_endpoint_.address().to_string() + 
-            " to channel: " + channel);
-        sendToClient(remote_endpoint_, "REGISTERED", 10);
+    if (is_new_client) {
+        Client &client = shard.clients[from];
+        client.endpoint = from;
+        client.channel = channel;
+        client.user = user;
+        touchClient(shard, client);
+        RTP_LOG("New client registered: " + from.address().to_string() + 
+            " to channel: " + name + reply_suffix);
+        reply(shard, from, "REGISTERED" + reply_suffix);
     } else {
-        auto& old_channel = client_it->second.second;
+        const std::uint32_t old_channel = client_it->second.channel;
 
         if (old_channel != channel) {
-            auto& old_channel_clients = channels_[old_channel];
-            old_channel_clients.erase(
-                std::remove(old_channel_clients.begin(), old_channel_clients.end(), remote_endpoint_),
-                old_channel_clients.end());
-
-            client_it->second = {steady_clock::now(), channel};
-            channels_[channel].push_back(remote_endpoint_);
-            log("Client changed channel: " + remote_endpoint_.address().to_string() + 
-                " from " + old_channel + " to " + channel);
-            sendToClient(remote_endpoint_, "RE-REGISTERED", 13);
-        } else {
-            client_it->second.first = steady_clock::now();
-            sendToClient(remote_endpoint_, "RE-REGISTERED", 13);
+            channels_->remove(old_channel, {from});
+
+            RTP_LOG("Client changed channel: " + from.address().to_string() + 
+                " from " + std::to_string(old_channel) + " to " + name + reply_suffix);
+            client_it->second.channel = channel;
+            client_it->second.level = 0;
         }
+        // A re-register may come from a restarted client with a new SSRC.
+        client_it->second.user = user;
+        client_it->second.ssrc_pinned = false;
+        touchClient(shard, client_it->second);
+        reply(shard, from, "RE-REGISTERED" + reply_suffix);
     }
 
-    log("Active clients: " + std::to_string(clients_.size()) + 
-        ", Channel " + channel + " clients: " + 
-        std::to_string(channels_[channel].size()));
+    const ChannelTable::Members *members = channels_->members(channel);
+    RTP_LOG("Active clients: " + std::to_string(client_count_.load()) + 
+        ", Channel " + name + " clients: " + 
+        std::to_string(members ? members->size() : 0));
 }
 
-void RTPServer::broadcast(const char *data, std::size_t length, const udp::endpoint &sender, const std::string& channel) {
-    std::lock_guard<std::mutex> lock(clients_mutex_);
-    
-    auto channel_it = channels_.find(channel);
-    if (channel_it == channels_.end()) {
-        logError("XYITA " + channel);
+RTPServer::ChannelState &RTPServer::channelState(const ChannelTable::Membership &channel) {
+    ChannelState *state = channel_state_[channel.id].load(std::memory_order_acquire);
+    if (state && state->generation.load(std::memory_order_acquire) == channel.generation) {
+        return *state;
+    }
+    std::lock_guard<std::mutex> lock(channel_state_mutex_);
+    state = channel_state_[channel.id].load(std::memory_order_relaxed);
+    if (!state) {
+        channel_state_storage_.push_back(std::make_unique<ChannelState>());
+        state = channel_state_storage_.back().get();
+        if (max_speakers_ > 0) {
+            state->speakers = std::make_unique<SpeakerSelector>(max_speakers_);
+        }
+        channel_state_[channel.id].store(state, std::memory_order_release);
+    }
+    if (state->generation.load(std::memory_order_relaxed) != channel.generation) {
+        // The id belonged to a channel that has emptied: forget its speakers
+        // and its mixing mode. The mixer stays on its shard's list, detached,
+        // and is emptied there so a frame in progress is not torn.
+        if (state->speakers) {
+            state->speakers->clear();
+        }
+        if (ChannelMixer *mixer = state->mixer.exchange(nullptr, std::memory_order_acq_rel)) {
+            boost::asio::post(shards_[channel.id % shards_.size()]->io_context, [mixer] { mixer->clear(); });
+        }
+        state->generation.store(channel.generation, std::memory_order_release);
+    }
+    return *state;
+}
+
+// A channel switches to mixing for as long as it exists: the first
+// REGISTER ... MIX creates its mixer, and the shard channel % threads mixes
+// it. A later channel with the same id reuses the mixer.
+void RTPServer::enableMixing(ChannelState &state, std::uint32_t channel) {
+    std::lock_guard<std::mutex> lock(channel_state_mutex_);
+    if (state.mixer.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (state.mixer_owner) {
+        state.mixer.store(state.mixer_owner.get(), std::memory_order_release);
+        RTP_LOG("Channel " + std::to_string(channel) + " switched to mixing");
         return;
     }
-    int counter = 0;
-    for (const auto &client : channel_it->second) {
-        std::cout << ++counter << "\n";
+    state.mixer_owner = std::make_unique<ChannelMixer>(channel);
+    ChannelMixer *mixer = state.mixer_owner.get();
+    state.mixer.store(mixer, std::memory_order_release);
+
+    Shard &owner = *shards_[channel % shards_.size()];
+    boost::asio::post(owner.io_context, [this, &owner, mixer] {
+        owner.mixers.push_back(mixer);
+        if (owner.mixers.size() == 1) {
+            owner.next_mix = steady_clock::now();
+            startMixTimer(owner);
+        }
+    });
+    RTP_LOG("Channel " + std::to_string(channel) + " switched to mixing");
+}
+
+void RTPServer::reply(Shard &shard, const udp::endpoint &to, const std::string &text) {
+    PacketRef packet = shard.pool.acquire();
+    packet->size = std::min(text.size(), packet->data.size());
+    std::memcpy(packet->data.data(), text.data(), packet->size);
+    sendToClient(shard, to, packet);
+}
+
+// A channel's members can be spread over every shard. They are all sent to
+// from this shard's socket: every shard is bound to the same port, so to the
+// client it is the same server.
+void RTPServer::broadcast(Shard &shard, const PacketRef &packet, std::uint32_t channel) {
+    const ChannelTable::Members *members = channels_->members(channel);
+    if (!members) {
+        return;
+    }
+    const udp::endpoint &sender = packet->from;
+    auto &recipients = shard.recipients;
+    recipients.clear();
+    for (const auto &client : *members) {
         if (client != sender) {
-            sendToClient(client, data, length);
+            recipients.push_back(client);
+        }
+    }
+    sendToMany(shard, packet);
+}
+
+#if defined(RTP_HAVE_MMSG)
+// One sendmmsg for the whole recipient list (in UIO_MAXIOV chunks); the
+// kernel has copied the payload when it returns. A recipient that fails is
+// skipped. If the socket buffer is full the rest go out as async sends that
+// keep the packet until they complete.
+void RTPServer::sendToMany(Shard &shard, const PacketRef &packet) {
+    auto const &recipients = shard.recipients;
+    const std::size_t length = packet->size;
+    auto &msgs = shard.send_msgs;
+    std::size_t const n = recipients.size();
+    if (msgs.size() < n) {
+        msgs.resize(n);
+    }
+    iovec iov{ packet->data.data(), length };
+    for (std::size_t i = 0; i < n; ++i) {
+        msgs[i].msg_hdr = msghdr{};
+        msgs[i].msg_hdr.msg_name = const_cast<sockaddr *>(recipients[i].data());
+        msgs[i].msg_hdr.msg_namelen = static_cast<socklen_t>(recipients[i].size());
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int const fd = shard.socket.native_handle();
+    std::size_t sent = 0;
+    std::size_t i = 0;
+    while (i < n) {
+        unsigned int const chunk = static_cast<unsigned int>(std::min<std::size_t>(n - i, UIO_MAXIOV));
+        int const r = ::sendmmsg(fd, &msgs[i], chunk, MSG_DONTWAIT);
+        send_syscalls.inc();
+        if (r > 0) {
+            i += static_cast<std::size_t>(r);
+            sent += static_cast<std::size_t>(r);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
         }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            for (; i < n; ++i) {
+                sendToClient(shard, recipients[i], packet);
+            }
+            break;
+        }
+        send_errors.inc();
+        CHAT_LOG_EVERY(100, warn, "sendmmsg failed", {{ "error", std::strerror(errno) }});
+        ++i;
+    }
+    packets_relayed.inc(sent);
+    bytes_relayed.inc(sent * length);
+}
+#else
+void RTPServer::sendToMany(Shard &shard, const PacketRef &packet) {
+    for (const auto &client : shard.recipients) {
+        sendToClient(shard, client, packet);
+        packets_relayed.inc();
+        bytes_relayed.inc(packet->size);
     }
 }
+#endif
 
-void RTPServer::sendToClient(const udp::endpoint &client, const char *data, std::size_t length)
+// data must outlive the send: used for constant replies only.
+void RTPServer::sendToClient(Shard &shard, const udp::endpoint &client, const char *data, std::size_t length)
 {
-    socket_.async_send_to(
+    send_syscalls.inc();
+    shard.socket.async_send_to(
         boost::asio::buffer(data, length), client,
-        boost::asio::bind_executor(strand_,
-            [this, client](const boost::system::error_code &error, std::size_t bytes_sent) {
-                (void)bytes_sent;
-                if (error) {
-                    logError("Error sending to " + client.address().to_string() +
-                            ":" + std::to_string(client.port()) +
-                            " - " + error.message());
-                }
-            }));
+        [this, client](const boost::system::error_code &error, std::size_t) {
+            if (error) {
+                onSendError(client, error);
+            }
+        });
 }
 
-void RTPServer::startCleanupTimer() {
-    cleanup_timer_.expires_after(seconds(CLIENT_TIMEOUT_SEC));
-    cleanup_timer_.async_wait(
-        boost::asio::bind_executor(strand_,
-            [this](const boost::system::error_code &error) {
-                if (!error) {
-                    cleanupInactiveClients();
-                    startCleanupTimer();
-                }
-            }));
+void RTPServer::sendToClient(Shard &shard, const udp::endpoint &client, const PacketRef &packet)
+{
+    send_syscalls.inc();
+    shard.socket.async_send_to(
+        boost::asio::buffer(packet->data.data(), packet->size), client,
+        [this, client, packet](const boost::system::error_code &error, std::size_t) {
+            if (error) {
+                onSendError(client, error);
+            }
+        });
 }
 
-void RTPServer::cleanupInactiveClients() {
-    std::lock_guard<std::mutex> lock(clients_mutex_);
-    auto now = steady_clock::now();
-    size_t removed = 0;
+void RTPServer::onSendError(const udp::endpoint &client, const boost::system::error_code &error)
+{
+    send_errors.inc();
+    RTP_LOG_ERROR("Error sending to " + client.address().to_string() +
+            ":" + std::to_string(client.port()) +
+            " - " + error.message());
+}
 
-    for (auto it = clients_.begin(); it != clients_.end();) {
-        if (duration_cast<seconds>(now - it->second.first).count() > CLIENT_TIMEOUT_SEC) {
-            log("Removing inactive client: " +
-                it->first.address().to_string() + ":" +
-                std::to_string(it->first.port()));
+void RTPServer::startMixTimer(Shard &shard) {
+    shard.next_mix += MIX_FRAME_INTERVAL;
+    shard.mix_timer.expires_at(shard.next_mix);
+    shard.mix_timer.async_wait(
+        [this, &shard](const boost::system::error_code &error) {
+            if (!error) {
+                mixChannels(shard);
+                startMixTimer(shard);
+            }
+        });
+}
 
-            auto& channel_clients = channels_[it->second.second];
-            channel_clients.erase(
-                std::remove(channel_clients.begin(), channel_clients.end(), it->first),
-                channel_clients.end());
+// One frame per mixing channel: members that spoke get the mix without their
+// own voice, everybody else shares one packet and one sendmmsg.
+void RTPServer::mixChannels(Shard &shard) {
+    for (ChannelMixer *mixer : shard.mixers) {
+        // Detached: its channel emptied and the id went to a channel that
+        // does not mix.
+        if (channel_state_[mixer->channel()].load(std::memory_order_acquire)->mixer.load(std::memory_order_acquire) != mixer) {
+            continue;
+        }
+        if (mixer->mix() == 0) {
+            continue;
+        }
+        const ChannelTable::Members *members = channels_->members(mixer->channel());
+        if (!members) {
+            continue;
+        }
+        auto &recipients = shard.recipients;
+        recipients.clear();
+        for (const auto &member : *members) {
+            if (!mixer->contributed(member)) {
+                recipients.push_back(member);
+                continue;
+            }
+            PacketRef own = shard.pool.acquire();
+            own->size = mixer->render(own->data.data(), &member);
+            sendToClient(shard, member, own);
+            packets_relayed.inc();
+            bytes_relayed.inc(own->size);
+        }
+        if (!recipients.empty()) {
+            PacketRef shared = shard.pool.acquire();
+            shared->size = mixer->render(shared->data.data(), nullptr);
+            sendToMany(shard, shared);
+        }
+    }
+}
 
-            if (channel_clients.empty()) {
-                channels_.erase(it->second.second);
+// Moves the client to the slot CLIENT_TIMEOUT_SEC + 1 ticks ahead. Between
+// ticks the deadline does not change, so most packets only compare it.
+void RTPServer::touchClient(Shard &shard, Client &client) {
+    std::uint64_t const deadline = shard.tick + CLIENT_TIMEOUT_SEC + 1;
+    if (client.deadline == deadline) {
+        return;
+    }
+    if (client.deadline != 0) {
+        unscheduleClient(shard, client);
+    }
+    auto &slot = shard.expiry[deadline % EXPIRY_SLOTS];
+    client.deadline = deadline;
+    client.slot_index = slot.size();
+    slot.push_back(&client);
+}
+
+void RTPServer::unscheduleClient(Shard &shard, Client &client) {
+    auto &slot = shard.expiry[client.deadline % EXPIRY_SLOTS];
+    Client *last = slot.back();
+    slot[client.slot_index] = last;
+    last->slot_index = client.slot_index;
+    slot.pop_back();
+}
+
+void RTPServer::startCleanupTimer(Shard &shard) {
+    shard.cleanup_timer.expires_after(seconds(1));
+    shard.cleanup_timer.async_wait(
+        [this, &shard](const boost::system::error_code &error) {
+            if (!error) {
+                // Also keeps an idle shard from holding up reclamation.
+                channels_->quiescent(shard.index);
+                cleanupInactiveClients(shard);
+                startCleanupTimer(shard);
             }
+        });
+}
 
-            it = clients_.erase(it);
-            removed++;
-        } else {
-            ++it;
-        }
+// Advances the wheel by one tick. Everyone left in the new slot was last
+// heard from CLIENT_TIMEOUT_SEC + 1 ticks ago: the work is the number of
+// expiries, not the number of clients.
+void RTPServer::cleanupInactiveClients(Shard &shard) {
+    ++shard.tick;
+    auto &due = shard.expiry[shard.tick % EXPIRY_SLOTS];
+    size_t const removed = due.size();
+    std::unordered_map<std::uint32_t, std::vector<udp::endpoint>> expired;
+
+    for (Client *client : due) {
+        udp::endpoint const endpoint = client->endpoint;
+        RTP_LOG("Removing inactive client: " +
+            endpoint.address().to_string() + ":" +
+            std::to_string(endpoint.port()));
+        expired[client->channel].push_back(endpoint);
+        shard.clients.erase(endpoint);
+    }
+    due.clear();
+
+    // One copy of each channel's member array, however many left it.
+    for (const auto &channel : expired) {
+        channels_->remove(channel.first, channel.second);
     }
+    channels_->collect();
 
     if (removed > 0) {
-        log("Removed " + std::to_string(removed) + " inactive clients");
-        log("Active clients: " + std::to_string(clients_.size()));
+        client_count_.fetch_sub(removed);
+        RTP_LOG("Removed " + std::to_string(removed) + " inactive clients");
+        RTP_LOG("Active clients: " + std::to_string(client_count_.load()));
     }
 }
 
-void RTPServer::log(const std::string &message) {
-    auto now = system_clock::to_time_t(system_clock::now());
-    std::cout << "[SERVER][" << std::put_time(std::localtime(&now), "%T") << "] "
-              << message << std::endl;
+void RTPServer::startMetricsAccept() {
+    metrics_acceptor_->async_accept(
+        [this](const boost::system::error_code &error, tcp::socket socket) {
+            if (!error) {
+                serveMetrics(std::make_shared<tcp::socket>(std::move(socket)));
+            } else if (error == boost::asio::error::operation_aborted) {
+                return;
+            }
+            startMetricsAccept();
+        });
 }
 
-void RTPServer::logError(const std::string &message) {
-    auto now = system_clock::to_time_t(system_clock::now());
-    std::cerr << "[SERVER][" << std::put_time(std::localtime(&now), "%T") << "] ERROR: "
-              << message << std::endl;
+// Minimal HTTP/1.0-style responder for Prometheus: one GET per connection.
+void RTPServer::serveMetrics(std::shared_ptr<tcp::socket> socket) {
+    auto request = std::make_shared<std::string>();
+    boost::asio::async_read_until(*socket, boost::asio::dynamic_buffer(*request, 8192), "\r\n\r\n",
+        [this, socket, request](const boost::system::error_code &error, std::size_t) {
+            if (error) {
+                return;
+            }
+            std::ostringstream body;
+            std::string status = "200 OK";
+            if (request->compare(0, 13, "GET /metrics ") == 0) {
+                clients_gauge.set(static_cast<std::int64_t>(client_count_.load()));
+                channels_gauge.set(static_cast<std::int64_t>(channels_->activeChannels()));
+                metrics::render(body);
+            } else {
+                status = "404 Not Found";
+            }
+            std::string const text = body.str();
+            auto response = std::make_shared<std::string>(
+                "HTTP/1.1 " + status + "\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(text.size()) + "\r\n"
+                "Connection: close\r\n\r\n" + text);
+            boost::asio::async_write(*socket, boost::asio::buffer(*response),
+                [socket, response](const boost::system::error_code &, std::size_t) {
+                    boost::system::error_code ignored;
+                    socket->shutdown(tcp::socket::shutdown_both, ignored);
+                });
+        });
 }
\ No newline at end of file
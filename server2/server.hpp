@@ -2,51 +2,156 @@
 #define RTP_SERVER_HPP
 
 #include <boost/asio.hpp>
+#include "channel_table.hpp"
+#include "mixer.hpp"
+#include "packet_pool.hpp"
+#include "speakers.hpp"
+#include "voice_packet.hpp"
+#include "voice_token.hpp"
 #include <unordered_map>
-#include <mutex>
 #include <utility>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <chrono>
-#include <iomanip>
 #include <memory>
 #include <cctype>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Batched datagram I/O (recvmmsg/sendmmsg); elsewhere one Asio operation per
+// datagram.
+#if defined(__linux__)
+#define RTP_HAVE_MMSG 1
+#include <sys/socket.h>
+#endif
 
 using boost::asio::ip::udp;
+using boost::asio::ip::tcp;
 using namespace std::chrono;
 
 const int RTP_PORT = 5004;
-const int BUFFER_SIZE = 4096;
+const int METRICS_PORT = 5005;
 const int CLIENT_TIMEOUT_SEC = 10;
-const int MAX_CLIENTS = 50;
+const int DEFAULT_MAX_CLIENTS = 10000;
 const int MAX_CHANNEL_LENGTH = 64;
+const std::size_t MAX_CHANNELS = 65536;
+const std::size_t RECV_BATCH = 32;
+// Client expiry: one wheel slot per second, enough slots for a full timeout.
+const std::size_t EXPIRY_SLOTS = 16;
+static_assert(EXPIRY_SLOTS > CLIENT_TIMEOUT_SEC + 1, "expiry wheel too small for the timeout");
 
 class RTPServer {
 public:
-    RTPServer(unsigned short port);
+    // threads > 1 binds one SO_REUSEPORT socket per thread (a shard). The
+    // kernel picks the shard by source address, so a client always lands on
+    // the same one. metrics_port 0 disables the HTTP /metrics endpoint.
+    // max_speakers: voices relayed per channel at once, 0 for all of them.
+    // voice_secret: CHAT_VOICE_SECRET of the chat server; when set, REGISTER
+    // needs a token it issued for the channel.
+    RTPServer(unsigned short port, unsigned short metrics_port = 0,
+              std::size_t threads = 1, std::size_t max_clients = DEFAULT_MAX_CLIENTS,
+              std::size_t max_speakers = DEFAULT_MAX_SPEAKERS, const std::string &voice_secret = "");
 
+    // Runs shard 0 on the calling thread and the others on their own.
     void run();
-    void startReceive();
-    void handleReceive(std::size_t bytes_recvd);
-    std::string validateChannelName(const std::string& channel);
-    void handleClientRegistration(const std::string& channel);
-    void broadcast(const char *data, std::size_t length, const udp::endpoint &sender, const std::string& channel);
-    void sendToClient(const udp::endpoint &client, const char *data, std::size_t length);
-    void startCleanupTimer();
-    void cleanupInactiveClients();
 
 private:
-    void log(const std::string &message);
-    void logError(const std::string &message);
-
-    boost::asio::io_context io_context_;
-    udp::socket socket_;
-    udp::endpoint remote_endpoint_;
-    std::array<char, BUFFER_SIZE> data_;
-    std::unordered_map<udp::endpoint, std::pair<steady_clock::time_point, std::string>> clients_;
-    std::unordered_map<std::string, std::vector<udp::endpoint>> channels_;
-    std::mutex clients_mutex_;
-    boost::asio::steady_timer cleanup_timer_;
-    boost::asio::strand<boost::asio::any_io_executor> strand_;
+#if defined(RTP_HAVE_MMSG)
+    struct Batch {
+        explicit Batch(PacketPool &pool);
+        void arm(std::size_t i, PacketRef packet);
+
+        std::array<PacketRef, RECV_BATCH> packets;
+        std::array<iovec, RECV_BATCH> iov;
+        std::array<mmsghdr, RECV_BATCH> msgs;
+    };
+#endif
+
+    struct Client {
+        udp::endpoint endpoint;
+        std::uint32_t channel;
+        std::uint32_t user = 0;      // from the token, 0 without one
+        std::uint32_t ssrc = 0;      // pinned by the first voice packet
+        bool ssrc_pinned = false;
+        std::uint32_t level = 0;     // smoothed, for SpeakerSelector
+        std::uint64_t deadline = 0;  // expiry tick
+        std::size_t slot_index = 0;  // position in its expiry slot
+    };
+
+    // Created at an id's first registration and never freed, so the packet
+    // path reads it unlocked. A reused id is reset by the first registration
+    // of the new generation, before any of its members gets a reply; the
+    // channel was empty until then, so no packet path holds the old state.
+    struct ChannelState {
+        std::atomic<std::uint64_t> generation{0};
+        std::unique_ptr<SpeakerSelector> speakers;  // null: relay every voice
+        std::atomic<ChannelMixer *> mixer{nullptr};  // null: not mixing
+        std::unique_ptr<ChannelMixer> mixer_owner;   // kept across generations
+    };
+
+    struct Shard {
+        Shard(unsigned short port, bool reuse_port, std::size_t index);
+
+        std::size_t const index;  // reader slot in the channel table
+        PacketPool pool;  // outlives the handlers io_context destroys
+        boost::asio::io_context io_context;
+        udp::socket socket;
+#if defined(RTP_HAVE_MMSG)
+        Batch batch{pool};
+        std::vector<mmsghdr> send_msgs;
+#endif
+        std::vector<udp::endpoint> recipients;  // scratch for broadcast()
+        // Clients the kernel routes to this shard. Only this shard's thread
+        // touches them, so no lock.
+        std::unordered_map<udp::endpoint, Client> clients;
+        // Hashed timer wheel over clients: slot deadline % EXPIRY_SLOTS holds
+        // the clients that expire at that tick unless heard from again.
+        std::array<std::vector<Client *>, EXPIRY_SLOTS> expiry;
+        std::uint64_t tick = 0;
+        boost::asio::steady_timer cleanup_timer;
+        // Mixing-mode channels this shard mixes and sends, one tick per frame.
+        std::vector<ChannelMixer *> mixers;
+        boost::asio::steady_timer mix_timer;
+        steady_clock::time_point next_mix;
+    };
+
+    void startReceive(Shard &shard);
+#if defined(RTP_HAVE_MMSG)
+    void receiveBatch(Shard &shard);
+#endif
+    void handleReceive(Shard &shard, const PacketRef &packet);
+    std::string validateChannelName(const std::string& channel, const udp::endpoint &from);
+    void handleClientRegistration(Shard &shard, const std::string& name, const std::string &token,
+                                  const udp::endpoint &from, bool mix);
+    ChannelState &channelState(const ChannelTable::Membership &channel);
+    void enableMixing(ChannelState &state, std::uint32_t channel);
+    void startMixTimer(Shard &shard);
+    void mixChannels(Shard &shard);
+    void reply(Shard &shard, const udp::endpoint &to, const std::string &text);
+    void broadcast(Shard &shard, const PacketRef &packet, std::uint32_t channel);
+    void sendToMany(Shard &shard, const PacketRef &packet);
+    void sendToClient(Shard &shard, const udp::endpoint &client, const char *data, std::size_t length);
+    void sendToClient(Shard &shard, const udp::endpoint &client, const PacketRef &packet);
+    void onSendError(const udp::endpoint &client, const boost::system::error_code &error);
+    void touchClient(Shard &shard, Client &client);
+    void unscheduleClient(Shard &shard, Client &client);
+    void startCleanupTimer(Shard &shard);
+    void cleanupInactiveClients(Shard &shard);
+    void startMetricsAccept();
+    void serveMetrics(std::shared_ptr<tcp::socket> socket);
+
+    std::size_t const max_clients_;
+    std::atomic<std::size_t> client_count_{0};
+    std::size_t const max_speakers_;
+    std::optional<VoiceTokenVerifier> tokens_;  // unset: channels are open
+    std::unique_ptr<ChannelTable> channels_;
+    std::unique_ptr<std::atomic<ChannelState *>[]> channel_state_;
+    std::mutex channel_state_mutex_;
+    std::vector<std::unique_ptr<ChannelState>> channel_state_storage_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::optional<tcp::acceptor> metrics_acceptor_;
 };
 
-#endif // RTP_SERVER_HPP
\ No newline at end of file
+#endif // RTP_SERVER_HPP
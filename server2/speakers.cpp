@@ -0,0 +1,52 @@
+#include "speakers.hpp"
+#include <algorithm>
+
+SpeakerSelector::SpeakerSelector(std::size_t max_speakers)
+    : max_(max_speakers)
+{
+    active_.reserve(max_);
+}
+
+void SpeakerSelector::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_.clear();
+}
+
+bool SpeakerSelector::admit(const boost::asio::ip::udp::endpoint &from, std::uint32_t level, bool speech,
+                            std::chrono::steady_clock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_.erase(std::remove_if(active_.begin(), active_.end(),
+        [now](const Speaker &s) { return now - s.last_speech > SPEAKER_HANGOVER; }),
+        active_.end());
+
+    for (auto &s : active_) {
+        if (s.endpoint == from) {
+            s.level = level;
+            if (speech) {
+                s.last_speech = now;
+            }
+            return true;
+        }
+    }
+    if (!speech) {
+        return false;
+    }
+    if (active_.size() < max_) {
+        active_.push_back({ from, level, now, now });
+        return true;
+    }
+
+    Speaker *weakest = nullptr;
+    for (auto &s : active_) {
+        if (now - s.since >= SPEAKER_MIN_HOLD && (!weakest || s.level < weakest->level)) {
+            weakest = &s;
+        }
+    }
+    if (weakest && level > weakest->level * SPEAKER_PREEMPT_RATIO) {
+        *weakest = { from, level, now, now };
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,48 @@
+#ifndef RTP_SPEAKERS_HPP
+#define RTP_SPEAKERS_HPP
+
+#include <boost/asio/ip/udp.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+const std::size_t DEFAULT_MAX_SPEAKERS = 4;
+const std::uint32_t SPEECH_LEVEL = 300;                             // mean |sample|, about -40 dBFS
+const std::chrono::milliseconds SPEAKER_HANGOVER(400);              // slot kept through short pauses
+const std::chrono::milliseconds SPEAKER_MIN_HOLD(1000);             // before a louder voice may take it
+const std::uint32_t SPEAKER_PREEMPT_RATIO = 2;                      // 6 dB louder than the weakest
+
+// The top-K active speakers of one channel; only their packets are relayed.
+//
+// A source with speech (VAD flag or level above SPEECH_LEVEL) takes a free
+// slot. With all slots taken it replaces the quietest speaker only when it is
+// SPEAKER_PREEMPT_RATIO times louder and that speaker has held its slot for
+// SPEAKER_MIN_HOLD. A speaker keeps its slot, silence included, until it has
+// been quiet for SPEAKER_HANGOVER. Called from every shard, so locked, but
+// only for a few entries.
+class SpeakerSelector {
+public:
+    explicit SpeakerSelector(std::size_t max_speakers);
+
+    // level is the sender's smoothed level; true if this packet is relayed.
+    bool admit(const boost::asio::ip::udp::endpoint &from, std::uint32_t level, bool speech,
+               std::chrono::steady_clock::time_point now);
+    // Forgets every speaker, for a reused channel id.
+    void clear();
+
+private:
+    struct Speaker {
+        boost::asio::ip::udp::endpoint endpoint;
+        std::uint32_t level;
+        std::chrono::steady_clock::time_point since;
+        std::chrono::steady_clock::time_point last_speech;
+    };
+
+    std::size_t const max_;
+    std::mutex mutex_;
+    std::vector<Speaker> active_;
+};
+
+#endif // RTP_SPEAKERS_HPP
@@ -0,0 +1,95 @@
+#ifndef RTP_VOICE_PACKET_HPP
+#define RTP_VOICE_PACKET_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Audio datagram header, shared by the relay and the client. 16 bytes,
+// big-endian:
+//
+//   0       magic (VOICE_MAGIC)
+//   1       flags (VOICE_FLAG_*)
+//   2..3    sequence number, +1 per packet
+//   4..7    timestamp, in samples
+//   8..11   SSRC, picked at random by the sender
+//   12..15  channel id, from the "REGISTERED <id>" reply
+//
+// followed by the payload (mono 16-bit PCM). Control messages (PING,
+// REGISTER and the replies) stay text and never start with the magic byte.
+const std::uint8_t VOICE_MAGIC = 0xA5;
+const std::size_t VOICE_HEADER_SIZE = 16;
+
+// Set by senders that run voice activity detection on speech frames; the
+// relay measures the level of everything else.
+const std::uint8_t VOICE_FLAG_SPEECH = 0x01;
+// Set by the relay on frames it mixed itself (SSRC 0, one stream per
+// listener).
+const std::uint8_t VOICE_FLAG_MIXED = 0x02;
+
+struct VoiceHeader {
+    std::uint8_t flags = 0;
+    std::uint16_t sequence = 0;
+    std::uint32_t timestamp = 0;
+    std::uint32_t ssrc = 0;
+    std::uint32_t channel = 0;
+};
+
+namespace voice_detail {
+
+inline std::uint32_t load32(const char *p)
+{
+    auto const *u = reinterpret_cast<const unsigned char *>(p);
+    return (std::uint32_t(u[0]) << 24) | (std::uint32_t(u[1]) << 16) |
+           (std::uint32_t(u[2]) << 8) | std::uint32_t(u[3]);
+}
+
+inline void store32(char *p, std::uint32_t v)
+{
+    p[0] = static_cast<char>(v >> 24);
+    p[1] = static_cast<char>(v >> 16);
+    p[2] = static_cast<char>(v >> 8);
+    p[3] = static_cast<char>(v);
+}
+
+} // namespace voice_detail
+
+inline bool isVoicePacket(const char *data, std::size_t size)
+{
+    return size >= VOICE_HEADER_SIZE && static_cast<std::uint8_t>(data[0]) == VOICE_MAGIC;
+}
+
+// The relay only needs the channel; callers check isVoicePacket() first.
+inline std::uint32_t voiceChannel(const char *data)
+{
+    return voice_detail::load32(data + 12);
+}
+
+inline std::uint32_t voiceSsrc(const char *data)
+{
+    return voice_detail::load32(data + 8);
+}
+
+inline VoiceHeader readVoiceHeader(const char *data)
+{
+    VoiceHeader h;
+    h.flags = static_cast<std::uint8_t>(data[1]);
+    h.sequence = static_cast<std::uint16_t>(
+        (static_cast<unsigned char>(data[2]) << 8) | static_cast<unsigned char>(data[3]));
+    h.timestamp = voice_detail::load32(data + 4);
+    h.ssrc = voice_detail::load32(data + 8);
+    h.channel = voice_detail::load32(data + 12);
+    return h;
+}
+
+inline void writeVoiceHeader(char *data, const VoiceHeader &h)
+{
+    data[0] = static_cast<char>(VOICE_MAGIC);
+    data[1] = static_cast<char>(h.flags);
+    data[2] = static_cast<char>(h.sequence >> 8);
+    data[3] = static_cast<char>(h.sequence);
+    voice_detail::store32(data + 4, h.timestamp);
+    voice_detail::store32(data + 8, h.ssrc);
+    voice_detail::store32(data + 12, h.channel);
+}
+
+#endif // RTP_VOICE_PACKET_HPP
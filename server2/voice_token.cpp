@@ -0,0 +1,56 @@
+#include "voice_token.hpp"
+#include <cryptopp/hex.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/misc.h>
+#include <cryptopp/sha.h>
+#include <cstdlib>
+#include <utility>
+
+VoiceTokenVerifier::VoiceTokenVerifier(std::string secret)
+    : secret_(std::move(secret))
+{
+}
+
+std::optional<std::uint32_t> VoiceTokenVerifier::verify(const std::string &token, const std::string &channel,
+                                                        std::time_t now) const
+{
+    auto const user_end = token.find('.');
+    auto const mac_begin = token.rfind('.');
+    if (user_end == std::string::npos || mac_begin == user_end) {
+        return std::nullopt;
+    }
+    auto const expiry_begin = token.rfind('.', mac_begin - 1);
+    if (expiry_begin == user_end ||
+        token.compare(user_end + 1, expiry_begin - user_end - 1, channel) != 0) {
+        return std::nullopt;
+    }
+
+    char *end = nullptr;
+    std::string const user = token.substr(0, user_end);
+    unsigned long const user_id = std::strtoul(user.c_str(), &end, 10);
+    if (user.empty() || *end != '\0') {
+        return std::nullopt;
+    }
+    std::string const expiry = token.substr(expiry_begin + 1, mac_begin - expiry_begin - 1);
+    long long const expires = std::strtoll(expiry.c_str(), &end, 10);
+    if (expiry.empty() || *end != '\0' || expires < now) {
+        return std::nullopt;
+    }
+
+    CryptoPP::byte mac[CryptoPP::HMAC<CryptoPP::SHA256>::DIGESTSIZE];
+    CryptoPP::HMAC<CryptoPP::SHA256> hmac(
+        reinterpret_cast<const CryptoPP::byte *>(secret_.data()), secret_.size());
+    hmac.CalculateDigest(mac, reinterpret_cast<const CryptoPP::byte *>(token.data()), mac_begin);
+    std::string expected;
+    CryptoPP::StringSource(mac, sizeof(mac), true,
+        new CryptoPP::HexEncoder(new CryptoPP::StringSink(expected), false));
+
+    std::size_t const given = token.size() - mac_begin - 1;
+    if (given != expected.size() ||
+        !CryptoPP::VerifyBufsEqual(reinterpret_cast<const CryptoPP::byte *>(expected.data()),
+                                   reinterpret_cast<const CryptoPP::byte *>(token.data() + mac_begin + 1),
+                                   given)) {
+        return std::nullopt;
+    }
+    return static_cast<std::uint32_t>(user_id);
+}
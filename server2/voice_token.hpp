@@ -0,0 +1,28 @@
+#ifndef RTP_VOICE_TOKEN_HPP
+#define RTP_VOICE_TOKEN_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <string>
+
+// Checks the channel admission tokens chat_server hands out (topic 23):
+//
+//   <user id>.<channel>.<expiry, unix seconds>.<hex HMAC-SHA256 of the rest>
+//
+// keyed with CHAT_VOICE_SECRET, which both servers share. Channel names
+// cannot contain '.', so the fields split unambiguously.
+class VoiceTokenVerifier {
+public:
+    explicit VoiceTokenVerifier(std::string secret);
+
+    // The user the token was issued to, if it is intact, unexpired and was
+    // issued for channel.
+    std::optional<std::uint32_t> verify(const std::string &token, const std::string &channel,
+                                        std::time_t now) const;
+
+private:
+    std::string const secret_;
+};
+
+#endif // RTP_VOICE_TOKEN_HPP